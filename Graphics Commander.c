@@ -16,14 +16,31 @@
 #include <getopt.h>
 #include <termios.h>
 #include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/epoll.h>
 #include <pthread.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <limits.h>
 
 // X11支持
 #ifdef USE_X11
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#ifdef USE_XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+#endif
 #endif
 
 // Wayland支持
@@ -31,12 +48,28 @@
 #include <wayland-client.h>
 #endif
 
+// DRM/KMS扫描输出捕获
+#ifdef USE_DRM
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <drm_fourcc.h>
+#endif
+
+// 字符单元协议压缩
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+
 #define VERSION "2.0.0"
 #define MAX_BUFFERS 10
 #define MAX_DISPLAYS 10
 #define UNICODE_CHARS 256
 #define COLOR_TABLE_SIZE 256
 
+static const char* color_mode_names[] = {"none", "basic", "256", "true", "gray"};
+static const char* charset_names[] = {"simple", "blocks", "half", "braille", "art", "quadrant", "sextant"};
+static const char* sampling_names[] = {"point", "area", "linear"};
+
 // Unicode字符密度级别
 static const char* unicode_blocks[] = {
     // 完整方块
@@ -51,6 +84,25 @@ static const char* unicode_blocks[] = {
     "⣿"
 };
 
+// 四分块字符，按掩码索引: 位0左上、位1右上、位2左下、位3右下为前景
+static const char* quadrant_glyphs[16] = {
+    " ", "▘", "▝", "▀", "▖", "▌", "▞", "▛",
+    "▗", "▚", "▐", "▜", "▄", "▙", "▟", "█"
+};
+
+// 六分块字符 (U+1FB00起)，按掩码索引: 位0/1为上行左/右，位2/3中行，位4/5下行。
+// 空白、左半、右半和全块没有六分块字符，用已有的方块字符
+static const char* sextant_glyphs[64] = {
+    " ", "🬀", "🬁", "🬂", "🬃", "🬄", "🬅", "🬆",
+    "🬇", "🬈", "🬉", "🬊", "🬋", "🬌", "🬍", "🬎",
+    "🬏", "🬐", "🬑", "🬒", "🬓", "▌", "🬔", "🬕",
+    "🬖", "🬗", "🬘", "🬙", "🬚", "🬛", "🬜", "🬝",
+    "🬞", "🬟", "🬠", "🬡", "🬢", "🬣", "🬤", "🬥",
+    "🬦", "🬧", "▐", "🬨", "🬩", "🬪", "🬫", "🬬",
+    "🬭", "🬮", "🬯", "🬰", "🬱", "🬲", "🬳", "🬴",
+    "🬵", "🬶", "🬷", "🬸", "🬹", "🬺", "🬻", "█"
+};
+
 // ANSI颜色代码
 typedef struct {
     int code;
@@ -58,16 +110,38 @@ typedef struct {
     char bg[16];
 } AnsiColor;
 
-// 像素格式
+// 像素格式：8位通道的格式按内存字节顺序命名，其余按像素值 (本机字节序) 的位布局命名。
+// 数值写入录制文件，只能在末尾追加
 typedef enum {
     PIXFMT_RGB565 = 0,
     PIXFMT_RGB888,
     PIXFMT_BGR888,
     PIXFMT_RGBA8888,
     PIXFMT_BGRA8888,
+    PIXFMT_ARGB8888,
+    PIXFMT_ABGR8888,
+    PIXFMT_RGB555,          // xRRRRRGGGGGBBBBB，也用于ARGB1555
+    PIXFMT_BGR565,
+    PIXFMT_XRGB2101010,
+    PIXFMT_BITFIELD,        // 没有专用解码的布局，按GraphicsBuffer.layout的位域通用解码
+    PIXFMT_PALETTE8,        // 8位调色板索引，经layout.palette查表
     PIXFMT_UNKNOWN
 } PixelFormat;
 
+// 通道位域，与fb_bitfield含义相同
+typedef struct {
+    uint8_t offset;
+    uint8_t length;
+} PixelField;
+
+typedef struct {
+    int bytes;              // 每像素字节数
+    PixelField red;
+    PixelField green;
+    PixelField blue;
+    const uint32_t* palette;    // PIXFMT_PALETTE8的256色查找表 (0xRRGGBB)，由源持有
+} PixelLayout;
+
 // 颜色模式
 typedef enum {
     COLOR_NONE = 0,
@@ -83,20 +157,65 @@ typedef enum {
     CHARSET_BLOCKS = 1,
     CHARSET_HALF = 2,
     CHARSET_BRAILLE = 3,
-    CHARSET_ART = 4
+    CHARSET_ART = 4,
+    CHARSET_QUADRANT = 5,       // 每单元2x2像素，选最优的四分块字形和前景/背景色
+    CHARSET_SEXTANT = 6         // 每单元2x3像素，按亮度分两组映射为六分块字形
 } CharsetMode;
 
+#define CHARSET_COUNT 7
+
+// 采样方式：每个字符单元取一个像素，或对覆盖的像素求平均 (sRGB值直接平均/线性光下平均)
+typedef enum {
+    SAMPLING_POINT = 0,
+    SAMPLING_AREA = 1,
+    SAMPLING_LINEAR = 2
+} SamplingMode;
+
 // 服务器类型
 typedef enum {
     SERVER_FRAMEBUFFER = 0,
     SERVER_X11 = 1,
     SERVER_WAYLAND = 2,
     SERVER_VNC = 3,
-    SERVER_RDP = 4
+    SERVER_RDP = 4,
+    SERVER_FILE = 5,
+    SERVER_REPLAY = 6
 } ServerType;
 
-// 图形缓冲区
+// 像素矩形，用于记录源的变化区域
+#define MAX_DAMAGE_RECTS 64
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} DamageRect;
+
+// 捕获源能力
+enum {
+    CAPTURE_CAP_DAMAGE = 1 << 0,    // acquire_frame报告变化区域，可只转换受影响的字符单元
+    CAPTURE_CAP_ZERO_COPY = 1 << 1, // buffer直接映射源内存，取帧不拷贝像素
+    CAPTURE_CAP_EVENTS = 1 << 2,    // acquire_frame在源内等待变化，静止时没有新帧
+    CAPTURE_CAP_TIMED = 1 << 3      // 源自带时间轴 (回放)，按源的节奏出帧
+};
+
+typedef struct GraphicsBuffer GraphicsBuffer;
+
+// 捕获源接口：按设备名选择实现，所有采集路径只通过这些操作访问源
 typedef struct {
+    const char* name;
+    const char* usage;              // 设备名格式，用于帮助和设备列表
+    ServerType type;
+    unsigned int caps;
+    int (*probe)(const char* device);                   // 设备名是否由该源处理
+    int (*open)(GraphicsBuffer* buf, const char* device);
+    int (*acquire_frame)(GraphicsBuffer* buf);          // 更新buffer和damage，-1表示源已结束；NULL表示内容实时更新
+    void (*release_frame)(GraphicsBuffer* buf);         // 调用方用完当前帧，可为NULL
+    void (*close)(GraphicsBuffer* buf);
+} CaptureSource;
+
+// 图形缓冲区
+struct GraphicsBuffer {
     char device[64];
     int fd;
     void *buffer;
@@ -106,8 +225,368 @@ typedef struct {
     int bpp;
     int line_length;
     PixelFormat format;
+    PixelLayout layout;     // format为PIXFMT_BITFIELD时的位域
     ServerType type;
-} GraphicsBuffer;
+    void *map_base;         // mmap起始地址 (文件源中buffer指向当前帧)
+    size_t map_size;
+    int frame_count;        // 文件源中的帧数
+    int frame_index;        // 当前帧序号
+    void *priv;             // 源私有状态 (回放状态、VNC连接等)
+    DamageRect damage[MAX_DAMAGE_RECTS];    // 自上一帧以来变化的像素区域
+    int damage_count;       // -1表示不跟踪变化，整帧重新转换
+    const CaptureSource* source;
+    unsigned int caps;      // 实际可用的能力 (打开时可按运行环境去掉部分)
+};
+
+// 调色板帧缓冲区：FBIOGETCMAP读出的颜色表及由它生成的查找表
+typedef struct {
+    uint16_t red[256];
+    uint16_t green[256];
+    uint16_t blue[256];
+    uint32_t lut[256];      // 0xRRGGBB
+    int valid;
+} FbPalette;
+
+// 原始帧文件头 (小端)，其后紧跟frame_count帧，每帧stride*height字节
+#define RAW_FRAME_MAGIC "GCRF"
+typedef struct {
+    char magic[4];          // "GCRF"
+    uint32_t version;       // 1
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // 每行字节数
+    uint32_t format;        // PixelFormat
+    uint32_t bpp;
+    uint32_t frame_count;   // 0表示按文件大小推算
+} RawFrameHeader;
+
+// 录制容器 (小端): 文件头 + 帧记录(关键帧/XOR差分帧，RLE压缩) + 尾部索引
+#define RECORD_MAGIC "GCRC"
+#define RECORD_INDEX_MAGIC "GCIX"
+#define RECORD_QUEUE_DEPTH 4
+#define RECORD_KEYFRAME_INTERVAL 60
+
+enum {
+    RECORD_KEYFRAME = 1,
+    RECORD_DELTA = 2
+};
+
+typedef struct {
+    char magic[4];          // "GCRC"
+    uint32_t version;       // 1
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;        // 每行字节数 (紧凑排列)
+    uint32_t format;        // PixelFormat
+    uint32_t bpp;
+    uint32_t layout;        // PIXFMT_BITFIELD的位域 (pixel_layout_pack)，其余格式为0
+} RecordHeader;
+
+typedef struct {
+    uint32_t type;          // RECORD_KEYFRAME / RECORD_DELTA
+    uint32_t raw_size;      // 解压后字节数
+    uint32_t comp_size;     // 压缩数据字节数
+    uint32_t reserved;
+    uint64_t timestamp_us;  // 相对录制开始的时间
+} RecordFrameHeader;
+
+typedef struct {
+    uint64_t offset;        // 帧记录在文件中的偏移
+    uint64_t timestamp_us;
+    uint32_t type;
+    uint32_t reserved;
+} RecordIndexEntry;
+
+typedef struct {
+    char magic[4];          // "GCIX"
+    uint32_t count;
+    uint64_t index_offset;
+} RecordFooter;
+
+// 录制器：捕获线程只拷贝帧到队列，压缩和写盘在独立线程完成
+typedef struct {
+    FILE* fp;
+    RecordHeader header;
+    size_t frame_size;
+    unsigned char* slots[RECORD_QUEUE_DEPTH];
+    uint64_t stamps[RECORD_QUEUE_DEPTH];
+    atomic_ulong head;      // 捕获线程写入位置
+    atomic_ulong tail;      // 写盘线程读取位置
+    unsigned char* prev;    // 上一帧，用于XOR差分
+    unsigned char* delta;
+    unsigned char* packed;
+    RecordIndexEntry* index;
+    size_t index_count;
+    size_t index_capacity;
+    uint64_t offset;
+    struct timespec start;
+    long frames_written;
+    atomic_long frames_dropped;
+    int write_error;        // 写盘失败后不再写入，停止时报告
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} FrameRecorder;
+
+// 回放状态：容器整体mmap，按索引解码到frame
+typedef struct {
+    const unsigned char* map;
+    size_t map_size;
+    RecordIndexEntry* index;
+    int count;
+    int current;            // 已解码的帧序号 (-1=无)
+    unsigned char* frame;
+    double speed;           // 0=最大速度
+    uint64_t seek_us;
+    struct timespec start;
+} ReplayState;
+
+// asciicast v2 录制：渲染线程把已输出的缓冲区交给写盘线程，不重新编码
+#define ASCIICAST_QUEUE_DEPTH 64    // 初始容量，写盘跟不上时加倍
+
+typedef struct {
+    const char* prefix;     // 缓冲区之前输出的固定序列
+    char* data;             // 输出缓冲区 (所有权转移给写盘线程)
+    size_t len;
+    uint64_t time_us;
+} AsciicastEvent;
+
+typedef struct {
+    FILE* fp;
+    AsciicastEvent* queue;
+    unsigned long capacity;
+    unsigned long head;
+    unsigned long tail;
+    long events_written;
+    long events_merged;     // 无法扩容时并入上一个事件的次数
+    int stop;
+    struct timespec start;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} AsciicastWriter;
+
+// 预编码的字形：UTF-8字节 (不足4字节补0) 和长度；输出时整体写入4字节再前进len
+typedef struct {
+    char bytes[4];
+    uint8_t len;
+} Glyph;
+
+// 字符单元：转换流水线各阶段 (采样→调整→量化→字形→编码) 的中间结果
+typedef struct {
+    uint8_t r, g, b;        // 采样颜色 (调整后原地覆盖)
+    uint8_t luma;           // 亮度
+    uint8_t r2, g2, b2;     // 第二种颜色 (四分块/六分块模式的背景色)
+    uint8_t mask;           // 四分块/六分块模式的前景像素掩码
+    uint32_t fg;            // 量化后的前景色: 调色板索引或0xRRGGBB
+    uint32_t bg;            // 量化后的背景色
+    const Glyph* glyph;     // 字符
+} TextCell;
+
+typedef struct {
+    int cols;
+    int rows;
+    TextCell* cells;
+} CellFrame;
+
+// 字符单元矩形 [x0,x1) x [y0,y1)
+typedef struct {
+    int x0, y0, x1, y1;
+} CellRect;
+
+// 对数线性延迟直方图：每个2的幂区间分为8个线性子桶，无锁计数
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    atomic_ulong counts[HIST_BUCKETS];
+    atomic_ulong total;
+    atomic_ulong sum;
+    atomic_ulong max;
+} LatencyHistogram;
+
+// 流水线阶段
+typedef enum {
+    STAGE_SNAPSHOT = 0,     // 获取源帧
+    STAGE_CONVERT,          // 采样/调整/量化/字形
+    STAGE_ENCODE,           // 生成ANSI
+    STAGE_WRITE,            // 写终端
+    STAGE_COUNT
+} PipelineStage;
+
+// 登记的工作线程，用于按线程统计CPU时间
+#define METRICS_MAX_THREADS 32
+
+typedef struct {
+    char name[24];
+    clockid_t clock;
+    atomic_int active;
+} MetricsThread;
+
+// 源分辨率，按源下标登记
+typedef struct {
+    char device[64];
+    atomic_int width;
+    atomic_int height;
+} MetricsSource;
+
+typedef struct {
+    LatencyHistogram stages[STAGE_COUNT];   // 单位ns
+    LatencyHistogram frame_bytes;           // 每帧输出字节数
+    atomic_ulong frames;
+    atomic_ulong frames_dropped;            // 错过的帧时刻
+    atomic_ulong bytes_total;
+    MetricsThread threads[METRICS_MAX_THREADS];
+    atomic_int thread_count;
+    MetricsSource sources[MAX_BUFFERS];
+} PipelineMetrics;
+
+// Prometheus文本格式的指标服务 (Unix套接字或回环端口)
+typedef struct {
+    int listen_fd;
+    char unix_path[108];
+    pthread_t thread;
+    volatile int running;
+} MetricsServer;
+
+// 广播服务：一次捕获编码，发送给所有连接的查看端
+#define SERVE_MAX_CLIENTS 64
+
+// 多个客户端共享的一帧输出，引用计数归零时释放
+typedef struct {
+    int refs;
+    size_t len;
+    char data[];
+} SharedChunk;
+
+typedef struct {
+    int fd;                 // -1表示空闲槽位
+    SharedChunk* pending;   // 正在发送的帧
+    size_t offset;
+    int need_keyframe;      // 下一帧发送完整帧
+    int want_write;         // 已注册EPOLLOUT
+    unsigned long resyncs;
+} ServeClient;
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    ServeClient clients[SERVE_MAX_CLIENTS];
+    int client_count;
+} FanoutServer;
+
+// 二进制字符单元协议 (小端序)
+// 每条消息: 16字节头 + 负载；负载为若干变化区间:
+//   u32 起始单元下标, u16 单元数, 之后是各单元记录
+// 单元记录: u32 字符码位 + 颜色 (真彩色各3字节, 调色板各1字节, 无色0字节)
+// 第2版起码位为32位以容纳六分块等辅助平面字形；消息类型随版本更换，
+// 旧版(类型1/2, 16位码位)的消息会被拒绝而不是被错误解析
+#define CELL_MSG_HEADER_SIZE 16
+#define CELL_MSG_KEYFRAME 3
+#define CELL_MSG_DELTA 4
+#define CELL_FLAG_ZLIB 0x01
+#define CELL_SPAN_MAX 65535
+#define CELL_MAX_CELLS (1 << 20)    // 接收端接受的最大单元数
+#define CELL_KEYFRAME_INTERVAL 100  // 每隔多少帧发送一次完整帧
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint8_t color_mode;
+    uint8_t charset;
+    uint16_t cols;
+    uint16_t rows;
+    uint32_t raw_size;      // 解压后负载字节数
+    uint32_t size;          // 随后的负载字节数
+} CellMessageHeader;
+
+// 按绝对时刻控制帧率
+typedef struct {
+    uint64_t interval_ns;
+    uint64_t next_ns;
+} FramePacer;
+
+// 帧转换上下文：保留上一帧的字符单元，用于统计变化的单元
+typedef struct {
+    CellFrame frames[2];
+    int current;            // frames中本帧的下标
+    int have_previous;
+    int previous_valid;     // 另一份字符单元是否为有效的上一帧 (可编码增量)
+    int dirty_cells;        // 最近一次转换中变化的字符单元数
+} FrameConverter;
+
+// Sixel输出：按每字符8x16像素换算图像尺寸，每条带6行像素
+#define SIXEL_CELL_WIDTH 8
+#define SIXEL_CELL_HEIGHT 16
+#define SIXEL_MAX_COLORS 256
+#define SIXEL_MAX_WORKERS 8
+#define SIXEL_HIST_SIZE 32768       // 每通道5位的颜色直方图
+
+typedef struct {
+    char* data;             // 本条带的sixel数据
+    size_t len;
+    size_t capacity;
+    uint8_t used[SIXEL_MAX_COLORS / 8];     // 本条带用到的颜色
+} SixelBand;
+
+// Sixel编码器：调色板在画面稳定时跨帧沿用，只重发变化的条带，条带由工作线程并行编码
+typedef struct {
+    int width;
+    int height;
+    int band_count;
+    TextCell* pixels;               // 采样结果
+    uint8_t* index;                 // 本帧各像素的调色板下标
+    uint8_t* previous;              // 上一次发送的调色板下标
+    int have_previous;
+    long frames;
+    uint32_t histogram[SIXEL_HIST_SIZE];
+    uint16_t lookup[SIXEL_HIST_SIZE];   // 15位颜色 -> 最近的调色板下标，0xFFFF表示未计算
+    uint32_t* entries;              // 中位切分时的非空直方图项 (颜色<<16 | 计数的排序缓冲)
+    uint8_t palette[SIXEL_MAX_COLORS][3];
+    int palette_size;
+    double palette_error;           // 生成调色板时的平均平方误差
+    long palette_builds;
+    long bands_sent;
+    long bands_total;
+    SixelBand* bands;
+    uint8_t* dirty;                 // 本帧需要重发的条带
+    uint8_t* scratch;               // 调用线程编码条带用的位图
+    char* output;
+    size_t output_capacity;
+    
+    pthread_t workers[SIXEL_MAX_WORKERS];
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t done;
+    unsigned long generation;
+    atomic_int next_band;
+    atomic_int failed;
+    int busy;
+    int stop;
+} SixelEncoder;
+
+// 输出缓冲区末尾为状态行等附加内容预留的空间
+#define OUTPUT_TRAILER_RESERVE 512
+#define STATUS_LINE_MAX 256
+
+// 底部状态行：内容每秒最多刷新一次，每帧随帧文本一起输出
+typedef struct {
+    char text[STATUS_LINE_MAX];
+    size_t len;
+    int row;
+    int width;
+    uint64_t last_ns;
+    unsigned long frames;
+    unsigned long bytes;
+    unsigned long dropped;
+    unsigned long stage_count[STAGE_COUNT];
+    unsigned long stage_sum[STAGE_COUNT];
+    unsigned long dirty_cells;
+    unsigned long total_cells;
+} StatusLine;
 
 // 显示配置
 typedef struct {
@@ -118,6 +597,7 @@ typedef struct {
     float brightness;
     float contrast;
     int dither;
+    SamplingMode sampling;
     int fps;
     int continuous;
     int region_x;
@@ -126,6 +606,157 @@ typedef struct {
     int region_h;
 } DisplayConfig;
 
+// RFB (VNC) 客户端状态，帧缓冲区为本地BGRA8888副本
+#define VNC_DEFAULT_PORT 5900
+#define VNC_READ_BUFFER 65536
+#define VNC_ZLIB_STREAMS 5      // Tight 0-3, ZRLE 4
+#define VNC_TRACE_MAGIC "GCVT"
+
+// 各编码的解码统计，下标见 vnc_encoding_slot()
+enum {
+    VNC_SLOT_RAW,
+    VNC_SLOT_COPYRECT,
+    VNC_SLOT_HEXTILE,
+    VNC_SLOT_ZRLE,
+    VNC_SLOT_TIGHT,
+    VNC_SLOT_COUNT
+};
+
+typedef struct {
+    unsigned long rects;
+    uint64_t pixels;
+    uint64_t bytes;         // 线上字节数 (压缩后)
+    uint64_t ns;
+} VncEncodingStats;
+
+// 服务器消息流录制文件 (--vnc-trace): 文件头 + ServerInit之后服务器发送的原始字节
+typedef struct {
+    char magic[4];          // "GCVT"
+    uint32_t width;
+    uint32_t height;
+    uint32_t reserved;
+} VncTraceHeader;
+
+typedef struct {
+    int fd;
+    int minor;              // 协商的协议版本 3.minor
+    int request_pending;    // 已发送尚未收到回应的更新请求
+    unsigned long updates;
+    unsigned long rects;
+    uint64_t bytes_in;      // 已消费的服务器数据
+    FILE* trace;            // 录制消费的服务器数据
+    const uint8_t* replay;  // 非NULL时从内存回放而不是读socket
+    size_t replay_len;
+    size_t replay_pos;
+    VncEncodingStats stats[VNC_SLOT_COUNT];
+    uint8_t* zin;           // 压缩数据暂存
+    size_t zin_capacity;
+    uint8_t* zout;          // 解压数据暂存
+    size_t zout_capacity;
+#ifdef USE_ZLIB
+    z_stream zstreams[VNC_ZLIB_STREAMS];    // 跨矩形持续的解压流
+    int zstream_ready[VNC_ZLIB_STREAMS];
+#endif
+    size_t rpos;
+    size_t rlen;
+    uint8_t rbuf[VNC_READ_BUFFER];
+} VncState;
+
+#ifdef USE_X11
+// X11捕获源：根窗口 (或其中一块区域) 抓取到持久的XImage，本地显示使用MIT-SHM
+typedef struct {
+    Display* display;
+    Window root;
+    XImage* image;
+    XShmSegmentInfo shm;
+    int use_shm;
+    int x;                  // 抓取区域在根窗口中的位置
+    int y;
+    int width;
+    int height;
+#ifdef USE_XDAMAGE
+    Damage damage;          // 0表示服务器不支持XDamage，按帧率整帧抓取
+    XserverRegion region;   // 取回变化区域用的临时区域
+    int damage_event;       // XDamageNotify事件类型
+    int damaged;            // 已收到通知但尚未取回的变化
+#endif
+} X11State;
+#endif
+
+#ifdef USE_WAYLAND
+// Wayland捕获源：通过wlr-screencopy把输出复制到一次分配、反复使用的wl_shm缓冲区
+typedef struct {
+    struct wl_display* display;
+    struct wl_registry* registry;
+    struct wl_shm* shm;
+    struct wl_output* outputs[MAX_DISPLAYS];
+    int output_count;
+    struct wl_output* output;       // 截取的输出
+    struct wl_proxy* manager;       // zwlr_screencopy_manager_v1
+    uint32_t manager_version;
+    struct wl_proxy* frame;         // 进行中的截取请求
+    GraphicsBuffer* target;         // 接收damage事件的缓冲区
+    uint32_t frame_format;          // 当前帧buffer事件给出的参数
+    uint32_t frame_width;
+    uint32_t frame_height;
+    uint32_t frame_stride;
+    uint32_t frame_flags;
+    int buffer_info;
+    int buffer_done;
+    int frame_state;                // 0等待中，1完成，-1失败
+    struct wl_buffer* buffer;       // 已分配的共享内存缓冲区
+    void* data;
+    size_t size;
+    uint32_t buffer_format;
+    uint32_t buffer_width;
+    uint32_t buffer_height;
+    uint32_t buffer_stride;
+} WaylandState;
+#endif
+
+#ifdef USE_DRM
+// DRM捕获源：映射CRTC当前扫描输出的帧缓冲区。翻页时扫描输出在几个缓冲区间轮换，
+// 按帧缓冲区ID缓存映射；ID释放后可能被新的缓冲区复用，所以命中时还要核对缓冲区对象本身
+#define DRM_MAP_CACHE 3
+
+// GETFB2/GETFB查询结果。GEM句柄号每次查询都重新分配，不能代表对象；
+// 对象身份取导出的dma-buf文件的st_dev/st_ino (导出失败时为0，视为未知)
+typedef struct {
+    uint32_t handles[4];
+    uint32_t pitches[4];
+    uint32_t offsets[4];
+    uint32_t width;
+    uint32_t height;
+    uint32_t pixel_format;
+    uint64_t object_dev;
+    uint64_t object_ino;
+} DrmFbInfo;
+
+typedef struct {
+    uint32_t fb_id;         // 0表示空槽
+    uint32_t handle;        // 缓存期间保留的GEM句柄，使对象的dma-buf导出保持不变
+    DrmFbInfo info;
+    void* map;
+    size_t map_size;
+    size_t offset;          // 第一个平面在映射中的偏移
+    int width;
+    int height;
+    int pitch;
+    int bpp;
+    PixelFormat format;
+    uint64_t last_used;
+} DrmMapping;
+
+typedef struct {
+    int fd;
+    uint32_t crtc_id;
+    uint32_t fb_id;         // 当前使用的帧缓冲区
+    DrmMapping maps[DRM_MAP_CACHE];
+    uint64_t use_clock;
+    unsigned long remaps;
+} DrmState;
+#endif
+
 // 服务器连接配置
 typedef struct {
     ServerType type;
@@ -137,6 +768,18 @@ typedef struct {
     int use_ssh;
 } ServerConfig;
 
+// --viewport 定义的视口：未指定的项沿用全局显示配置
+typedef struct {
+    int region_x;
+    int region_y;
+    int region_w;           // 0表示整帧
+    int region_h;
+    int out_width;          // 输出尺寸 (字符)，0表示自动
+    int out_height;
+    int charset;            // CharsetMode，-1表示沿用
+    int color_mode;         // ColorMode，-1表示沿用
+} ViewportSpec;
+
 // 应用程序状态
 typedef struct {
     GraphicsBuffer buffers[MAX_BUFFERS];
@@ -147,12 +790,75 @@ typedef struct {
     int verbose;
     int benchmark;
     pthread_t capture_thread;
+    int tile_width[MAX_BUFFERS];    // 各源图块输出宽度 (0=自动)
+    int tile_height[MAX_BUFFERS];   // 各源图块输出高度 (0=自动)
+    int mosaic_columns;             // 拼接列数 (0=自动)
+    ViewportSpec viewports[MAX_DISPLAYS];   // 从同一帧转换的多个视口
+    int viewport_count;
+    char device[320];               // 捕获设备、原始帧文件或vnc://地址
+    int raw_width;                  // 无文件头原始帧的几何参数
+    int raw_height;
+    PixelFormat raw_format;
+    char record_path[256];          // --record 输出文件
+    double replay_speed;            // 回放倍速 (0=最大速度)
+    double replay_seek;             // 回放起始时间 (秒)
+    char asciicast_path[256];       // --asciicast 输出文件
+    int status_line;                // 底部显示统计状态行
+    char metrics_addr[128];         // --metrics unix:PATH 或 PORT
+    char serve_addr[128];           // --serve [ADDR:]PORT
+    int serve_cells;                // 广播二进制字符单元而不是ANSI
+    char view_addr[128];            // --view HOST:PORT
+    char vnc_trace_path[256];       // --vnc-trace 录制/回放VNC消息流
+    int sixel;                      // 以sixel图像代替字符输出
 } AppState;
 
+// 拼接布局中的单个图块
+typedef struct {
+    int index;              // 对应app.buffers下标
+    int out_width;          // 图块输出宽度 (字符)
+    int out_height;         // 图块输出高度 (字符)
+    int col;                // 终端起始列 (从1开始)
+    int row;                // 终端起始行 (从1开始)
+    char* text;             // 最近一次转换结果
+    unsigned long seq;      // 结果序号
+    int failed;             // 源打开失败或已结束
+    pthread_t thread;
+    DisplayConfig config;   // 图块的显示配置 (视口可各自指定区域、字符集和颜色)
+    FrameConverter conv;    // 视口保留上一帧，按变化区域局部转换
+} MosaicTile;
+
+// 多源拼接合成器
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    MosaicTile tiles[MAX_BUFFERS];
+    int tile_count;
+    int total_width;
+    int total_height;
+    DisplayConfig* config;
+    // 视口模式：捕获线程发布一帧 (generation加一)，各视口线程并行转换，busy减到0后合成
+    pthread_cond_t done;
+    GraphicsBuffer* frame;
+    unsigned long generation;
+    int busy;
+    int stop;
+} Mosaic;
+
+// 每帧输出前的清屏序列
+#define FRAME_PREFIX "\033[2J\033[H"
+
 // 全局变量
 static AppState app = {0};
 static struct termios original_termios;
 static AnsiColor color_table[COLOR_TABLE_SIZE];
+static PipelineMetrics metrics;
+static volatile sig_atomic_t metrics_dump_requested = 0;
+static const char* stage_names[STAGE_COUNT] = {"snapshot", "convert", "encode", "write"};
+static Mosaic mosaic = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
 
 // 函数声明
 void print_banner();
@@ -165,22 +871,160 @@ void hide_cursor();
 void show_cursor();
 int get_terminal_size(int *width, int *height);
 void init_color_table();
+void init_gamma_tables();
+void init_glyph_tables();
 char* get_color_fg(int r, int g, int b, ColorMode mode);
 char* get_color_bg(int r, int g, int b, ColorMode mode);
 const char* get_unicode_char(int brightness, CharsetMode charset);
 int detect_servers();
-GraphicsBuffer* open_framebuffer(const char* device);
-void close_framebuffer(GraphicsBuffer* buf);
+PixelFormat pixel_format_from_layout(const PixelLayout* layout);
+void pixel_layout_from_masks(PixelLayout* layout, int bytes, unsigned long red, unsigned long green,
+                             unsigned long blue);
+uint32_t pixel_layout_pack(const PixelLayout* layout);
+void pixel_layout_unpack(PixelLayout* layout, uint32_t packed, int bpp);
+int init_framebuffer(GraphicsBuffer* buf, const char* device);
+void release_framebuffer(GraphicsBuffer* buf);
+int framebuffer_next_frame(GraphicsBuffer* buf);
+void release_fbdev(GraphicsBuffer* buf);
+int init_raw_file(GraphicsBuffer* buf, const char* path);
+const CaptureSource* find_capture_source(const char* device);
+int init_source(GraphicsBuffer* buf, const char* device);
+void release_source(GraphicsBuffer* buf);
+GraphicsBuffer* open_source(const char* device);
+void close_source(GraphicsBuffer* buf);
+int source_next_frame(GraphicsBuffer* buf);
+void source_release_frame(GraphicsBuffer* buf);
+void print_capture_caps(unsigned int caps);
+size_t rle_bound(size_t len);
+size_t rle_encode(const unsigned char* src, size_t len, unsigned char* dst);
+int rle_decode(const unsigned char* src, size_t len, unsigned char* dst, size_t dst_len, int xor_mode);
+FrameRecorder* recorder_start(const char* path, GraphicsBuffer* buf);
+void recorder_submit(FrameRecorder* rec, GraphicsBuffer* buf);
+void recorder_stop(FrameRecorder* rec);
+int init_replay(GraphicsBuffer* buf, const char* path);
+int replay_next_frame(GraphicsBuffer* buf);
+void release_replay(GraphicsBuffer* buf);
+int tcp_connect(const char* addr);
+int init_vnc(GraphicsBuffer* buf, const char* url);
+int vnc_next_frame(GraphicsBuffer* buf);
+void release_vnc(GraphicsBuffer* buf);
+void benchmark_vnc_trace(const char* path);
+#ifdef USE_X11
+int init_x11(GraphicsBuffer* buf, const char* device);
+int x11_next_frame(GraphicsBuffer* buf);
+void release_x11(GraphicsBuffer* buf);
+#endif
+#ifdef USE_DRM
+int init_drm(GraphicsBuffer* buf, const char* device);
+int drm_next_frame(GraphicsBuffer* buf);
+void release_drm(GraphicsBuffer* buf);
+#endif
+#ifdef USE_WAYLAND
+int init_wayland(GraphicsBuffer* buf, const char* device);
+int wayland_next_frame(GraphicsBuffer* buf);
+void wayland_release_frame(GraphicsBuffer* buf);
+void release_wayland(GraphicsBuffer* buf);
+#endif
+PixelFormat parse_pixel_format(const char* name);
+int parse_frame_geometry(const char* spec);
 int capture_screen();
 void* capture_thread_func(void* arg);
+int parse_source_spec(const char* spec);
+int parse_viewport_spec(const char* spec);
+int load_config_file(const char* path);
+void mosaic_layout(DisplayConfig* config, int count, const int* widths, const int* heights);
+void* mosaic_source_thread(void* arg);
+void* mosaic_thread_func(void* arg);
+void* viewport_thread_func(void* arg);
+int write_all(int fd, const char* data, size_t len);
 int rgb_to_brightness(int r, int g, int b);
 int convert_buffer_to_text(GraphicsBuffer* buf, DisplayConfig* config, char** output);
+int converter_run(FrameConverter* conv, GraphicsBuffer* buf, DisplayConfig* config,
+                  char** output, size_t* len);
+void converter_free(FrameConverter* conv);
+void status_line_init(StatusLine* status, int row, int width);
+void status_line_update(StatusLine* status, int dirty_cells, int total_cells);
+size_t status_line_append(StatusLine* status, char* out);
+int cell_frame_init(CellFrame* frame, int cols, int rows);
+void cell_frame_free(CellFrame* frame);
+int cells_decode(GraphicsBuffer* buf, DisplayConfig* config, CellFrame* frame, const CellRect* rect);
+void cells_adjust(DisplayConfig* config, CellFrame* frame, const CellRect* rect);
+void cells_quantize(DisplayConfig* config, CellFrame* frame, const CellRect* rect);
+void cells_glyph(DisplayConfig* config, CellFrame* frame, const CellRect* rect);
+int damage_to_cells(GraphicsBuffer* buf, DisplayConfig* config, CellFrame* frame, CellRect* rects);
+void damage_add(GraphicsBuffer* buf, int x, int y, int width, int height);
+size_t cells_output_bound(CellFrame* frame);
+size_t cells_encode(DisplayConfig* config, CellFrame* frame, char* out);
+size_t cells_delta_bound(CellFrame* frame);
+size_t cells_encode_delta(DisplayConfig* config, CellFrame* frame, CellFrame* prev, char* out);
+int converter_encode_delta(FrameConverter* conv, DisplayConfig* config, char** output, size_t* len);
+int converter_convert(FrameConverter* conv, GraphicsBuffer* buf, DisplayConfig* config);
+int converter_encode(FrameConverter* conv, DisplayConfig* config, char** output, size_t* len);
 void display_text(char* text, int width, int height);
+SixelEncoder* sixel_encoder_new(int width, int height);
+void sixel_encoder_free(SixelEncoder* enc);
+int sixel_encode_frame(SixelEncoder* enc, GraphicsBuffer* buf, DisplayConfig* config, char** output, size_t* len);
+AsciicastWriter* asciicast_start(const char* path, int width, int height);
+void asciicast_submit(AsciicastWriter* cast, const char* prefix, char* data, size_t len);
+void asciicast_stop(AsciicastWriter* cast);
 void benchmark_mode();
+void benchmark_corpus();
 void interactive_mode();
 int connect_to_server(ServerConfig* config);
 void list_available_devices();
 void signal_handler(int sig);
+uint64_t monotonic_ns();
+void histogram_record(LatencyHistogram* hist, uint64_t value);
+uint64_t histogram_percentile(LatencyHistogram* hist, double p);
+void metrics_dump(FILE* fp);
+void metrics_signal_handler(int sig);
+int metrics_thread_register(const char* name);
+void metrics_thread_unregister(int slot);
+int metrics_self_check();
+void metrics_set_source(int index, const char* device, int width, int height);
+void metrics_write_prometheus(FILE* fp);
+MetricsServer* metrics_server_start(const char* addr);
+void metrics_server_stop(MetricsServer* server);
+void frame_pacer_init(FramePacer* pacer, int fps);
+FanoutServer* fanout_start(const char* addr);
+void fanout_poll(FanoutServer* server, int timeout_ms);
+void fanout_broadcast(FanoutServer* server, SharedChunk* keyframe, SharedChunk* delta);
+void fanout_resync(FanoutServer* server, SharedChunk* keyframe);
+void fanout_stop(FanoutServer* server);
+void serve_mode();
+size_t cell_payload_bound(CellFrame* frame);
+size_t cell_payload_encode(DisplayConfig* config, CellFrame* frame, CellFrame* prev, uint8_t* out);
+int cell_payload_apply(const CellMessageHeader* header, const uint8_t* payload, CellFrame* frame);
+SharedChunk* cell_message_build(DisplayConfig* config, CellFrame* frame, CellFrame* prev);
+void view_mode();
+long frame_pacer_advance(FramePacer* pacer);
+long frame_pacer_wait(FramePacer* pacer);
+
+// 按亮度索引的字形表 (四分块/六分块按掩码索引)，由init_glyph_tables填充
+static Glyph glyph_table[CHARSET_COUNT][256];
+static Glyph quadrant_glyph_table[16];
+static Glyph sextant_glyph_table[64];
+
+// sRGB与线性光互换的查找表，让线性光下的平均保持整数运算
+static uint16_t srgb_to_linear[256];    // sRGB 8位 -> 线性光 16位
+static uint8_t linear_to_srgb[4096];    // 线性光高12位 -> sRGB 8位
+static uint8_t srgb_half[256];          // 线性光下亮度减半
+
+void init_gamma_tables() {
+    for (int i = 0; i < 256; i++) {
+        double c = i / 255.0;
+        double l = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+        srgb_to_linear[i] = (uint16_t)(l * 65535.0 + 0.5);
+    }
+    for (int i = 0; i < 4096; i++) {
+        double l = (i + 0.5) / 4096.0;
+        double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1 / 2.4) - 0.055;
+        linear_to_srgb[i] = (uint8_t)(c * 255.0 + 0.5);
+    }
+    for (int i = 0; i < 256; i++) {
+        srgb_half[i] = linear_to_srgb[srgb_to_linear[i] >> 5];
+    }
+}
 
 // ANSI颜色函数
 void init_color_table() {
@@ -313,6 +1157,29 @@ const char* get_unicode_char(int brightness, CharsetMode charset) {
     }
 }
 
+static Glyph glyph_from_utf8(const char* s) {
+    Glyph glyph = { { 0 }, 0 };
+    size_t len = strlen(s);
+    memcpy(glyph.bytes, s, len > 4 ? 4 : len);
+    glyph.len = len > 4 ? 4 : len;
+    return glyph;
+}
+
+// 把各字符集编译为按亮度直接索引的字形表，转换时不再逐单元计算
+void init_glyph_tables() {
+    for (int charset = 0; charset < CHARSET_COUNT; charset++) {
+        for (int luma = 0; luma < 256; luma++) {
+            glyph_table[charset][luma] = glyph_from_utf8(get_unicode_char(luma, (CharsetMode)charset));
+        }
+    }
+    for (int mask = 0; mask < 16; mask++) {
+        quadrant_glyph_table[mask] = glyph_from_utf8(quadrant_glyphs[mask]);
+    }
+    for (int mask = 0; mask < 64; mask++) {
+        sextant_glyph_table[mask] = glyph_from_utf8(sextant_glyphs[mask]);
+    }
+}
+
 void print_banner() {
     printf("\n");
     printf("╔══════════════════════════════════════════════════════╗\n");
@@ -332,30 +1199,66 @@ void print_help() {
     printf("  --benchmark, -b        性能测试模式\n");
     printf("  --list, -l             列出可用设备\n");
     printf("\n捕获选项:\n");
-    printf("  --device DEVICE        帧缓冲区设备 (默认: /dev/fb0)\n");
+    printf("  --device DEVICE        帧缓冲区设备、原始帧文件、vnc://HOST[:PORT] 或\n");
+    printf("                         x11:[DISPLAY][/WxH+X+Y]、wayland:[DISPLAY][/N]、\n");
+    printf("                         /dev/dri/cardN[:CRTC] (默认: /dev/fb0)\n");
+    printf("  --frame-geometry WxH:FMT  无文件头原始帧的尺寸和格式\n");
+    printf("                         FMT: rgb565,bgr565,rgb555,rgb888,bgr888,rgba8888,bgra8888,\n");
+    printf("                              argb8888,abgr8888,xrgb2101010\n");
     printf("  --width WIDTH          输出宽度 (字符数)\n");
     printf("  --height HEIGHT        输出高度 (字符数)\n");
     printf("  --fps FPS              帧率 (默认: 10)\n");
     printf("  --continuous, -R       连续捕获模式\n");
+    printf("  --source DEV[@WxH]     添加捕获源，可重复使用以拼接显示多个源\n");
+    printf("  --mosaic-columns N     拼接布局的列数 (默认自动)\n");
+    printf("  --viewport SPEC        添加视口，可重复使用，各视口从同一帧并行转换\n");
+    printf("                         SPEC: [X,Y,W,H|full][@COLSxROWS][:CHARSET[:COLOR]]\n");
+    printf("  --record FILE          把捕获的原始帧录制到文件\n");
+    printf("  --replay FILE          回放录制文件\n");
+    printf("  --replay-speed SPEED   回放倍速，max为最大速度 (默认: 1)\n");
+    printf("  --seek SECONDS         从录制的指定时间开始回放\n");
+    printf("  --asciicast FILE       把终端输出录制为asciicast v2文件\n");
+    printf("  --status               在底行显示帧率、各阶段耗时、输出量等统计\n");
+    printf("  --metrics ADDR         提供Prometheus指标: unix:PATH 或本地端口号\n");
+    printf("  --serve [ADDR:]PORT    捕获一次并广播给多个telnet/nc查看端 (默认只监听127.0.0.1)\n");
+    printf("  --serve-cells [ADDR:]PORT  广播紧凑的二进制字符单元流，用 --view 查看\n");
+    printf("  --view HOST:PORT       连接 --serve-cells 服务，在本地终端显示\n");
+    printf("  --vnc-trace FILE       录制VNC服务器消息流；与 -b 同用时单独测试各编码的解码速度\n");
     printf("\n显示选项:\n");
     printf("  --color MODE           颜色模式: none,basic,256,true,gray\n");
-    printf("  --charset SET          字符集: simple,blocks,half,braille,art\n");
+    printf("  --charset SET          字符集: simple,blocks,half,braille,art,\n");
+    printf("                         quadrant (每单元2x2像素拟合四分块字形和两种颜色),\n");
+    printf("                         sextant (每单元2x3像素，需要支持Unicode 13的字体)\n");
     printf("  --brightness VAL       亮度调整 (0.5-2.0)\n");
     printf("  --contrast VAL         对比度调整 (0.5-2.0)\n");
+    printf("  --sampling MODE        采样方式: point (默认，每单元一个像素), area (区域平均),\n");
+    printf("                         linear (线性光下区域平均，细亮线不丢失)\n");
+    printf("  --sixel                输出sixel图像 (xterm -ti vt340、foot、mlterm等)，\n");
+    printf("                         尺寸按每字符8x16像素由 --width/--height 换算\n");
     printf("\n连接选项:\n");
     printf("  --server TYPE          服务器类型: fb,x11,wayland,vnc,rdp\n");
-    printf("  --display DISP         X11显示 (例如: :0)\n");
+    printf("  --display DISP         X11或Wayland显示 (例如: :0, wayland-1)\n");
     printf("  --host HOST            远程主机\n");
     printf("  --port PORT            端口号\n");
     printf("  --username USER        用户名\n");
-    printf("  --password PASS        密码\n");
+    printf("  --password PASS        密码 (VNC认证)\n");
     printf("\n其他选项:\n");
+    printf("  --config FILE          读取配置文件 (格式见 Graphics Commander.conf)，命令行参数优先\n");
     printf("  --help, -h             显示此帮助\n");
     printf("  --verbose, -v          详细输出\n");
     printf("  --version              显示版本\n");
+    printf("\n捕获过程中发送 SIGUSR1 可输出各阶段延迟直方图，退出时也会输出\n");
     printf("\n示例:\n");
     printf("  graphics_commander -c --color true --charset braille\n");
-    printf("  graphics_commander -C --server vnc --host 192.168.1.100\n");
+    printf("  graphics_commander -c --source /dev/fb0 --source /dev/fb1@60x20\n");
+    printf("  graphics_commander -c --viewport full@60x30 --viewport 0,900,1920,180@60x10:simple:256\n");
+    printf("  graphics_commander -b --device frame.raw --frame-geometry 1920x1080:bgra8888\n");
+    printf("  graphics_commander -c --record kiosk.gcrc\n");
+    printf("  graphics_commander --replay kiosk.gcrc --seek 30 --replay-speed 2\n");
+    printf("  graphics_commander -C --server vnc --host 192.168.1.100 --password secret\n");
+    printf("  graphics_commander -c --device vnc://192.168.1.100:5901\n");
+    printf("  graphics_commander -c --device x11::0/800x600+0+0\n");
+    printf("  graphics_commander -b --vnc-trace session.gcvt\n");
     printf("  graphics_commander -i\n");
     printf("  graphics_commander -l\n");
 }
@@ -477,22 +1380,163 @@ int detect_servers() {
     return found;
 }
 
-GraphicsBuffer* open_framebuffer(const char* device) {
-    GraphicsBuffer* buf = malloc(sizeof(GraphicsBuffer));
-    if (!buf) {
-        perror("分配内存失败");
-        return NULL;
+static int layout_matches(const PixelLayout* layout, int bytes, int red_offset, int red_length,
+                          int green_offset, int green_length, int blue_offset, int blue_length) {
+    return layout->bytes == bytes &&
+           layout->red.offset == red_offset && layout->red.length == red_length &&
+           layout->green.offset == green_offset && layout->green.length == green_length &&
+           layout->blue.offset == blue_offset && layout->blue.length == blue_length;
+}
+
+// 常见布局映射到专用解码，其余合法布局走通用位域解码
+PixelFormat pixel_format_from_layout(const PixelLayout* layout) {
+    static const struct {
+        PixelFormat format;
+        int bytes;
+        int red_offset, red_length, green_offset, green_length, blue_offset, blue_length;
+    } known[] = {
+        {PIXFMT_BGRA8888, 4, 16, 8, 8, 8, 0, 8},
+        {PIXFMT_RGBA8888, 4, 0, 8, 8, 8, 16, 8},
+        {PIXFMT_ARGB8888, 4, 8, 8, 16, 8, 24, 8},
+        {PIXFMT_ABGR8888, 4, 24, 8, 16, 8, 8, 8},
+        {PIXFMT_XRGB2101010, 4, 20, 10, 10, 10, 0, 10},
+        {PIXFMT_BGR888, 3, 16, 8, 8, 8, 0, 8},
+        {PIXFMT_RGB888, 3, 0, 8, 8, 8, 16, 8},
+        {PIXFMT_RGB565, 2, 11, 5, 5, 6, 0, 5},
+        {PIXFMT_BGR565, 2, 0, 5, 5, 6, 11, 5},
+        {PIXFMT_RGB555, 2, 10, 5, 5, 5, 0, 5},
+    };
+    
+    for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+        if (layout_matches(layout, known[i].bytes, known[i].red_offset, known[i].red_length,
+                           known[i].green_offset, known[i].green_length,
+                           known[i].blue_offset, known[i].blue_length)) {
+            return known[i].format;
+        }
+    }
+    
+    if (layout->bytes < 1 || layout->bytes > 4) {
+        return PIXFMT_UNKNOWN;
+    }
+    const PixelField* fields[3] = { &layout->red, &layout->green, &layout->blue };
+    for (int i = 0; i < 3; i++) {
+        if (fields[i]->length == 0 || fields[i]->length > 16 ||
+            fields[i]->offset + fields[i]->length > layout->bytes * 8) {
+            return PIXFMT_UNKNOWN;
+        }
+    }
+    return PIXFMT_BITFIELD;
+}
+
+// 由连续的通道掩码 (X11视觉等) 得到位域
+void pixel_layout_from_masks(PixelLayout* layout, int bytes, unsigned long red, unsigned long green,
+                             unsigned long blue) {
+    unsigned long masks[3] = { red, green, blue };
+    PixelField* fields[3] = { &layout->red, &layout->green, &layout->blue };
+    
+    layout->bytes = bytes;
+    for (int i = 0; i < 3; i++) {
+        int offset = 0, length = 0;
+        unsigned long mask = masks[i];
+        while (mask && !(mask & 1)) {
+            mask >>= 1;
+            offset++;
+        }
+        while (mask & 1) {
+            mask >>= 1;
+            length++;
+        }
+        fields[i]->offset = offset;
+        fields[i]->length = length;
+    }
+}
+
+// 录制文件头中的位域：每通道5位偏移和5位长度
+uint32_t pixel_layout_pack(const PixelLayout* layout) {
+    const PixelField* fields[3] = { &layout->red, &layout->green, &layout->blue };
+    uint32_t packed = 0;
+    
+    for (int i = 0; i < 3; i++) {
+        packed |= (uint32_t)((fields[i]->offset & 31) | (fields[i]->length & 31) << 5) << (i * 10);
+    }
+    return packed;
+}
+
+void pixel_layout_unpack(PixelLayout* layout, uint32_t packed, int bpp) {
+    PixelField* fields[3] = { &layout->red, &layout->green, &layout->blue };
+    
+    layout->bytes = bpp / 8;
+    for (int i = 0; i < 3; i++) {
+        uint32_t field = packed >> (i * 10);
+        fields[i]->offset = field & 31;
+        fields[i]->length = (field >> 5) & 31;
+    }
+}
+
+// 真彩色帧缓冲区按位域选择解码，8位调色板经颜色表查表；其他视觉类型暂不支持
+static PixelFormat fb_pixel_format(const struct fb_fix_screeninfo* fix_info,
+                                   const struct fb_var_screeninfo* var_info, PixelLayout* layout) {
+    memset(layout, 0, sizeof(*layout));
+    if ((fix_info->visual == FB_VISUAL_PSEUDOCOLOR || fix_info->visual == FB_VISUAL_STATIC_PSEUDOCOLOR) &&
+        var_info->bits_per_pixel == 8) {
+        layout->bytes = 1;
+        return PIXFMT_PALETTE8;
+    }
+    if (fix_info->visual != FB_VISUAL_TRUECOLOR && fix_info->visual != FB_VISUAL_DIRECTCOLOR) {
+        return PIXFMT_UNKNOWN;
+    }
+    layout->bytes = var_info->bits_per_pixel / 8;
+    layout->red.offset = var_info->red.offset;
+    layout->red.length = var_info->red.length;
+    layout->green.offset = var_info->green.offset;
+    layout->green.length = var_info->green.length;
+    layout->blue.offset = var_info->blue.offset;
+    layout->blue.length = var_info->blue.length;
+    return pixel_format_from_layout(layout);
+}
+
+// 读取颜色表；与上次相同时不重建查找表。返回1表示查找表已更新，-1表示读取失败
+static int fb_update_palette(GraphicsBuffer* buf) {
+    FbPalette* palette = (FbPalette*)buf->priv;
+    uint16_t red[256], green[256], blue[256];
+    struct fb_cmap cmap = { .start = 0, .len = 256, .red = red, .green = green, .blue = blue };
+    
+    if (ioctl(buf->fd, FBIOGETCMAP, &cmap) < 0) {
+        return -1;
+    }
+    if (palette->valid && memcmp(red, palette->red, sizeof(red)) == 0 &&
+        memcmp(green, palette->green, sizeof(green)) == 0 &&
+        memcmp(blue, palette->blue, sizeof(blue)) == 0) {
+        return 0;
     }
     
-    strcpy(buf->device, device);
+    memcpy(palette->red, red, sizeof(red));
+    memcpy(palette->green, green, sizeof(green));
+    memcpy(palette->blue, blue, sizeof(blue));
+    for (int i = 0; i < 256; i++) {
+        palette->lut[i] = (uint32_t)(red[i] >> 8) << 16 | (uint32_t)(green[i] >> 8) << 8 | blue[i] >> 8;
+    }
+    palette->valid = 1;
+    return 1;
+}
+
+int init_framebuffer(GraphicsBuffer* buf, const char* device) {
+    if (buf->device != device) {
+        snprintf(buf->device, sizeof(buf->device), "%s", device);
+    }
     buf->type = SERVER_FRAMEBUFFER;
+    buf->buffer = NULL;
+    buf->map_base = NULL;
+    buf->map_size = 0;
+    buf->frame_count = 1;
+    buf->frame_index = 0;
+    buf->priv = NULL;
     
     // 打开设备
     buf->fd = open(device, O_RDONLY);
     if (buf->fd < 0) {
         perror("打开帧缓冲区失败");
-        free(buf);
-        return NULL;
+        return -1;
     }
     
     // 获取屏幕信息
@@ -502,15 +1546,15 @@ GraphicsBuffer* open_framebuffer(const char* device) {
     if (ioctl(buf->fd, FBIOGET_FSCREENINFO, &fix_info) < 0) {
         perror("获取固定屏幕信息失败");
         close(buf->fd);
-        free(buf);
-        return NULL;
+        buf->fd = -1;
+        return -1;
     }
     
     if (ioctl(buf->fd, FBIOGET_VSCREENINFO, &var_info) < 0) {
         perror("获取可变屏幕信息失败");
         close(buf->fd);
-        free(buf);
-        return NULL;
+        buf->fd = -1;
+        return -1;
     }
     
     // 填充缓冲区信息
@@ -520,269 +1564,7225 @@ GraphicsBuffer* open_framebuffer(const char* device) {
     buf->line_length = fix_info.line_length;
     buf->size = fix_info.smem_len;
     
-    // 检测像素格式
-    if (buf->bpp == 32) {
-        if (var_info.red.offset == 16 && var_info.green.offset == 8 && var_info.blue.offset == 0)
-            buf->format = PIXFMT_RGBA8888;
-        else if (var_info.red.offset == 0 && var_info.green.offset == 8 && var_info.blue.offset == 16)
-            buf->format = PIXFMT_BGRA8888;
-        else
-            buf->format = PIXFMT_UNKNOWN;
-    } else if (buf->bpp == 24) {
-        // 假设BGR格式
-        buf->format = PIXFMT_BGR888;
-    } else if (buf->bpp == 16) {
-        buf->format = PIXFMT_RGB565;
-    } else {
-        buf->format = PIXFMT_UNKNOWN;
+    // 按驱动报告的通道位域选择像素解码
+    buf->format = fb_pixel_format(&fix_info, &var_info, &buf->layout);
+    if (buf->format == PIXFMT_UNKNOWN) {
+        fprintf(stderr, "不支持的帧缓冲区像素格式 (visual %u, %d位, R%u/%u G%u/%u B%u/%u)，按灰度显示\n",
+                fix_info.visual, buf->bpp, var_info.red.offset, var_info.red.length,
+                var_info.green.offset, var_info.green.length, var_info.blue.offset, var_info.blue.length);
+    } else if (app.verbose) {
+        printf("帧缓冲区: %dx%d %d位 R%u/%u G%u/%u B%u/%u\n", buf->width, buf->height, buf->bpp,
+               var_info.red.offset, var_info.red.length, var_info.green.offset, var_info.green.length,
+               var_info.blue.offset, var_info.blue.length);
     }
     
     // 映射内存
     buf->buffer = mmap(NULL, buf->size, PROT_READ, MAP_SHARED, buf->fd, 0);
     if (buf->buffer == MAP_FAILED) {
         perror("映射帧缓冲区失败");
+        buf->buffer = NULL;
         close(buf->fd);
-        free(buf);
-        return NULL;
+        buf->fd = -1;
+        return -1;
     }
+    buf->map_base = buf->buffer;
+    buf->map_size = buf->size;
     
-    return buf;
-}
-
-void close_framebuffer(GraphicsBuffer* buf) {
-    if (buf) {
-        if (buf->buffer && buf->buffer != MAP_FAILED) {
-            munmap(buf->buffer, buf->size);
+    if (buf->format == PIXFMT_PALETTE8) {
+        FbPalette* palette = calloc(1, sizeof(FbPalette));
+        if (!palette) {
+            perror("分配内存失败");
+            release_framebuffer(buf);
+            return -1;
         }
-        if (buf->fd >= 0) {
-            close(buf->fd);
+        buf->priv = palette;
+        buf->layout.palette = palette->lut;
+        if (fb_update_palette(buf) < 0) {
+            perror("读取帧缓冲区颜色表失败，按灰度显示");
+            for (int i = 0; i < 256; i++) {
+                palette->lut[i] = (uint32_t)i * 0x010101;
+            }
         }
-        free(buf);
     }
+    
+    return 0;
 }
 
-int rgb_to_brightness(int r, int g, int b) {
-    // 使用标准亮度公式
-    return (int)(0.299 * r + 0.587 * g + 0.114 * b);
+// 调色板帧缓冲区每帧检查颜色表 (启动画面常在渐变时改写调色板)，像素本身是实时映射
+int framebuffer_next_frame(GraphicsBuffer* buf) {
+    if (buf->format == PIXFMT_PALETTE8 && ((FbPalette*)buf->priv)->valid) {
+        fb_update_palette(buf);
+    }
+    return 0;
 }
 
-int get_pixel_color(GraphicsBuffer* buf, int x, int y, int* r, int* g, int* b) {
-    if (x < 0 || x >= buf->width || y < 0 || y >= buf->height) {
-        return -1;
+void release_fbdev(GraphicsBuffer* buf) {
+    free(buf->priv);
+    buf->priv = NULL;
+    release_framebuffer(buf);
+}
+
+void release_framebuffer(GraphicsBuffer* buf) {
+    if (buf->map_base && buf->map_base != MAP_FAILED) {
+        munmap(buf->map_base, buf->map_size);
     }
-    
-    int offset = y * buf->line_length + x * (buf->bpp / 8);
-    unsigned char* pixel = (unsigned char*)buf->buffer + offset;
-    
-    switch (buf->format) {
-        case PIXFMT_RGB565: {
-            unsigned short rgb = *(unsigned short*)pixel;
-            *r = ((rgb >> 11) & 0x1F) * 8;
-            *g = ((rgb >> 5) & 0x3F) * 4;
-            *b = (rgb & 0x1F) * 8;
-            break;
-        }
-        case PIXFMT_RGB888:
-            *r = pixel[0];
-            *g = pixel[1];
-            *b = pixel[2];
-            break;
-        case PIXFMT_BGR888:
-            *r = pixel[2];
-            *g = pixel[1];
-            *b = pixel[0];
-            break;
-        case PIXFMT_RGBA8888:
-            *r = pixel[0];
-            *g = pixel[1];
-            *b = pixel[2];
-            break;
-        case PIXFMT_BGRA8888:
-            *r = pixel[2];
-            *g = pixel[1];
-            *b = pixel[0];
-            break;
-        default:
-            // 假设灰度
-            *r = *g = *b = pixel[0];
-            break;
+    buf->map_base = NULL;
+    buf->buffer = NULL;
+    if (buf->fd >= 0) {
+        close(buf->fd);
     }
-    
-    return 0;
+    buf->fd = -1;
 }
 
-int convert_buffer_to_text(GraphicsBuffer* buf, DisplayConfig* config, char** output) {
-    if (!buf || !buf->buffer || !config) {
+static const struct {
+    const char* name;
+    PixelFormat format;
+    int bpp;
+} pixel_format_names[] = {
+    {"rgb565", PIXFMT_RGB565, 16},
+    {"rgb888", PIXFMT_RGB888, 24},
+    {"bgr888", PIXFMT_BGR888, 24},
+    {"rgba8888", PIXFMT_RGBA8888, 32},
+    {"bgra8888", PIXFMT_BGRA8888, 32},
+    {"argb8888", PIXFMT_ARGB8888, 32},
+    {"abgr8888", PIXFMT_ABGR8888, 32},
+    {"rgb555", PIXFMT_RGB555, 16},
+    {"bgr565", PIXFMT_BGR565, 16},
+    {"xrgb2101010", PIXFMT_XRGB2101010, 32},
+};
+
+PixelFormat parse_pixel_format(const char* name) {
+    for (size_t i = 0; i < sizeof(pixel_format_names) / sizeof(pixel_format_names[0]); i++) {
+        if (strcmp(name, pixel_format_names[i].name) == 0) {
+            return pixel_format_names[i].format;
+        }
+    }
+    return PIXFMT_UNKNOWN;
+}
+
+static int pixel_format_bpp(PixelFormat format) {
+    for (size_t i = 0; i < sizeof(pixel_format_names) / sizeof(pixel_format_names[0]); i++) {
+        if (pixel_format_names[i].format == format) {
+            return pixel_format_names[i].bpp;
+        }
+    }
+    return 0;
+}
+
+// 检查文件头中的帧几何参数；位域格式没有固定位深，只要求整字节
+static int frame_geometry_valid(uint32_t width, uint32_t height, uint32_t stride,
+                                PixelFormat format, uint32_t bpp) {
+    int expected = pixel_format_bpp(format);
+    
+    if (width == 0 || height == 0 || stride == 0 ||
+        width > INT_MAX || height > INT_MAX || stride > INT_MAX) {
+        return 0;
+    }
+    if (expected ? bpp != (uint32_t)expected : (bpp == 0 || bpp > 32 || bpp % 8 != 0)) {
+        return 0;
+    }
+    return stride >= (uint64_t)width * (bpp / 8);
+}
+
+// 解析 --frame-geometry 参数: WIDTHxHEIGHT:FORMAT
+int parse_frame_geometry(const char* spec) {
+    char name[16];
+    
+    if (sscanf(spec, "%dx%d:%15s", &app.raw_width, &app.raw_height, name) != 3 ||
+        app.raw_width <= 0 || app.raw_height <= 0) {
+        fprintf(stderr, "无效的帧几何参数: %s\n", spec);
+        return -1;
+    }
+    
+    app.raw_format = parse_pixel_format(name);
+    if (app.raw_format == PIXFMT_UNKNOWN) {
+        fprintf(stderr, "未知的像素格式: %s\n", name);
         return -1;
     }
+    return 0;
+}
+
+// 映射原始帧文件：带GCRF文件头的多帧文件，或按--frame-geometry解释的裸数据
+int init_raw_file(GraphicsBuffer* buf, const char* path) {
+    struct stat st;
+    size_t data_offset = 0;
+    size_t frame_bytes;
+    uint32_t frame_count = 0;
     
-    // 计算实际区域
-    int region_x = config->region_x;
-    int region_y = config->region_y;
-    int region_w = config->region_w > 0 ? config->region_w : buf->width;
-    int region_h = config->region_h > 0 ? config->region_h : buf->height;
+    if (buf->device != path) {
+        snprintf(buf->device, sizeof(buf->device), "%s", path);
+    }
+    buf->type = SERVER_FILE;
+    buf->buffer = NULL;
+    buf->map_base = NULL;
+    buf->frame_index = 0;
+    buf->priv = NULL;
     
-    // 边界检查
-    if (region_x + region_w > buf->width) region_w = buf->width - region_x;
-    if (region_y + region_h > buf->height) region_h = buf->height - region_y;
-    if (region_w <= 0 || region_h <= 0) {
+    buf->fd = open(path, O_RDONLY);
+    if (buf->fd < 0) {
+        perror("打开原始帧文件失败");
         return -1;
     }
     
-    // 计算采样步长
-    float x_step = (float)region_w / config->output_width;
-    float y_step = (float)region_h / config->output_height;
+    if (fstat(buf->fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "原始帧文件为空: %s\n", path);
+        close(buf->fd);
+        buf->fd = -1;
+        return -1;
+    }
+    buf->map_size = st.st_size;
+    
+    buf->map_base = mmap(NULL, buf->map_size, PROT_READ, MAP_SHARED, buf->fd, 0);
+    if (buf->map_base == MAP_FAILED) {
+        perror("映射原始帧文件失败");
+        buf->map_base = NULL;
+        close(buf->fd);
+        buf->fd = -1;
+        return -1;
+    }
+    
+    const RawFrameHeader* header = (const RawFrameHeader*)buf->map_base;
+    if (buf->map_size >= sizeof(RawFrameHeader) &&
+        memcmp(header->magic, RAW_FRAME_MAGIC, 4) == 0) {
+        // 文件头没有位域信息，不能使用PIXFMT_BITFIELD
+        if (header->version != 1 || header->format >= PIXFMT_BITFIELD) {
+            fprintf(stderr, "不支持的原始帧文件: %s\n", path);
+            release_framebuffer(buf);
+            return -1;
+        }
+        uint32_t bpp = header->bpp ? header->bpp : (uint32_t)pixel_format_bpp(header->format);
+        if (!frame_geometry_valid(header->width, header->height, header->stride,
+                                  (PixelFormat)header->format, bpp)) {
+            fprintf(stderr, "原始帧几何参数无效: %s\n", path);
+            release_framebuffer(buf);
+            return -1;
+        }
+        buf->width = header->width;
+        buf->height = header->height;
+        buf->line_length = header->stride;
+        buf->format = (PixelFormat)header->format;
+        buf->bpp = bpp;
+        frame_count = header->frame_count;
+        data_offset = sizeof(RawFrameHeader);
+    } else if (app.raw_width > 0) {
+        buf->width = app.raw_width;
+        buf->height = app.raw_height;
+        buf->format = app.raw_format;
+        buf->bpp = pixel_format_bpp(buf->format);
+        buf->line_length = buf->width * (buf->bpp / 8);
+    } else {
+        fprintf(stderr, "%s 没有文件头，请用 --frame-geometry 指定尺寸和格式\n", path);
+        release_framebuffer(buf);
+        return -1;
+    }
+    
+    frame_bytes = (size_t)buf->line_length * buf->height;
+    if (frame_bytes == 0 || (size_t)buf->line_length < (size_t)buf->width * (buf->bpp / 8)) {
+        fprintf(stderr, "原始帧几何参数无效: %s\n", path);
+        release_framebuffer(buf);
+        return -1;
+    }
+    
+    size_t available = (buf->map_size - data_offset) / frame_bytes;
+    if (frame_count == 0 || frame_count > available) {
+        frame_count = available;
+    }
+    if (frame_count == 0) {
+        fprintf(stderr, "原始帧文件不足一帧: %s\n", path);
+        release_framebuffer(buf);
+        return -1;
+    }
+    
+    buf->frame_count = frame_count;
+    buf->size = frame_bytes;
+    buf->buffer = (unsigned char*)buf->map_base + data_offset;
+    return 0;
+}
+
+// 多帧文件源循环播放
+static int file_next_frame(GraphicsBuffer* buf) {
+    if (buf->frame_count <= 1) {
+        return 0;
+    }
+    
+    unsigned char* first = (unsigned char*)buf->buffer - (size_t)buf->frame_index * buf->size;
+    buf->frame_index = (buf->frame_index + 1) % buf->frame_count;
+    buf->buffer = first + (size_t)buf->frame_index * buf->size;
+    return 0;
+}
+
+// 普通文件按文件头区分录制容器和原始帧文件
+static int probe_file_magic(const char* device, const char* magic) {
+    struct stat st;
+    char head[4] = {0};
+    
+    if (stat(device, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    if (!magic) {
+        return 1;
+    }
+    int fd = open(device, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    if (read(fd, head, sizeof(head)) != sizeof(head)) {
+        memset(head, 0, sizeof(head));
+    }
+    close(fd);
+    return memcmp(head, magic, 4) == 0;
+}
+
+static int probe_replay(const char* device) {
+    return probe_file_magic(device, RECORD_MAGIC);
+}
+
+static int probe_raw_file(const char* device) {
+    return probe_file_magic(device, NULL);
+}
+
+static int probe_framebuffer(const char* device) {
+    (void)device;
+    return 1;
+}
+
+static int probe_vnc(const char* device) {
+    return strncmp(device, "vnc://", 6) == 0;
+}
+
+static int probe_x11(const char* device) {
+    return strncmp(device, "x11:", 4) == 0;
+}
+
+static int probe_wayland(const char* device) {
+    return strncmp(device, "wayland:", 8) == 0;
+}
+
+static int probe_drm(const char* device) {
+    if (strncmp(device, "/dev/dri/", 9) == 0) {
+        return 1;
+    }
+#ifdef USE_DRM
+    // 新内核可能不提供fbdev，默认设备不存在时改用第一块显卡的扫描输出
+    return strcmp(device, "/dev/fb0") == 0 && access(device, F_OK) != 0 &&
+           access("/dev/dri/card0", F_OK) == 0;
+#else
+    return 0;
+#endif
+}
+
+#if !defined(USE_X11) || !defined(USE_WAYLAND) || !defined(USE_DRM)
+// 编译时未启用的源仍占用设备名前缀，给出明确的错误
+static int open_disabled(GraphicsBuffer* buf, const char* device) {
+    fprintf(stderr, "未启用%s支持: %s\n", buf->source->name, device);
+    return -1;
+}
+#endif
+
+#ifdef USE_DRM
+static int open_drm(GraphicsBuffer* buf, const char* device) {
+    if (strncmp(device, "/dev/dri/", 9) != 0) {
+        if (app.verbose) {
+            printf("%s 不存在，改用 /dev/dri/card0\n", device);
+        }
+        device = "/dev/dri/card0";
+    }
+    return init_drm(buf, device);
+}
+#endif
+
+// 按顺序匹配设备名，最后的帧缓冲区设备接受任何名字
+static const CaptureSource capture_sources[] = {
+    { "VNC", "vnc://HOST[:PORT]", SERVER_VNC, CAPTURE_CAP_DAMAGE | CAPTURE_CAP_EVENTS,
+      probe_vnc, init_vnc, vnc_next_frame, NULL, release_vnc },
+#ifdef USE_X11
+#ifdef USE_XDAMAGE
+    { "X11", "x11:[DISPLAY][/WxH+X+Y]", SERVER_X11, CAPTURE_CAP_DAMAGE | CAPTURE_CAP_EVENTS,
+      probe_x11, init_x11, x11_next_frame, NULL, release_x11 },
+#else
+    { "X11", "x11:[DISPLAY][/WxH+X+Y]", SERVER_X11, 0,
+      probe_x11, init_x11, x11_next_frame, NULL, release_x11 },
+#endif
+#else
+    { "X11", "x11:[DISPLAY][/WxH+X+Y]", SERVER_X11, 0, probe_x11, open_disabled, NULL, NULL, NULL },
+#endif
+#ifdef USE_WAYLAND
+    { "Wayland", "wayland:[DISPLAY][/N]", SERVER_WAYLAND, CAPTURE_CAP_DAMAGE | CAPTURE_CAP_EVENTS,
+      probe_wayland, init_wayland, wayland_next_frame, wayland_release_frame, release_wayland },
+#else
+    { "Wayland", "wayland:[DISPLAY][/N]", SERVER_WAYLAND, 0, probe_wayland, open_disabled, NULL, NULL, NULL },
+#endif
+#ifdef USE_DRM
+    { "DRM/KMS", "/dev/dri/cardN[:K]", SERVER_FRAMEBUFFER, CAPTURE_CAP_ZERO_COPY,
+      probe_drm, open_drm, drm_next_frame, NULL, release_drm },
+#else
+    { "DRM/KMS", "/dev/dri/cardN[:K]", SERVER_FRAMEBUFFER, 0, probe_drm, open_disabled, NULL, NULL, NULL },
+#endif
+    { "录制回放", "FILE.gcrc", SERVER_REPLAY, CAPTURE_CAP_TIMED,
+      probe_replay, init_replay, replay_next_frame, NULL, release_replay },
+    { "原始帧文件", "FILE", SERVER_FILE, CAPTURE_CAP_ZERO_COPY,
+      probe_raw_file, init_raw_file, file_next_frame, NULL, release_framebuffer },
+    { "帧缓冲区", "/dev/fbN", SERVER_FRAMEBUFFER, CAPTURE_CAP_ZERO_COPY,
+      probe_framebuffer, init_framebuffer, framebuffer_next_frame, NULL, release_fbdev },
+};
+
+#define CAPTURE_SOURCE_COUNT (sizeof(capture_sources) / sizeof(capture_sources[0]))
+
+const CaptureSource* find_capture_source(const char* device) {
+    for (size_t i = 0; i < CAPTURE_SOURCE_COUNT; i++) {
+        if (capture_sources[i].probe(device)) {
+            return &capture_sources[i];
+        }
+    }
+    return NULL;
+}
+
+int init_source(GraphicsBuffer* buf, const char* device) {
+    const CaptureSource* source = find_capture_source(device);
+    
+    buf->source = source;
+    buf->caps = source->caps;
+    buf->damage_count = -1;
+    if (source->open(buf, device) != 0) {
+        buf->source = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void release_source(GraphicsBuffer* buf) {
+    if (buf->source && buf->source->close) {
+        buf->source->close(buf);
+    }
+    buf->source = NULL;
+}
+
+GraphicsBuffer* open_source(const char* device) {
+    GraphicsBuffer* buf = malloc(sizeof(GraphicsBuffer));
+    if (!buf) {
+        perror("分配内存失败");
+        return NULL;
+    }
+    
+    if (init_source(buf, device) != 0) {
+        free(buf);
+        return NULL;
+    }
+    
+    return buf;
+}
+
+void close_source(GraphicsBuffer* buf) {
+    if (buf) {
+        release_source(buf);
+        free(buf);
+    }
+}
+
+// 前进到下一帧，返回-1表示源已结束；实时映射的源没有取帧操作，内容始终是最新的
+int source_next_frame(GraphicsBuffer* buf) {
+    if (!buf->source->acquire_frame) {
+        return 0;
+    }
+    return buf->source->acquire_frame(buf);
+}
+
+// 调用方转换完当前帧后通知源，源可以开始准备下一帧
+void source_release_frame(GraphicsBuffer* buf) {
+    if (buf->source->release_frame) {
+        buf->source->release_frame(buf);
+    }
+}
+
+void print_capture_caps(unsigned int caps) {
+    static const char* names[] = { "变化区域", "零拷贝", "事件驱动", "自带时间轴" };
+    int printed = 0;
+    
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (caps & (1u << i)) {
+            printf("%s%s", printed++ ? " " : "", names[i]);
+        }
+    }
+    if (!printed) {
+        printf("轮询");
+    }
+}
+
+static uint64_t elapsed_us(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000ULL +
+           (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+// RLE编码：
+//   0x00-0x7F  后跟 n+1 个字面字节
+//   0x80-0xFE  后跟1字节，重复 (n & 0x7F) + 3 次
+//   0xFF       后跟4字节长度和1字节值 (长重复)
+size_t rle_bound(size_t len) {
+    return len + len / 128 + 16;
+}
+
+static size_t rle_flush_literals(const unsigned char* src, size_t len, unsigned char* dst) {
+    size_t o = 0;
+    while (len > 0) {
+        size_t n = len > 128 ? 128 : len;
+        dst[o++] = (unsigned char)(n - 1);
+        memcpy(dst + o, src, n);
+        o += n;
+        src += n;
+        len -= n;
+    }
+    return o;
+}
+
+size_t rle_encode(const unsigned char* src, size_t len, unsigned char* dst) {
+    size_t i = 0, o = 0, literal = 0;
+    
+    while (i < len) {
+        unsigned char v = src[i];
+        size_t run = 1;
+        
+        // 差分帧大部分是0，按8字节跳过
+        if (v == 0) {
+            uint64_t word;
+            while (i + run + 8 <= len) {
+                memcpy(&word, src + i + run, 8);
+                if (word != 0) break;
+                run += 8;
+            }
+        }
+        while (i + run < len && src[i + run] == v) run++;
+        
+        if (run < 3) {
+            i += run;
+            continue;
+        }
+        
+        o += rle_flush_literals(src + literal, i - literal, dst + o);
+        if (run <= 129) {
+            dst[o++] = (unsigned char)(0x80 | (run - 3));
+        } else {
+            uint32_t n = (uint32_t)run;
+            dst[o++] = 0xFF;
+            memcpy(dst + o, &n, 4);
+            o += 4;
+        }
+        dst[o++] = v;
+        i += run;
+        literal = i;
+    }
+    
+    o += rle_flush_literals(src + literal, len - literal, dst + o);
+    return o;
+}
+
+// xor_mode下输出与dst异或 (应用差分帧)，0值重复直接跳过
+int rle_decode(const unsigned char* src, size_t len, unsigned char* dst, size_t dst_len, int xor_mode) {
+    size_t i = 0, o = 0;
+    
+    while (i < len) {
+        unsigned char token = src[i++];
+        
+        if (token < 0x80) {
+            size_t n = (size_t)token + 1;
+            if (i + n > len || o + n > dst_len) return -1;
+            if (xor_mode) {
+                for (size_t k = 0; k < n; k++) dst[o + k] ^= src[i + k];
+            } else {
+                memcpy(dst + o, src + i, n);
+            }
+            i += n;
+            o += n;
+        } else {
+            size_t n;
+            if (token == 0xFF) {
+                uint32_t ext;
+                if (i + 4 > len) return -1;
+                memcpy(&ext, src + i, 4);
+                i += 4;
+                n = ext;
+            } else {
+                n = (size_t)(token & 0x7F) + 3;
+            }
+            if (i >= len || o + n > dst_len) return -1;
+            unsigned char v = src[i++];
+            if (!xor_mode) {
+                memset(dst + o, v, n);
+            } else if (v != 0) {
+                for (size_t k = 0; k < n; k++) dst[o + k] ^= v;
+            }
+            o += n;
+        }
+    }
+    
+    return o == dst_len ? 0 : -1;
+}
+
+static void* recorder_thread_func(void* arg) {
+    FrameRecorder* rec = (FrameRecorder*)arg;
+    int metrics_slot = metrics_thread_register("recorder");
+    
+    for (;;) {
+        pthread_mutex_lock(&rec->lock);
+        while (atomic_load(&rec->tail) == atomic_load(&rec->head) && !rec->stop) {
+            pthread_cond_wait(&rec->cond, &rec->lock);
+        }
+        if (atomic_load(&rec->tail) == atomic_load(&rec->head)) {
+            pthread_mutex_unlock(&rec->lock);
+            break;
+        }
+        pthread_mutex_unlock(&rec->lock);
+        
+        unsigned long tail = atomic_load(&rec->tail);
+        int slot = tail % RECORD_QUEUE_DEPTH;
+        unsigned char* frame = rec->slots[slot];
+        RecordFrameHeader fh = {0};
+        
+        fh.raw_size = rec->frame_size;
+        fh.timestamp_us = rec->stamps[slot];
+        
+        if (rec->frames_written % RECORD_KEYFRAME_INTERVAL == 0) {
+            fh.type = RECORD_KEYFRAME;
+            fh.comp_size = rle_encode(frame, rec->frame_size, rec->packed);
+        } else {
+            fh.type = RECORD_DELTA;
+            for (size_t i = 0; i < rec->frame_size; i++) {
+                rec->delta[i] = frame[i] ^ rec->prev[i];
+            }
+            fh.comp_size = rle_encode(rec->delta, rec->frame_size, rec->packed);
+        }
+        
+        if (rec->index_count == rec->index_capacity) {
+            size_t capacity = rec->index_capacity ? rec->index_capacity * 2 : 256;
+            RecordIndexEntry* index = realloc(rec->index, capacity * sizeof(RecordIndexEntry));
+            if (index) {
+                rec->index = index;
+                rec->index_capacity = capacity;
+            }
+        }
+        if (rec->index_count < rec->index_capacity) {
+            RecordIndexEntry* entry = &rec->index[rec->index_count++];
+            entry->offset = rec->offset;
+            entry->timestamp_us = fh.timestamp_us;
+            entry->type = fh.type;
+            entry->reserved = 0;
+        }
+        
+        if (!rec->write_error &&
+            (fwrite(&fh, sizeof(fh), 1, rec->fp) != 1 ||
+             fwrite(rec->packed, 1, fh.comp_size, rec->fp) != fh.comp_size)) {
+            perror("写入录制文件失败");
+            rec->write_error = 1;
+        }
+        rec->offset += sizeof(fh) + fh.comp_size;
+        rec->frames_written++;
+        
+        // 当前帧成为新的参考帧，旧参考帧的缓冲区还给队列
+        rec->slots[slot] = rec->prev;
+        rec->prev = frame;
+        atomic_store(&rec->tail, tail + 1);
+    }
+    
+    metrics_thread_unregister(metrics_slot);
+    return NULL;
+}
+
+FrameRecorder* recorder_start(const char* path, GraphicsBuffer* buf) {
+    // 录制格式只保存像素，调色板会随时间变化，无法回放
+    if (buf->format == PIXFMT_PALETTE8) {
+        fprintf(stderr, "调色板帧缓冲区不支持录制\n");
+        return NULL;
+    }
+    
+    FrameRecorder* rec = calloc(1, sizeof(FrameRecorder));
+    if (!rec) {
+        perror("分配内存失败");
+        return NULL;
+    }
+    
+    int bytes_pp = buf->bpp / 8 > 0 ? buf->bpp / 8 : 1;
+    memcpy(rec->header.magic, RECORD_MAGIC, 4);
+    rec->header.version = 1;
+    rec->header.width = buf->width;
+    rec->header.height = buf->height;
+    rec->header.stride = buf->width * bytes_pp;
+    rec->header.format = buf->format;
+    rec->header.bpp = buf->bpp;
+    rec->header.layout = buf->format == PIXFMT_BITFIELD ? pixel_layout_pack(&buf->layout) : 0;
+    rec->frame_size = (size_t)rec->header.stride * buf->height;
+    
+    int ok = 1;
+    for (int i = 0; i < RECORD_QUEUE_DEPTH; i++) {
+        rec->slots[i] = malloc(rec->frame_size);
+        ok = ok && rec->slots[i];
+    }
+    rec->prev = calloc(1, rec->frame_size);
+    rec->delta = malloc(rec->frame_size);
+    rec->packed = malloc(rle_bound(rec->frame_size));
+    rec->fp = ok && rec->prev && rec->delta && rec->packed ? fopen(path, "wb") : NULL;
+    
+    if (!rec->fp) {
+        perror("创建录制文件失败");
+        for (int i = 0; i < RECORD_QUEUE_DEPTH; i++) free(rec->slots[i]);
+        free(rec->prev);
+        free(rec->delta);
+        free(rec->packed);
+        free(rec);
+        return NULL;
+    }
+    
+    if (fwrite(&rec->header, sizeof(rec->header), 1, rec->fp) != 1) {
+        perror("写入录制文件失败");
+        rec->write_error = 1;
+    }
+    rec->offset = sizeof(rec->header);
+    atomic_init(&rec->head, 0);
+    atomic_init(&rec->tail, 0);
+    atomic_init(&rec->frames_dropped, 0);
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &rec->start);
+    pthread_create(&rec->thread, NULL, recorder_thread_func, rec);
+    
+    return rec;
+}
+
+// 捕获线程调用：队列满时丢弃该帧的录制，不阻塞捕获
+void recorder_submit(FrameRecorder* rec, GraphicsBuffer* buf) {
+    unsigned long head = atomic_load(&rec->head);
+    
+    if (head - atomic_load(&rec->tail) >= RECORD_QUEUE_DEPTH ||
+        buf->width != (int)rec->header.width || buf->height != (int)rec->header.height) {
+        atomic_fetch_add(&rec->frames_dropped, 1);
+        return;
+    }
+    
+    int slot = head % RECORD_QUEUE_DEPTH;
+    unsigned char* dst = rec->slots[slot];
+    const unsigned char* src = (const unsigned char*)buf->buffer;
+    
+    // 源缓冲区在释放帧后即失效，只能在捕获线程上拷贝；行距一致时整块拷贝
+    if ((uint32_t)buf->line_length == rec->header.stride) {
+        memcpy(dst, src, rec->frame_size);
+    } else {
+        for (int y = 0; y < buf->height; y++) {
+            memcpy(dst + (size_t)y * rec->header.stride,
+                   src + (size_t)y * buf->line_length, rec->header.stride);
+        }
+    }
+    rec->stamps[slot] = elapsed_us(&rec->start);
+    atomic_store(&rec->head, head + 1);
+    
+    pthread_mutex_lock(&rec->lock);
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+}
+
+void recorder_stop(FrameRecorder* rec) {
+    if (!rec) return;
+    
+    pthread_mutex_lock(&rec->lock);
+    rec->stop = 1;
+    pthread_cond_signal(&rec->cond);
+    pthread_mutex_unlock(&rec->lock);
+    pthread_join(rec->thread, NULL);
+    
+    // 写入尾部索引
+    RecordFooter footer;
+    memcpy(footer.magic, RECORD_INDEX_MAGIC, 4);
+    footer.count = rec->index_count;
+    footer.index_offset = rec->offset;
+    int failed = rec->write_error ||
+                 fwrite(rec->index, sizeof(RecordIndexEntry), rec->index_count, rec->fp) != rec->index_count ||
+                 fwrite(&footer, sizeof(footer), 1, rec->fp) != 1;
+    if (fclose(rec->fp) != 0 || failed) {
+        fprintf(stderr, "录制文件不完整: 写入失败\n");
+    }
+    
+    if (app.verbose) {
+        printf("  录制帧数: %ld (丢弃 %ld)\n", rec->frames_written,
+               (long)atomic_load(&rec->frames_dropped));
+    }
+    
+    for (int i = 0; i < RECORD_QUEUE_DEPTH; i++) free(rec->slots[i]);
+    free(rec->prev);
+    free(rec->delta);
+    free(rec->packed);
+    free(rec->index);
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->cond);
+    free(rec);
+}
+
+// 没有有效尾部索引时 (录制被中断) 顺序扫描帧记录重建索引
+static int replay_build_index(ReplayState* replay, size_t frame_size) {
+    RecordFooter footer;
+    
+    if (replay->map_size >= sizeof(RecordHeader) + sizeof(footer)) {
+        memcpy(&footer, replay->map + replay->map_size - sizeof(footer), sizeof(footer));
+        // 全部用减法比较，构造的index_offset/count不能借加法回绕通过检查
+        size_t index_end = replay->map_size - sizeof(footer);
+        if (memcmp(footer.magic, RECORD_INDEX_MAGIC, 4) == 0 &&
+            footer.index_offset >= sizeof(RecordHeader) && footer.index_offset <= index_end &&
+            footer.count <= INT_MAX &&
+            footer.count <= (index_end - footer.index_offset) / sizeof(RecordIndexEntry) &&
+            footer.count * sizeof(RecordIndexEntry) == index_end - footer.index_offset) {
+            replay->count = footer.count;
+            replay->index = malloc((footer.count + 1) * sizeof(RecordIndexEntry));
+            if (!replay->index) return -1;
+            memcpy(replay->index, replay->map + footer.index_offset,
+                   footer.count * sizeof(RecordIndexEntry));
+            return 0;
+        }
+    }
+    
+    size_t capacity = 256;
+    size_t offset = sizeof(RecordHeader);
+    replay->count = 0;
+    replay->index = malloc(capacity * sizeof(RecordIndexEntry));
+    if (!replay->index) return -1;
+    
+    while (offset + sizeof(RecordFrameHeader) <= replay->map_size) {
+        RecordFrameHeader fh;
+        memcpy(&fh, replay->map + offset, sizeof(fh));
+        if ((fh.type != RECORD_KEYFRAME && fh.type != RECORD_DELTA) ||
+            fh.raw_size != frame_size ||
+            fh.comp_size > replay->map_size - offset - sizeof(fh)) {
+            break;
+        }
+        if ((size_t)replay->count == capacity) {
+            capacity *= 2;
+            RecordIndexEntry* index = realloc(replay->index, capacity * sizeof(RecordIndexEntry));
+            if (!index) return -1;
+            replay->index = index;
+        }
+        RecordIndexEntry* entry = &replay->index[replay->count++];
+        entry->offset = offset;
+        entry->timestamp_us = fh.timestamp_us;
+        entry->type = fh.type;
+        entry->reserved = 0;
+        offset += sizeof(fh) + fh.comp_size;
+    }
+    
+    return 0;
+}
+
+int init_replay(GraphicsBuffer* buf, const char* path) {
+    RecordHeader header;
+    
+    if (buf->device != path) {
+        snprintf(buf->device, sizeof(buf->device), "%s", path);
+    }
+    buf->type = SERVER_REPLAY;
+    buf->priv = NULL;
+    buf->buffer = NULL;
+    buf->frame_index = 0;
+    
+    buf->fd = open(path, O_RDONLY);
+    if (buf->fd < 0) {
+        perror("打开录制文件失败");
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(buf->fd, &st) < 0 || (size_t)st.st_size < sizeof(header)) {
+        fprintf(stderr, "录制文件无效: %s\n", path);
+        close(buf->fd);
+        buf->fd = -1;
+        return -1;
+    }
+    buf->map_size = st.st_size;
+    buf->map_base = mmap(NULL, buf->map_size, PROT_READ, MAP_SHARED, buf->fd, 0);
+    if (buf->map_base == MAP_FAILED) {
+        perror("映射录制文件失败");
+        buf->map_base = NULL;
+        close(buf->fd);
+        buf->fd = -1;
+        return -1;
+    }
+    
+    memcpy(&header, buf->map_base, sizeof(header));
+    if (header.version != 1 || header.format >= PIXFMT_PALETTE8 ||
+        !frame_geometry_valid(header.width, header.height, header.stride,
+                              (PixelFormat)header.format, header.bpp)) {
+        fprintf(stderr, "不支持的录制文件: %s\n", path);
+        release_framebuffer(buf);
+        return -1;
+    }
+    
+    buf->width = header.width;
+    buf->height = header.height;
+    buf->line_length = header.stride;
+    buf->bpp = header.bpp;
+    buf->format = (PixelFormat)header.format;
+    pixel_layout_unpack(&buf->layout, header.layout, header.bpp);
+    buf->size = (size_t)header.stride * header.height;
+    
+    ReplayState* replay = calloc(1, sizeof(ReplayState));
+    if (!replay) {
+        perror("分配内存失败");
+        release_framebuffer(buf);
+        return -1;
+    }
+    replay->map = (const unsigned char*)buf->map_base;
+    replay->map_size = buf->map_size;
+    replay->current = -1;
+    replay->speed = app.replay_speed;
+    replay->seek_us = (uint64_t)(app.replay_seek * 1e6);
+    replay->frame = calloc(1, buf->size);
+    buf->priv = replay;
+    
+    if (!replay->frame || replay_build_index(replay, buf->size) != 0 || replay->count == 0) {
+        fprintf(stderr, "录制文件中没有可用的帧: %s\n", path);
+        release_replay(buf);
+        return -1;
+    }
+    
+    buf->frame_count = replay->count;
+    buf->buffer = replay->frame;
+    clock_gettime(CLOCK_MONOTONIC, &replay->start);
+    return 0;
+}
+
+static int replay_decode_frame(ReplayState* replay, int n, size_t frame_size) {
+    RecordFrameHeader fh;
+    const RecordIndexEntry* entry = &replay->index[n];
+    
+    if (entry->offset > replay->map_size - sizeof(fh)) return -1;
+    memcpy(&fh, replay->map + entry->offset, sizeof(fh));
+    if (fh.raw_size != frame_size || fh.comp_size > replay->map_size - sizeof(fh) - entry->offset) {
+        return -1;
+    }
+    
+    return rle_decode(replay->map + entry->offset + sizeof(fh), fh.comp_size,
+                      replay->frame, frame_size, fh.type == RECORD_DELTA);
+}
+
+// 解码到第target帧：能从当前帧向前推进就继续应用差分，否则从最近的关键帧开始
+static int replay_seek_frame(ReplayState* replay, int target, size_t frame_size) {
+    int key = target;
+    while (key > 0 && replay->index[key].type != RECORD_KEYFRAME) key--;
+    
+    int from = replay->current >= key && replay->current <= target ? replay->current + 1 : key;
+    for (int n = from; n <= target; n++) {
+        if (replay_decode_frame(replay, n, frame_size) != 0) {
+            fprintf(stderr, "录制文件第 %d 帧损坏\n", n);
+            return -1;
+        }
+        replay->current = n;
+    }
+    return 0;
+}
+
+int replay_next_frame(GraphicsBuffer* buf) {
+    ReplayState* replay = (ReplayState*)buf->priv;
+    uint64_t base = replay->index[0].timestamp_us + replay->seek_us;
+    int target;
+    
+    if (replay->current < 0) {
+        // 首帧：定位到起始时间
+        target = 0;
+        while (target + 1 < replay->count && replay->index[target + 1].timestamp_us <= base) target++;
+    } else if (replay->current + 1 >= replay->count) {
+        return -1;
+    } else if (replay->speed <= 0) {
+        target = replay->current + 1;
+    } else {
+        // 实时回放：等到下一帧到期，然后跳到已到期的最新一帧
+        uint64_t now = base + (uint64_t)(elapsed_us(&replay->start) * replay->speed);
+        uint64_t due = replay->index[replay->current + 1].timestamp_us;
+        if (due > now) {
+            usleep((useconds_t)((due - now) / replay->speed));
+            now = due;
+        }
+        target = replay->current + 1;
+        while (target + 1 < replay->count && replay->index[target + 1].timestamp_us <= now) target++;
+    }
+    
+    if (replay_seek_frame(replay, target, buf->size) != 0) {
+        return -1;
+    }
+    buf->frame_index = replay->current;
+    return 0;
+}
+
+void release_replay(GraphicsBuffer* buf) {
+    ReplayState* replay = (ReplayState*)buf->priv;
+    if (replay) {
+        free(replay->index);
+        free(replay->frame);
+        free(replay);
+        buf->priv = NULL;
+    }
+    release_framebuffer(buf);
+}
+
+int rgb_to_brightness(int r, int g, int b) {
+    // 使用标准亮度公式
+    return (int)(0.299 * r + 0.587 * g + 0.114 * b);
+}
+
+// 像素解码：按格式选定的行内核，xoff为各采样点在行内的字节偏移，结果写入字符单元的r/g/b
+typedef void (*PixelRowDecoder)(const uint8_t* row, const int* xoff, int count, TextCell* cell,
+                                const PixelLayout* layout);
+
+// 8位通道：直接按字节取
+#define DEFINE_BYTE_DECODER(name, r_index, g_index, b_index) \
+static void name(const uint8_t* row, const int* xoff, int count, TextCell* cell, \
+                 const PixelLayout* layout) { \
+    (void)layout; \
+    for (int i = 0; i < count; i++, cell++) { \
+        const uint8_t* p = row + xoff[i]; \
+        cell->r = p[r_index]; \
+        cell->g = p[g_index]; \
+        cell->b = p[b_index]; \
+    } \
+}
+
+DEFINE_BYTE_DECODER(decode_rgb888, 0, 1, 2)
+DEFINE_BYTE_DECODER(decode_bgr888, 2, 1, 0)
+DEFINE_BYTE_DECODER(decode_argb8888, 1, 2, 3)
+DEFINE_BYTE_DECODER(decode_abgr8888, 3, 2, 1)
+
+// 5位和6位通道按位复制扩展到8位，保证满值为255
+static inline uint8_t expand5(unsigned v) { return (uint8_t)(v << 3 | v >> 2); }
+static inline uint8_t expand6(unsigned v) { return (uint8_t)(v << 2 | v >> 4); }
+
+static void decode_rgb565(const uint8_t* row, const int* xoff, int count, TextCell* cell,
+                          const PixelLayout* layout) {
+    (void)layout;
+    for (int i = 0; i < count; i++, cell++) {
+        uint16_t v;
+        memcpy(&v, row + xoff[i], 2);
+        cell->r = expand5(v >> 11);
+        cell->g = expand6((v >> 5) & 0x3F);
+        cell->b = expand5(v & 0x1F);
+    }
+}
+
+static void decode_bgr565(const uint8_t* row, const int* xoff, int count, TextCell* cell,
+                          const PixelLayout* layout) {
+    (void)layout;
+    for (int i = 0; i < count; i++, cell++) {
+        uint16_t v;
+        memcpy(&v, row + xoff[i], 2);
+        cell->r = expand5(v & 0x1F);
+        cell->g = expand6((v >> 5) & 0x3F);
+        cell->b = expand5(v >> 11);
+    }
+}
+
+static void decode_rgb555(const uint8_t* row, const int* xoff, int count, TextCell* cell,
+                          const PixelLayout* layout) {
+    (void)layout;
+    for (int i = 0; i < count; i++, cell++) {
+        uint16_t v;
+        memcpy(&v, row + xoff[i], 2);
+        cell->r = expand5((v >> 10) & 0x1F);
+        cell->g = expand5((v >> 5) & 0x1F);
+        cell->b = expand5(v & 0x1F);
+    }
+}
+
+static void decode_xrgb2101010(const uint8_t* row, const int* xoff, int count, TextCell* cell,
+                               const PixelLayout* layout) {
+    (void)layout;
+    for (int i = 0; i < count; i++, cell++) {
+        uint32_t v;
+        memcpy(&v, row + xoff[i], 4);
+        cell->r = (v >> 22) & 0xFF;
+        cell->g = (v >> 12) & 0xFF;
+        cell->b = (v >> 2) & 0xFF;
+    }
+}
+
+// 通用位域：按本机字节序读出像素值，再逐通道移位、屏蔽并缩放到8位
+static void decode_bitfield(const uint8_t* row, const int* xoff, int count, TextCell* cell,
+                            const PixelLayout* layout) {
+    const PixelField* fields[3] = { &layout->red, &layout->green, &layout->blue };
+    uint32_t mask[3], scale[3];
+    int shift[3];
+    
+    for (int c = 0; c < 3; c++) {
+        mask[c] = (1u << fields[c]->length) - 1;
+        // 超过8位的通道取高8位，不足8位的乘以 255/mask (16.16定点)
+        shift[c] = fields[c]->length > 8 ? fields[c]->length - 8 : 0;
+        scale[c] = fields[c]->length >= 8 ? 0 : (255u << 16) / mask[c];
+    }
+    
+    for (int i = 0; i < count; i++, cell++) {
+        const uint8_t* p = row + xoff[i];
+        uint32_t v = 0;
+        switch (layout->bytes) {
+            case 1: v = p[0]; break;
+            case 2: { uint16_t v16; memcpy(&v16, p, 2); v = v16; break; }
+            case 3: v = p[0] | p[1] << 8 | (uint32_t)p[2] << 16; break;
+            default: memcpy(&v, p, 4); break;
+        }
+        
+        uint8_t out[3];
+        for (int c = 0; c < 3; c++) {
+            uint32_t x = (v >> fields[c]->offset) & mask[c];
+            out[c] = scale[c] ? (uint8_t)((x * scale[c] + 0x8000) >> 16) : (uint8_t)(x >> shift[c]);
+        }
+        cell->r = out[0];
+        cell->g = out[1];
+        cell->b = out[2];
+    }
+}
+
+// 调色板：每像素一次查表
+static void decode_palette8(const uint8_t* row, const int* xoff, int count, TextCell* cell,
+                            const PixelLayout* layout) {
+    const uint32_t* lut = layout->palette;
+    for (int i = 0; i < count; i++, cell++) {
+        uint32_t c = lut[row[xoff[i]]];
+        cell->r = c >> 16;
+        cell->g = (c >> 8) & 0xFF;
+        cell->b = c & 0xFF;
+    }
+}
+
+// 不认识的格式只能按首字节灰度显示 (打开源时已给出警告)
+static void decode_gray(const uint8_t* row, const int* xoff, int count, TextCell* cell,
+                        const PixelLayout* layout) {
+    (void)layout;
+    for (int i = 0; i < count; i++, cell++) {
+        cell->r = cell->g = cell->b = row[xoff[i]];
+    }
+}
+
+static const PixelRowDecoder pixel_decoders[PIXFMT_UNKNOWN + 1] = {
+    [PIXFMT_RGB565] = decode_rgb565,
+    [PIXFMT_RGB888] = decode_rgb888,
+    [PIXFMT_BGR888] = decode_bgr888,
+    [PIXFMT_RGBA8888] = decode_rgb888,
+    [PIXFMT_BGRA8888] = decode_bgr888,
+    [PIXFMT_ARGB8888] = decode_argb8888,
+    [PIXFMT_ABGR8888] = decode_abgr8888,
+    [PIXFMT_RGB555] = decode_rgb555,
+    [PIXFMT_BGR565] = decode_bgr565,
+    [PIXFMT_XRGB2101010] = decode_xrgb2101010,
+    [PIXFMT_BITFIELD] = decode_bitfield,
+    [PIXFMT_PALETTE8] = decode_palette8,
+    [PIXFMT_UNKNOWN] = decode_gray,
+};
+
+static PixelRowDecoder pixel_decoder(PixelFormat format) {
+    return (unsigned)format <= PIXFMT_UNKNOWN ? pixel_decoders[format] : decode_gray;
+}
+
+static int bytes_per_pixel(const GraphicsBuffer* buf) {
+    return buf->bpp >= 8 ? buf->bpp / 8 : 1;
+}
+
+int get_pixel_color(GraphicsBuffer* buf, int x, int y, int* r, int* g, int* b) {
+    if (x < 0 || x >= buf->width || y < 0 || y >= buf->height) {
+        return -1;
+    }
+    
+    int offset = x * bytes_per_pixel(buf);
+    TextCell cell;
+    pixel_decoder(buf->format)((const uint8_t*)buf->buffer + (size_t)y * buf->line_length,
+                               &offset, 1, &cell, &buf->layout);
+    *r = cell.r;
+    *g = cell.g;
+    *b = cell.b;
+    return 0;
+}
+
+// DES加密 (仅用于VNC认证)，置换表的位序号从最高位1开始
+static const uint8_t des_ip[64] = {
+    58, 50, 42, 34, 26, 18, 10, 2, 60, 52, 44, 36, 28, 20, 12, 4,
+    62, 54, 46, 38, 30, 22, 14, 6, 64, 56, 48, 40, 32, 24, 16, 8,
+    57, 49, 41, 33, 25, 17, 9, 1, 59, 51, 43, 35, 27, 19, 11, 3,
+    61, 53, 45, 37, 29, 21, 13, 5, 63, 55, 47, 39, 31, 23, 15, 7
+};
+static const uint8_t des_fp[64] = {
+    40, 8, 48, 16, 56, 24, 64, 32, 39, 7, 47, 15, 55, 23, 63, 31,
+    38, 6, 46, 14, 54, 22, 62, 30, 37, 5, 45, 13, 53, 21, 61, 29,
+    36, 4, 44, 12, 52, 20, 60, 28, 35, 3, 43, 11, 51, 19, 59, 27,
+    34, 2, 42, 10, 50, 18, 58, 26, 33, 1, 41, 9, 49, 17, 57, 25
+};
+static const uint8_t des_e[48] = {
+    32, 1, 2, 3, 4, 5, 4, 5, 6, 7, 8, 9, 8, 9, 10, 11,
+    12, 13, 12, 13, 14, 15, 16, 17, 16, 17, 18, 19, 20, 21, 20, 21,
+    22, 23, 24, 25, 24, 25, 26, 27, 28, 29, 28, 29, 30, 31, 32, 1
+};
+static const uint8_t des_p[32] = {
+    16, 7, 20, 21, 29, 12, 28, 17, 1, 15, 23, 26, 5, 18, 31, 10,
+    2, 8, 24, 14, 32, 27, 3, 9, 19, 13, 30, 6, 22, 11, 4, 25
+};
+static const uint8_t des_pc1[56] = {
+    57, 49, 41, 33, 25, 17, 9, 1, 58, 50, 42, 34, 26, 18,
+    10, 2, 59, 51, 43, 35, 27, 19, 11, 3, 60, 52, 44, 36,
+    63, 55, 47, 39, 31, 23, 15, 7, 62, 54, 46, 38, 30, 22,
+    14, 6, 61, 53, 45, 37, 29, 21, 13, 5, 28, 20, 12, 4
+};
+static const uint8_t des_pc2[48] = {
+    14, 17, 11, 24, 1, 5, 3, 28, 15, 6, 21, 10,
+    23, 19, 12, 4, 26, 8, 16, 7, 27, 20, 13, 2,
+    41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+    44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32
+};
+static const uint8_t des_shifts[16] = { 1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1 };
+static const uint8_t des_sbox[8][64] = {
+    { 14, 4, 13, 1, 2, 15, 11, 8, 3, 10, 6, 12, 5, 9, 0, 7,
+      0, 15, 7, 4, 14, 2, 13, 1, 10, 6, 12, 11, 9, 5, 3, 8,
+      4, 1, 14, 8, 13, 6, 2, 11, 15, 12, 9, 7, 3, 10, 5, 0,
+      15, 12, 8, 2, 4, 9, 1, 7, 5, 11, 3, 14, 10, 0, 6, 13 },
+    { 15, 1, 8, 14, 6, 11, 3, 4, 9, 7, 2, 13, 12, 0, 5, 10,
+      3, 13, 4, 7, 15, 2, 8, 14, 12, 0, 1, 10, 6, 9, 11, 5,
+      0, 14, 7, 11, 10, 4, 13, 1, 5, 8, 12, 6, 9, 3, 2, 15,
+      13, 8, 10, 1, 3, 15, 4, 2, 11, 6, 7, 12, 0, 5, 14, 9 },
+    { 10, 0, 9, 14, 6, 3, 15, 5, 1, 13, 12, 7, 11, 4, 2, 8,
+      13, 7, 0, 9, 3, 4, 6, 10, 2, 8, 5, 14, 12, 11, 15, 1,
+      13, 6, 4, 9, 8, 15, 3, 0, 11, 1, 2, 12, 5, 10, 14, 7,
+      1, 10, 13, 0, 6, 9, 8, 7, 4, 15, 14, 3, 11, 5, 2, 12 },
+    { 7, 13, 14, 3, 0, 6, 9, 10, 1, 2, 8, 5, 11, 12, 4, 15,
+      13, 8, 11, 5, 6, 15, 0, 3, 4, 7, 2, 12, 1, 10, 14, 9,
+      10, 6, 9, 0, 12, 11, 7, 13, 15, 1, 3, 14, 5, 2, 8, 4,
+      3, 15, 0, 6, 10, 1, 13, 8, 9, 4, 5, 11, 12, 7, 2, 14 },
+    { 2, 12, 4, 1, 7, 10, 11, 6, 8, 5, 3, 15, 13, 0, 14, 9,
+      14, 11, 2, 12, 4, 7, 13, 1, 5, 0, 15, 10, 3, 9, 8, 6,
+      4, 2, 1, 11, 10, 13, 7, 8, 15, 9, 12, 5, 6, 3, 0, 14,
+      11, 8, 12, 7, 1, 14, 2, 13, 6, 15, 0, 9, 10, 4, 5, 3 },
+    { 12, 1, 10, 15, 9, 2, 6, 8, 0, 13, 3, 4, 14, 7, 5, 11,
+      10, 15, 4, 2, 7, 12, 9, 5, 6, 1, 13, 14, 0, 11, 3, 8,
+      9, 14, 15, 5, 2, 8, 12, 3, 7, 0, 4, 10, 1, 13, 11, 6,
+      4, 3, 2, 12, 9, 5, 15, 10, 11, 14, 1, 7, 6, 0, 8, 13 },
+    { 4, 11, 2, 14, 15, 0, 8, 13, 3, 12, 9, 7, 5, 10, 6, 1,
+      13, 0, 11, 7, 4, 9, 1, 10, 14, 3, 5, 12, 2, 15, 8, 6,
+      1, 4, 11, 13, 12, 3, 7, 14, 10, 15, 6, 8, 0, 5, 9, 2,
+      6, 11, 13, 8, 1, 4, 10, 7, 9, 5, 0, 15, 14, 2, 3, 12 },
+    { 13, 2, 8, 4, 6, 15, 11, 1, 10, 9, 3, 14, 5, 0, 12, 7,
+      1, 15, 13, 8, 10, 3, 7, 4, 12, 5, 6, 11, 0, 14, 9, 2,
+      7, 11, 4, 1, 9, 12, 14, 2, 0, 6, 10, 13, 15, 3, 5, 8,
+      2, 1, 14, 7, 4, 10, 8, 13, 15, 12, 9, 0, 3, 5, 6, 11 }
+};
+
+static uint64_t des_permute(uint64_t in, int in_bits, const uint8_t* table, int out_bits) {
+    uint64_t out = 0;
+    for (int i = 0; i < out_bits; i++) {
+        out = (out << 1) | ((in >> (in_bits - table[i])) & 1);
+    }
+    return out;
+}
+
+static uint64_t des_encrypt_block(uint64_t key, uint64_t block) {
+    uint64_t subkeys[16];
+    uint64_t cd = des_permute(key, 64, des_pc1, 56);
+    uint32_t c = cd >> 28, d = cd & 0xFFFFFFF;
+    
+    for (int i = 0; i < 16; i++) {
+        c = ((c << des_shifts[i]) | (c >> (28 - des_shifts[i]))) & 0xFFFFFFF;
+        d = ((d << des_shifts[i]) | (d >> (28 - des_shifts[i]))) & 0xFFFFFFF;
+        subkeys[i] = des_permute(((uint64_t)c << 28) | d, 56, des_pc2, 48);
+    }
+    
+    uint64_t lr = des_permute(block, 64, des_ip, 64);
+    uint32_t l = lr >> 32, r = lr & 0xFFFFFFFF;
+    for (int i = 0; i < 16; i++) {
+        uint64_t e = des_permute(r, 32, des_e, 48) ^ subkeys[i];
+        uint32_t sout = 0;
+        for (int j = 0; j < 8; j++) {
+            int six = (e >> (42 - 6 * j)) & 0x3F;
+            int row = ((six & 0x20) >> 4) | (six & 1);
+            sout = (sout << 4) | des_sbox[j][row * 16 + ((six >> 1) & 0xF)];
+        }
+        uint32_t f = des_permute(sout, 32, des_p, 32);
+        uint32_t next = l ^ f;
+        l = r;
+        r = next;
+    }
+    
+    return des_permute(((uint64_t)r << 32) | l, 64, des_fp, 64);
+}
+
+// VNC认证：密码截断/补零到8字节，每字节位序反转后作为DES密钥加密16字节挑战
+static void vnc_encrypt_challenge(const char* password, uint8_t challenge[16]) {
+    uint64_t key = 0;
+    size_t len = strlen(password);
+    
+    for (int i = 0; i < 8; i++) {
+        uint8_t c = i < (int)len ? (uint8_t)password[i] : 0;
+        uint8_t reversed = 0;
+        for (int b = 0; b < 8; b++) {
+            reversed |= ((c >> b) & 1) << (7 - b);
+        }
+        key = (key << 8) | reversed;
+    }
+    
+    for (int half = 0; half < 2; half++) {
+        uint8_t* p = challenge + half * 8;
+        uint64_t block = 0;
+        for (int i = 0; i < 8; i++) {
+            block = (block << 8) | p[i];
+        }
+        block = des_encrypt_block(key, block);
+        for (int i = 7; i >= 0; i--) {
+            p[i] = block & 0xFF;
+            block >>= 8;
+        }
+    }
+}
+
+// RFB协议字段为大端序
+static void put_be16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+static void put_be32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = (v >> 16) & 0xFF;
+    p[2] = (v >> 8) & 0xFF;
+    p[3] = v & 0xFF;
+}
+
+static uint16_t get_be16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t get_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// 带缓冲的读取，大块数据直接读到目标
+static int vnc_read(VncState* vnc, void* data, size_t len) {
+    uint8_t* out = data;
+    
+    if (vnc->replay) {
+        if (len > vnc->replay_len - vnc->replay_pos) return -1;
+        memcpy(out, vnc->replay + vnc->replay_pos, len);
+        vnc->replay_pos += len;
+        vnc->bytes_in += len;
+        return 0;
+    }
+    
+    size_t total = len;
+    
+    while (len > 0) {
+        if (vnc->rpos < vnc->rlen) {
+            size_t n = vnc->rlen - vnc->rpos;
+            if (n > len) n = len;
+            memcpy(out, vnc->rbuf + vnc->rpos, n);
+            vnc->rpos += n;
+            out += n;
+            len -= n;
+            continue;
+        }
+        
+        ssize_t n;
+        if (len >= sizeof(vnc->rbuf)) {
+            n = read(vnc->fd, out, len);
+            if (n > 0) {
+                out += n;
+                len -= n;
+                continue;
+            }
+        } else {
+            n = read(vnc->fd, vnc->rbuf, sizeof(vnc->rbuf));
+            if (n > 0) {
+                vnc->rpos = 0;
+                vnc->rlen = n;
+                continue;
+            }
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) fprintf(stderr, "VNC服务器关闭了连接\n");
+        else perror("读取VNC数据失败");
+        return -1;
+    }
+    
+    vnc->bytes_in += total;
+    if (vnc->trace) {
+        fwrite(data, 1, total, vnc->trace);
+    }
+    return 0;
+}
+
+static int vnc_skip(VncState* vnc, size_t len) {
+    uint8_t scratch[1024];
+    while (len > 0) {
+        size_t n = len > sizeof(scratch) ? sizeof(scratch) : len;
+        if (vnc_read(vnc, scratch, n) != 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// 读取并打印服务器给出的失败原因
+static void vnc_print_reason(VncState* vnc) {
+    uint8_t len_bytes[4];
+    char reason[256];
+    
+    if (vnc_read(vnc, len_bytes, 4) != 0) return;
+    uint32_t len = get_be32(len_bytes);
+    uint32_t keep = len < sizeof(reason) - 1 ? len : sizeof(reason) - 1;
+    if (vnc_read(vnc, reason, keep) != 0) return;
+    reason[keep] = '\0';
+    vnc_skip(vnc, len - keep);
+    fprintf(stderr, "VNC服务器: %s\n", reason);
+}
+
+static int vnc_send_update_request(VncState* vnc, GraphicsBuffer* buf, int incremental) {
+    uint8_t msg[10] = { 3, incremental };
+    put_be16(msg + 2, 0);
+    put_be16(msg + 4, 0);
+    put_be16(msg + 6, buf->width);
+    put_be16(msg + 8, buf->height);
+    if (write_all(vnc->fd, (const char*)msg, sizeof(msg)) != 0) {
+        return -1;
+    }
+    vnc->request_pending = 1;
+    return 0;
+}
+
+// 版本协商和安全握手
+static int vnc_handshake(VncState* vnc) {
+    char version[13] = {0};
+    int major, minor;
+    
+    if (vnc_read(vnc, version, 12) != 0 ||
+        sscanf(version, "RFB %03d.%03d", &major, &minor) != 2 || major != 3) {
+        fprintf(stderr, "不是RFB服务器\n");
+        return -1;
+    }
+    vnc->minor = minor >= 8 ? 8 : (minor == 7 ? 7 : 3);
+    snprintf(version, sizeof(version), "RFB 003.%03d\n", vnc->minor);
+    if (write_all(vnc->fd, version, 12) != 0) {
+        return -1;
+    }
+    
+    int have_password = app.server.password[0] != '\0';
+    uint32_t security = 0;
+    
+    if (vnc->minor == 3) {
+        // 3.3由服务器决定安全类型
+        uint8_t type[4];
+        if (vnc_read(vnc, type, 4) != 0) return -1;
+        security = get_be32(type);
+    } else {
+        uint8_t count;
+        uint8_t types[255];
+        if (vnc_read(vnc, &count, 1) != 0) return -1;
+        if (count == 0) {
+            vnc_print_reason(vnc);
+            return -1;
+        }
+        if (vnc_read(vnc, types, count) != 0) return -1;
+        
+        // 有密码时优先VNC认证，否则选择无认证
+        for (int i = 0; i < count; i++) {
+            if (types[i] == 2 && (have_password || security == 0)) security = 2;
+            if (types[i] == 1 && (!have_password || security == 0)) security = 1;
+        }
+        if (security == 0) {
+            fprintf(stderr, "VNC服务器不支持可用的安全类型\n");
+            return -1;
+        }
+        uint8_t choice = security;
+        if (write_all(vnc->fd, (const char*)&choice, 1) != 0) return -1;
+    }
+    
+    switch (security) {
+        case 0:
+            vnc_print_reason(vnc);
+            return -1;
+        case 1:
+            if (vnc->minor < 8) return 0;
+            break;
+        case 2: {
+            uint8_t challenge[16];
+            if (!have_password) {
+                fprintf(stderr, "VNC服务器要求密码，请使用 --password\n");
+                return -1;
+            }
+            if (vnc_read(vnc, challenge, 16) != 0) return -1;
+            vnc_encrypt_challenge(app.server.password, challenge);
+            if (write_all(vnc->fd, (const char*)challenge, 16) != 0) return -1;
+            break;
+        }
+        default:
+            fprintf(stderr, "不支持的VNC安全类型: %u\n", security);
+            return -1;
+    }
+    
+    uint8_t result[4];
+    if (vnc_read(vnc, result, 4) != 0) return -1;
+    if (get_be32(result) != 0) {
+        if (vnc->minor >= 8) {
+            vnc_print_reason(vnc);
+        } else {
+            fprintf(stderr, "VNC认证失败\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static void vnc_free(VncState* vnc) {
+#ifdef USE_ZLIB
+    for (int i = 0; i < VNC_ZLIB_STREAMS; i++) {
+        if (vnc->zstream_ready[i]) inflateEnd(&vnc->zstreams[i]);
+    }
+#endif
+    if (vnc->trace) fclose(vnc->trace);
+    if (vnc->fd >= 0) close(vnc->fd);
+    free(vnc->zin);
+    free(vnc->zout);
+    free(vnc);
+}
+
+// url: vnc://HOST[:PORT]，密码取自 --password
+int init_vnc(GraphicsBuffer* buf, const char* url) {
+    char addr[300];
+    const char* host = url + 6;
+    
+    if (strchr(host, ':')) {
+        snprintf(addr, sizeof(addr), "%s", host);
+    } else {
+        snprintf(addr, sizeof(addr), "%s:%d", host, VNC_DEFAULT_PORT);
+    }
+    
+    VncState* vnc = calloc(1, sizeof(VncState));
+    if (!vnc) {
+        perror("分配内存失败");
+        return -1;
+    }
+    vnc->fd = tcp_connect(addr);
+    if (vnc->fd < 0 || vnc_handshake(vnc) != 0) {
+        goto fail;
+    }
+    
+    // ClientInit: 共享连接
+    uint8_t shared = 1;
+    uint8_t init[24];
+    if (write_all(vnc->fd, (const char*)&shared, 1) != 0 || vnc_read(vnc, init, 24) != 0) {
+        goto fail;
+    }
+    int width = get_be16(init);
+    int height = get_be16(init + 2);
+    uint32_t name_len = get_be32(init + 20);
+    char name[64];
+    uint32_t keep = name_len < sizeof(name) - 1 ? name_len : sizeof(name) - 1;
+    if (vnc_read(vnc, name, keep) != 0 || vnc_skip(vnc, name_len - keep) != 0) {
+        goto fail;
+    }
+    name[keep] = '\0';
+    
+    // 此后消费的服务器数据都是协议消息，可原样录制供基准测试回放
+    if (app.vnc_trace_path[0]) {
+        VncTraceHeader header = { VNC_TRACE_MAGIC, width, height, 0 };
+        vnc->trace = fopen(app.vnc_trace_path, "wb");
+        if (!vnc->trace || fwrite(&header, sizeof(header), 1, vnc->trace) != 1) {
+            perror("无法创建VNC录制文件");
+            goto fail;
+        }
+    }
+    
+    // 请求与内部BGRA8888一致的像素格式，转换时无需再换序
+    uint8_t pixel_format[20] = { 0, 0, 0, 0, 32, 24, 0, 1 };
+    put_be16(pixel_format + 8, 255);
+    put_be16(pixel_format + 10, 255);
+    put_be16(pixel_format + 12, 255);
+    pixel_format[14] = 16;
+    pixel_format[15] = 8;
+    pixel_format[16] = 0;
+    
+    // 按偏好排列；ZRLE和Tight需要zlib
+#ifdef USE_ZLIB
+    static const int32_t encodings[] = { 1, 7, 16, 5, 0 };    // CopyRect, Tight, ZRLE, Hextile, Raw
+#else
+    static const int32_t encodings[] = { 1, 5, 0 };           // CopyRect, Hextile, Raw
+#endif
+    int encoding_count = sizeof(encodings) / sizeof(encodings[0]);
+    uint8_t set_encodings[4 + sizeof(encodings)] = { 2, 0 };
+    put_be16(set_encodings + 2, encoding_count);
+    for (int i = 0; i < encoding_count; i++) {
+        put_be32(set_encodings + 4 + i * 4, (uint32_t)encodings[i]);
+    }
+    
+    if (write_all(vnc->fd, (const char*)pixel_format, sizeof(pixel_format)) != 0 ||
+        write_all(vnc->fd, (const char*)set_encodings, 4 + encoding_count * 4) != 0) {
+        goto fail;
+    }
+    
+    snprintf(buf->device, sizeof(buf->device), "%s", url);
+    buf->fd = -1;
+    buf->width = width;
+    buf->height = height;
+    buf->bpp = 32;
+    buf->line_length = width * 4;
+    buf->size = (size_t)buf->line_length * height;
+    buf->format = PIXFMT_BGRA8888;
+    buf->type = SERVER_VNC;
+    buf->map_base = NULL;
+    buf->map_size = 0;
+    buf->frame_count = 0;
+    buf->frame_index = 0;
+    buf->buffer = calloc(1, buf->size);
+    buf->priv = vnc;
+    if (!buf->buffer) {
+        perror("分配内存失败");
+        goto fail;
+    }
+    
+    // 首次请求整帧，之后只请求增量
+    if (vnc_send_update_request(vnc, buf, 0) != 0) {
+        free(buf->buffer);
+        buf->buffer = NULL;
+        goto fail;
+    }
+    
+    if (app.verbose) {
+        printf("VNC: %s \"%s\" %dx%d (RFB 3.%d)\n", addr, name, width, height, vnc->minor);
+    }
+    return 0;
+    
+fail:
+    vnc_free(vnc);
+    buf->priv = NULL;
+    return -1;
+}
+
+static int vnc_read_raw(VncState* vnc, GraphicsBuffer* buf, int x, int y, int w, int h) {
+    for (int row = 0; row < h; row++) {
+        uint8_t* dst = (uint8_t*)buf->buffer + (size_t)(y + row) * buf->line_length + x * 4;
+        if (vnc_read(vnc, dst, (size_t)w * 4) != 0) return -1;
+    }
+    return 0;
+}
+
+static int vnc_copy_rect(VncState* vnc, GraphicsBuffer* buf, int x, int y, int w, int h) {
+    uint8_t src_pos[4];
+    if (vnc_read(vnc, src_pos, 4) != 0) return -1;
+    int sx = get_be16(src_pos), sy = get_be16(src_pos + 2);
+    if (sx + w > buf->width || sy + h > buf->height) return -1;
+    
+    // 源在上方时自下而上复制，避免覆盖尚未复制的行
+    uint8_t* base = (uint8_t*)buf->buffer;
+    for (int i = 0; i < h; i++) {
+        int row = sy < y ? h - 1 - i : i;
+        memmove(base + (size_t)(y + row) * buf->line_length + x * 4,
+                base + (size_t)(sy + row) * buf->line_length + sx * 4, (size_t)w * 4);
+    }
+    return 0;
+}
+
+static void vnc_fill(GraphicsBuffer* buf, int x, int y, int w, int h, const uint8_t pixel[4]) {
+    for (int row = 0; row < h; row++) {
+        uint8_t* dst = (uint8_t*)buf->buffer + (size_t)(y + row) * buf->line_length + x * 4;
+        for (int col = 0; col < w; col++, dst += 4) {
+            memcpy(dst, pixel, 4);
+        }
+    }
+}
+
+// Hextile: 16x16图块，背景/前景色在同一矩形的图块间沿用
+static int vnc_read_hextile(VncState* vnc, GraphicsBuffer* buf, int x, int y, int w, int h) {
+    uint8_t background[4] = {0}, foreground[4] = {0};
+    uint8_t subrects[255 * 6];
+    
+    for (int ty = y; ty < y + h; ty += 16) {
+        int th = y + h - ty < 16 ? y + h - ty : 16;
+        for (int tx = x; tx < x + w; tx += 16) {
+            int tw = x + w - tx < 16 ? x + w - tx : 16;
+            uint8_t sub;
+            if (vnc_read(vnc, &sub, 1) != 0) return -1;
+            
+            if (sub & 1) {      // Raw
+                if (vnc_read_raw(vnc, buf, tx, ty, tw, th) != 0) return -1;
+                continue;
+            }
+            if ((sub & 2) && vnc_read(vnc, background, 4) != 0) return -1;
+            if ((sub & 4) && vnc_read(vnc, foreground, 4) != 0) return -1;
+            vnc_fill(buf, tx, ty, tw, th, background);
+            if (!(sub & 8)) continue;
+            
+            uint8_t count;
+            if (vnc_read(vnc, &count, 1) != 0) return -1;
+            int coloured = sub & 16;
+            int record = coloured ? 6 : 2;
+            if (vnc_read(vnc, subrects, (size_t)count * record) != 0) return -1;
+            
+            for (int i = 0; i < count; i++) {
+                const uint8_t* s = subrects + i * record;
+                const uint8_t* pixel = coloured ? s : foreground;
+                const uint8_t* pos = coloured ? s + 4 : s;
+                int sx = pos[0] >> 4, sy = pos[0] & 15;
+                int sw = (pos[1] >> 4) + 1, sh = (pos[1] & 15) + 1;
+                if (sx + sw > tw || sy + sh > th) {
+                    fprintf(stderr, "Hextile子矩形超出图块\n");
+                    return -1;
+                }
+                vnc_fill(buf, tx + sx, ty + sy, sw, sh, pixel);
+            }
+        }
+    }
+    return 0;
+}
+
+#ifdef USE_ZLIB
+// 确保暂存缓冲区至少有need字节
+static uint8_t* vnc_scratch(uint8_t** data, size_t* capacity, size_t need) {
+    if (need > *capacity || !*data) {
+        uint8_t* grown = realloc(*data, need ? need : 1);
+        if (!grown) {
+            perror("分配内存失败");
+            return NULL;
+        }
+        *data = grown;
+        *capacity = need;
+    }
+    return *data;
+}
+
+// 从zin解压in_len字节到zout。exact时恰好解出*out_len字节 (Tight)，
+// 否则解出全部可用数据并按需扩容 (ZRLE)
+static int vnc_inflate(VncState* vnc, int stream, size_t in_len, size_t* out_len, int exact) {
+    z_stream* zs = &vnc->zstreams[stream];
+    if (!vnc->zstream_ready[stream]) {
+        memset(zs, 0, sizeof(*zs));
+        if (inflateInit(zs) != Z_OK) {
+            fprintf(stderr, "zlib初始化失败\n");
+            return -1;
+        }
+        vnc->zstream_ready[stream] = 1;
+    }
+    
+    size_t capacity = exact ? *out_len : in_len * 4;
+    if (!exact && capacity < vnc->zout_capacity) capacity = vnc->zout_capacity;
+    size_t produced = 0;
+    zs->next_in = vnc->zin;
+    zs->avail_in = in_len;
+    
+    for (;;) {
+        if (!vnc_scratch(&vnc->zout, &vnc->zout_capacity, capacity)) return -1;
+        zs->next_out = vnc->zout + produced;
+        zs->avail_out = capacity - produced;
+        int ret = inflate(zs, Z_SYNC_FLUSH);
+        produced = capacity - zs->avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+            fprintf(stderr, "VNC压缩数据损坏: %s\n", zs->msg ? zs->msg : "zlib");
+            return -1;
+        }
+        if (exact) {
+            if (produced == capacity) break;
+            if (ret != Z_OK) {
+                fprintf(stderr, "VNC压缩数据不完整\n");
+                return -1;
+            }
+        } else {
+            // 输出空间没有用完说明输入已全部解出
+            if (zs->avail_out > 0) break;
+            capacity *= 2;
+        }
+    }
+    *out_len = produced;
+    return 0;
+}
+
+// ZRLE的CPIXEL是像素值的低3字节，按本地BGRA8888格式即B,G,R
+static inline void zrle_pixel(uint8_t* dst, const uint8_t* cpixel) {
+    dst[0] = cpixel[0];
+    dst[1] = cpixel[1];
+    dst[2] = cpixel[2];
+    dst[3] = 0;
+}
+
+// ZRLE: 整个矩形的zlib数据解压后按64x64图块解码
+static int vnc_read_zrle(VncState* vnc, GraphicsBuffer* buf, int x, int y, int w, int h) {
+    uint8_t len_bytes[4];
+    if (vnc_read(vnc, len_bytes, 4) != 0) return -1;
+    size_t in_len = get_be32(len_bytes);
+    if (!vnc_scratch(&vnc->zin, &vnc->zin_capacity, in_len) ||
+        vnc_read(vnc, vnc->zin, in_len) != 0) {
+        return -1;
+    }
+    size_t out_len;
+    if (vnc_inflate(vnc, VNC_ZLIB_STREAMS - 1, in_len, &out_len, 0) != 0) return -1;
+    
+    const uint8_t* p = vnc->zout;
+    const uint8_t* end = p + out_len;
+    uint8_t palette[128][4];
+    
+    for (int ty = y; ty < y + h; ty += 64) {
+        int th = y + h - ty < 64 ? y + h - ty : 64;
+        for (int tx = x; tx < x + w; tx += 64) {
+            int tw = x + w - tx < 64 ? x + w - tx : 64;
+            uint8_t* tile = (uint8_t*)buf->buffer + (size_t)ty * buf->line_length + tx * 4;
+            if (p >= end) goto truncated;
+            int sub = *p++;
+            
+            if (sub == 0) {             // 原始CPIXEL
+                if ((size_t)(end - p) < (size_t)tw * th * 3) goto truncated;
+                for (int row = 0; row < th; row++) {
+                    uint8_t* dst = tile + (size_t)row * buf->line_length;
+                    for (int col = 0; col < tw; col++, dst += 4, p += 3) {
+                        zrle_pixel(dst, p);
+                    }
+                }
+            } else if (sub == 1) {      // 单色
+                if (end - p < 3) goto truncated;
+                zrle_pixel(palette[0], p);
+                p += 3;
+                vnc_fill(buf, tx, ty, tw, th, palette[0]);
+            } else if (sub <= 16) {     // 打包调色板，每行按字节对齐
+                int bits = sub == 2 ? 1 : (sub <= 4 ? 2 : 4);
+                size_t row_bytes = ((size_t)tw * bits + 7) / 8;
+                if ((size_t)(end - p) < (size_t)sub * 3 + row_bytes * th) goto truncated;
+                for (int i = 0; i < sub; i++, p += 3) {
+                    zrle_pixel(palette[i], p);
+                }
+                int mask = (1 << bits) - 1;
+                for (int row = 0; row < th; row++, p += row_bytes) {
+                    uint8_t* dst = tile + (size_t)row * buf->line_length;
+                    for (int col = 0; col < tw; col++, dst += 4) {
+                        int shift = 8 - bits - (col * bits) % 8;
+                        int index = (p[col * bits / 8] >> shift) & mask;
+                        memcpy(dst, palette[index < sub ? index : 0], 4);
+                    }
+                }
+            } else if (sub == 128 || sub >= 130) {  // 行程编码 / 调色板行程编码
+                int colors = sub == 128 ? 0 : sub - 128;
+                if ((size_t)(end - p) < (size_t)colors * 3) goto truncated;
+                for (int i = 0; i < colors; i++, p += 3) {
+                    zrle_pixel(palette[i], p);
+                }
+                
+                uint8_t single[4];
+                uint8_t* row_base = tile;
+                int col = 0;
+                int remaining = tw * th;
+                while (remaining > 0) {
+                    const uint8_t* pixel;
+                    int run = 1;
+                    if (colors == 0) {
+                        if (end - p < 3) goto truncated;
+                        zrle_pixel(single, p);
+                        p += 3;
+                        pixel = single;
+                    } else {
+                        if (p >= end) goto truncated;
+                        int index = *p++;
+                        pixel = palette[(index & 127) < colors ? (index & 127) : 0];
+                        if (!(index & 128)) goto write_run;
+                    }
+                    // 行程长度: 连续的255累加，最后一字节结束，总长为和+1
+                    for (;;) {
+                        if (p >= end) goto truncated;
+                        run += *p;
+                        if (*p++ != 255) break;
+                    }
+                write_run:
+                    if (run > remaining) {
+                        fprintf(stderr, "ZRLE行程超出图块\n");
+                        return -1;
+                    }
+                    remaining -= run;
+                    while (run-- > 0) {
+                        memcpy(row_base + col * 4, pixel, 4);
+                        if (++col == tw) {
+                            col = 0;
+                            row_base += buf->line_length;
+                        }
+                    }
+                }
+            } else {
+                fprintf(stderr, "无效的ZRLE子编码: %d\n", sub);
+                return -1;
+            }
+        }
+    }
+    return 0;
+    
+truncated:
+    fprintf(stderr, "ZRLE数据不完整\n");
+    return -1;
+}
+
+// Tight压缩长度: 1-3字节，每字节低7位 (第三字节8位)
+static int tight_read_length(VncState* vnc, size_t* len) {
+    *len = 0;
+    for (int i = 0; i < 3; i++) {
+        uint8_t b;
+        if (vnc_read(vnc, &b, 1) != 0) return -1;
+        *len |= (size_t)(i < 2 ? b & 0x7f : b) << (7 * i);
+        if (!(b & 0x80)) break;
+    }
+    return 0;
+}
+
+// Tight的TPIXEL为R,G,B三字节
+static inline void tight_pixel(uint8_t* dst, const uint8_t* tpixel) {
+    dst[0] = tpixel[2];
+    dst[1] = tpixel[1];
+    dst[2] = tpixel[0];
+    dst[3] = 0;
+}
+
+// Tight: 填充或基本压缩 (拷贝/调色板/梯度过滤 + 4个zlib流)，未请求JPEG
+static int vnc_read_tight(VncState* vnc, GraphicsBuffer* buf, int x, int y, int w, int h) {
+    uint8_t control;
+    if (vnc_read(vnc, &control, 1) != 0) return -1;
+    for (int i = 0; i < 4; i++) {
+        if ((control & (1 << i)) && vnc->zstream_ready[i]) {
+            inflateReset(&vnc->zstreams[i]);
+        }
+    }
+    control >>= 4;
+    
+    if (control == 8) {         // 填充
+        uint8_t tpixel[3], pixel[4];
+        if (vnc_read(vnc, tpixel, 3) != 0) return -1;
+        tight_pixel(pixel, tpixel);
+        vnc_fill(buf, x, y, w, h, pixel);
+        return 0;
+    }
+    if (control > 8) {
+        fprintf(stderr, "不支持的Tight压缩类型: %d\n", control);
+        return -1;
+    }
+    
+    int stream = control & 3;
+    uint8_t filter = 0;
+    if ((control & 4) && vnc_read(vnc, &filter, 1) != 0) return -1;
+    
+    uint8_t palette[256][4] = {{0}};
+    int colors = 0;
+    size_t size;
+    switch (filter) {
+        case 0:     // 拷贝
+        case 2:     // 梯度
+            size = (size_t)w * h * 3;
+            break;
+        case 1: {   // 调色板
+            uint8_t count, tpixels[256 * 3];
+            if (vnc_read(vnc, &count, 1) != 0) return -1;
+            colors = count + 1;
+            if (vnc_read(vnc, tpixels, (size_t)colors * 3) != 0) return -1;
+            for (int i = 0; i < colors; i++) {
+                tight_pixel(palette[i], tpixels + i * 3);
+            }
+            size = colors == 2 ? (size_t)(w + 7) / 8 * h : (size_t)w * h;
+            break;
+        }
+        default:
+            fprintf(stderr, "未知的Tight过滤器: %d\n", filter);
+            return -1;
+    }
+    
+    // 少于12字节的数据不压缩
+    if (size < 12) {
+        if (!vnc_scratch(&vnc->zout, &vnc->zout_capacity, size) ||
+            vnc_read(vnc, vnc->zout, size) != 0) {
+            return -1;
+        }
+    } else {
+        size_t in_len;
+        if (tight_read_length(vnc, &in_len) != 0 ||
+            !vnc_scratch(&vnc->zin, &vnc->zin_capacity, in_len) ||
+            vnc_read(vnc, vnc->zin, in_len) != 0 ||
+            vnc_inflate(vnc, stream, in_len, &size, 1) != 0) {
+            return -1;
+        }
+    }
+    
+    const uint8_t* p = vnc->zout;
+    uint8_t* base = (uint8_t*)buf->buffer + (size_t)y * buf->line_length + x * 4;
+    
+    if (filter == 1) {
+        size_t row_bytes = colors == 2 ? (size_t)(w + 7) / 8 : (size_t)w;
+        for (int row = 0; row < h; row++, p += row_bytes) {
+            uint8_t* dst = base + (size_t)row * buf->line_length;
+            for (int col = 0; col < w; col++, dst += 4) {
+                int index = colors == 2 ? (p[col >> 3] >> (7 - (col & 7))) & 1 : p[col];
+                memcpy(dst, palette[index], 4);
+            }
+        }
+    } else if (filter == 0) {
+        for (int row = 0; row < h; row++) {
+            uint8_t* dst = base + (size_t)row * buf->line_length;
+            for (int col = 0; col < w; col++, dst += 4, p += 3) {
+                tight_pixel(dst, p);
+            }
+        }
+    } else {
+        // 梯度: 预测值 = 左 + 上 - 左上 (截断到0-255)，数据为与预测值之差
+        if (!vnc_scratch(&vnc->zin, &vnc->zin_capacity, (size_t)w * 6)) return -1;
+        uint8_t* above = vnc->zin;
+        uint8_t* current = vnc->zin + (size_t)w * 3;
+        memset(above, 0, (size_t)w * 3);
+        for (int row = 0; row < h; row++) {
+            uint8_t* dst = base + (size_t)row * buf->line_length;
+            for (int col = 0; col < w; col++, dst += 4, p += 3) {
+                for (int c = 0; c < 3; c++) {
+                    int left = col ? current[(col - 1) * 3 + c] : 0;
+                    int corner = col ? above[(col - 1) * 3 + c] : 0;
+                    int predicted = left + above[col * 3 + c] - corner;
+                    if (predicted < 0) predicted = 0;
+                    if (predicted > 255) predicted = 255;
+                    current[col * 3 + c] = (uint8_t)(predicted + p[c]);
+                }
+                tight_pixel(dst, current + col * 3);
+            }
+            uint8_t* swap = above;
+            above = current;
+            current = swap;
+        }
+    }
+    return 0;
+}
+#endif
+
+static int vnc_encoding_slot(int32_t encoding) {
+    switch (encoding) {
+        case 0: return VNC_SLOT_RAW;
+        case 1: return VNC_SLOT_COPYRECT;
+        case 5: return VNC_SLOT_HEXTILE;
+#ifdef USE_ZLIB
+        case 16: return VNC_SLOT_ZRLE;
+        case 7: return VNC_SLOT_TIGHT;
+#endif
+        default: return -1;
+    }
+}
+
+static int vnc_read_update(VncState* vnc, GraphicsBuffer* buf) {
+    uint8_t header[3];
+    if (vnc_read(vnc, header, 3) != 0) return -1;
+    int count = get_be16(header + 1);
+    
+    for (int i = 0; i < count; i++) {
+        uint8_t rect[12];
+        if (vnc_read(vnc, rect, 12) != 0) return -1;
+        int x = get_be16(rect), y = get_be16(rect + 2);
+        int w = get_be16(rect + 4), h = get_be16(rect + 6);
+        int32_t encoding = (int32_t)get_be32(rect + 8);
+        
+        if (x + w > buf->width || y + h > buf->height) {
+            fprintf(stderr, "VNC矩形超出帧缓冲区\n");
+            return -1;
+        }
+        int slot = vnc_encoding_slot(encoding);
+        if (slot < 0) {
+            fprintf(stderr, "不支持的VNC编码: %d\n", encoding);
+            return -1;
+        }
+        
+        uint64_t t0 = monotonic_ns();
+        uint64_t bytes0 = vnc->bytes_in;
+        int ret;
+        switch (slot) {
+            case VNC_SLOT_RAW:
+                ret = vnc_read_raw(vnc, buf, x, y, w, h);
+                break;
+            case VNC_SLOT_COPYRECT:
+                ret = vnc_copy_rect(vnc, buf, x, y, w, h);
+                break;
+            case VNC_SLOT_HEXTILE:
+                ret = vnc_read_hextile(vnc, buf, x, y, w, h);
+                break;
+#ifdef USE_ZLIB
+            case VNC_SLOT_ZRLE:
+                ret = vnc_read_zrle(vnc, buf, x, y, w, h);
+                break;
+            case VNC_SLOT_TIGHT:
+                ret = vnc_read_tight(vnc, buf, x, y, w, h);
+                break;
+#endif
+            default:
+                ret = -1;
+                break;
+        }
+        if (ret != 0) return -1;
+        
+        VncEncodingStats* stats = &vnc->stats[slot];
+        stats->rects++;
+        stats->pixels += (uint64_t)w * h;
+        stats->bytes += vnc->bytes_in - bytes0 + sizeof(rect);
+        stats->ns += monotonic_ns() - t0;
+        damage_add(buf, x, y, w, h);
+        vnc->rects++;
+    }
+    
+    vnc->updates++;
+    return 0;
+}
+
+// 读取并处理一条服务器消息，是帧更新时返回1
+static int vnc_handle_message(VncState* vnc, GraphicsBuffer* buf) {
+    uint8_t type;
+    if (vnc_read(vnc, &type, 1) != 0) return -1;
+    
+    switch (type) {
+        case 0:     // FramebufferUpdate
+            return vnc_read_update(vnc, buf) == 0 ? 1 : -1;
+        case 1: {   // SetColourMapEntries (真彩色下忽略)
+            uint8_t h[5];
+            if (vnc_read(vnc, h, 5) != 0 || vnc_skip(vnc, (size_t)get_be16(h + 3) * 6) != 0) {
+                return -1;
+            }
+            return 0;
+        }
+        case 2:     // Bell
+            return 0;
+        case 3: {   // ServerCutText
+            uint8_t h[7];
+            if (vnc_read(vnc, h, 7) != 0 || vnc_skip(vnc, get_be32(h + 3)) != 0) {
+                return -1;
+            }
+            return 0;
+        }
+        default:
+            fprintf(stderr, "未知的VNC消息类型: %d\n", type);
+            return -1;
+    }
+}
+
+// 处理服务器消息直到收到一次帧更新；短时间内没有更新则返回，本帧没有变化区域
+int vnc_next_frame(GraphicsBuffer* buf) {
+    VncState* vnc = (VncState*)buf->priv;
+    buf->damage_count = 0;
+    
+    if (!vnc->request_pending && vnc_send_update_request(vnc, buf, 1) != 0) {
+        return -1;
+    }
+    
+    for (;;) {
+        if (vnc->rpos == vnc->rlen) {
+            struct pollfd pfd = { vnc->fd, POLLIN, 0 };
+            int ready = poll(&pfd, 1, 100);
+            if (ready < 0 && errno != EINTR) return -1;
+            if (ready <= 0) return 0;
+        }
+        
+        int ret = vnc_handle_message(vnc, buf);
+        if (ret < 0) return -1;
+        if (ret == 1) {
+            // 立即请求下一次更新，与本帧转换并行
+            vnc->request_pending = 0;
+            return vnc_send_update_request(vnc, buf, 1);
+        }
+    }
+}
+
+static void vnc_print_stats(const VncEncodingStats* stats) {
+    static const char* names[VNC_SLOT_COUNT] = { "Raw", "CopyRect", "Hextile", "ZRLE", "Tight" };
+    
+    printf("%-9s %8s %12s %12s %8s %9s %9s\n",
+           "编码", "矩形", "像素", "线上字节", "压缩比", "ns/像素", "MPix/s");
+    for (int i = 0; i < VNC_SLOT_COUNT; i++) {
+        const VncEncodingStats* s = &stats[i];
+        if (s->rects == 0) continue;
+        double ns = s->ns > 0 ? (double)s->ns : 1.0;
+        printf("%-9s %8lu %12llu %12llu %8.1f %9.2f %9.1f\n",
+               names[i], s->rects, (unsigned long long)s->pixels, (unsigned long long)s->bytes,
+               s->bytes ? (double)s->pixels * 4 / s->bytes : 0.0,
+               s->pixels ? ns / s->pixels : 0.0, s->pixels * 1e3 / ns);
+    }
+}
+
+void release_vnc(GraphicsBuffer* buf) {
+    VncState* vnc = (VncState*)buf->priv;
+    if (vnc) {
+        if (app.verbose) {
+            printf("VNC: %lu 次更新，%lu 个矩形\n", vnc->updates, vnc->rects);
+            vnc_print_stats(vnc->stats);
+        }
+        vnc_free(vnc);
+    }
+    free(buf->buffer);
+    buf->buffer = NULL;
+    buf->priv = NULL;
+}
+
+// 回放 --vnc-trace 录制的消息流，单独测量各编码的解码耗时 (不含网络和字符转换)
+void benchmark_vnc_trace(const char* path) {
+    const int passes = 3;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("无法打开VNC录制文件");
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(VncTraceHeader)) {
+        fprintf(stderr, "VNC录制文件无效: %s\n", path);
+        close(fd);
+        return;
+    }
+    size_t size = st.st_size;
+    uint8_t* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("映射VNC录制文件失败");
+        return;
+    }
+    
+    VncTraceHeader header;
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, VNC_TRACE_MAGIC, 4) != 0 ||
+        header.width == 0 || header.height == 0 || header.width > 16384 || header.height > 16384) {
+        fprintf(stderr, "VNC录制文件无效: %s\n", path);
+        munmap(map, size);
+        return;
+    }
+    
+    GraphicsBuffer buf = {
+        .device = "vnc-trace",
+        .fd = -1,
+        .width = header.width,
+        .height = header.height,
+        .bpp = 32,
+        .line_length = header.width * 4,
+        .format = PIXFMT_BGRA8888,
+        .type = SERVER_VNC,
+        .frame_count = 1
+    };
+    buf.size = (size_t)buf.line_length * buf.height;
+    buf.buffer = calloc(1, buf.size);
+    
+    VncEncodingStats stats[VNC_SLOT_COUNT] = {{0}};
+    unsigned long updates = 0;
+    uint64_t elapsed = 0;
+    int runs = 0;
+    int ok = buf.buffer != NULL;
+    
+    // zlib流有状态，每遍都从头重建解码器；解码失败时只统计第一遍
+    while (ok && runs < passes) {
+        VncState* vnc = calloc(1, sizeof(VncState));
+        if (!vnc) {
+            perror("分配内存失败");
+            break;
+        }
+        vnc->fd = -1;
+        vnc->replay = map + sizeof(header);
+        vnc->replay_len = size - sizeof(header);
+        
+        uint64_t t0 = monotonic_ns();
+        while (vnc->replay_pos < vnc->replay_len) {
+            buf.damage_count = 0;
+            if (vnc_handle_message(vnc, &buf) < 0) {
+                fprintf(stderr, "录制流在偏移 %zu 处解码失败\n", sizeof(header) + vnc->replay_pos);
+                ok = 0;
+                break;
+            }
+        }
+        elapsed += monotonic_ns() - t0;
+        runs++;
+        
+        updates = vnc->updates;
+        for (int i = 0; i < VNC_SLOT_COUNT; i++) {
+            stats[i].rects = vnc->stats[i].rects;
+            stats[i].pixels = vnc->stats[i].pixels;
+            stats[i].bytes = vnc->stats[i].bytes;
+            stats[i].ns += vnc->stats[i].ns;
+        }
+        vnc_free(vnc);
+    }
+    for (int i = 0; runs > 0 && i < VNC_SLOT_COUNT; i++) {
+        stats[i].ns /= runs;
+    }
+    
+    printf("VNC录制流: %s, %ux%u, %zu 字节, %lu 次更新\n",
+           path, header.width, header.height, size - sizeof(header), updates);
+    vnc_print_stats(stats);
+    if (updates > 0) {
+        printf("平均每次更新 %.3f ms (%d 遍)\n", elapsed / 1e6 / runs / updates, runs);
+    }
+    printf("\n");
+    
+    free(buf.buffer);
+    munmap(map, size);
+}
+
+#ifdef USE_X11
+// X11请求错误只记录，不终止进程 (用于探测MIT-SHM是否可用)
+static int x11_error_flag;
+
+static int x11_trap_error(Display* display, XErrorEvent* event) {
+    (void)display;
+    (void)event;
+    x11_error_flag = 1;
+    return 0;
+}
+
+// 按XImage的通道掩码和字节序映射到内部像素格式
+static PixelFormat x11_pixel_format(XImage* image, PixelLayout* layout) {
+    int lsb = image->byte_order == LSBFirst;
+    unsigned long r = image->red_mask, g = image->green_mask, b = image->blue_mask;
+    
+    // 24位按字节寻址，高位在前时通道顺序相反
+    if (image->bits_per_pixel == 24 && g == 0xff00) {
+        if (r == 0xff0000 && b == 0xff) return lsb ? PIXFMT_BGR888 : PIXFMT_RGB888;
+        if (r == 0xff && b == 0xff0000) return lsb ? PIXFMT_RGB888 : PIXFMT_BGR888;
+    }
+    // 其余按本机 (小端) 字节序读取像素值
+    if (!lsb || image->bits_per_pixel % 8 != 0) {
+        return PIXFMT_UNKNOWN;
+    }
+    pixel_layout_from_masks(layout, image->bits_per_pixel / 8, r, g, b);
+    return pixel_format_from_layout(layout);
+}
+
+// 创建共享内存图像并挂接到X服务器；失败时 (远程显示等) 返回-1，由调用者回退到XGetImage
+static int x11_attach_shm(X11State* x11, Visual* visual, int depth, int width, int height) {
+    x11->image = XShmCreateImage(x11->display, visual, depth, ZPixmap, NULL, &x11->shm, width, height);
+    if (!x11->image) return -1;
+    
+    x11->shm.shmid = shmget(IPC_PRIVATE, (size_t)x11->image->bytes_per_line * height, IPC_CREAT | 0600);
+    if (x11->shm.shmid < 0) {
+        XDestroyImage(x11->image);
+        x11->image = NULL;
+        return -1;
+    }
+    x11->shm.shmaddr = x11->image->data = shmat(x11->shm.shmid, NULL, 0);
+    x11->shm.readOnly = False;
+    
+    int attached = 0;
+    if (x11->shm.shmaddr != (char*)-1) {
+        x11_error_flag = 0;
+        XErrorHandler previous = XSetErrorHandler(x11_trap_error);
+        attached = XShmAttach(x11->display, &x11->shm);
+        XSync(x11->display, False);
+        XSetErrorHandler(previous);
+        attached = attached && !x11_error_flag;
+    }
+    // 双方都挂接后立即标记删除，进程退出时段自动释放
+    shmctl(x11->shm.shmid, IPC_RMID, NULL);
+    
+    if (!attached) {
+        if (x11->shm.shmaddr != (char*)-1) shmdt(x11->shm.shmaddr);
+        XDestroyImage(x11->image);
+        x11->image = NULL;
+        return -1;
+    }
+    x11->use_shm = 1;
+    return 0;
+}
+
+static int x11_grab(X11State* x11) {
+    if (x11->use_shm) {
+        return XShmGetImage(x11->display, x11->root, x11->image, x11->x, x11->y, AllPlanes) ? 0 : -1;
+    }
+    if (!x11->image) {
+        x11->image = XGetImage(x11->display, x11->root, x11->x, x11->y,
+                               x11->width, x11->height, AllPlanes, ZPixmap);
+        return x11->image ? 0 : -1;
+    }
+    return XGetSubImage(x11->display, x11->root, x11->x, x11->y, x11->width, x11->height,
+                        AllPlanes, ZPixmap, x11->image, 0, 0) ? 0 : -1;
+}
+
+static void release_x11_state(X11State* x11) {
+#ifdef USE_XDAMAGE
+    if (x11->damage) {
+        XDamageDestroy(x11->display, x11->damage);
+        XFixesDestroyRegion(x11->display, x11->region);
+    }
+#endif
+    if (x11->use_shm) {
+        XShmDetach(x11->display, &x11->shm);
+        XSync(x11->display, False);
+    }
+    if (x11->image) {
+        XDestroyImage(x11->image);
+    }
+    if (x11->use_shm) {
+        shmdt(x11->shm.shmaddr);
+    }
+    XCloseDisplay(x11->display);
+    free(x11);
+}
+
+#ifdef USE_XDAMAGE
+// 订阅根窗口的XDamage；变化区域由服务器累积，取回时一次减去，帧间的连续变化自然合并
+static void x11_damage_init(X11State* x11) {
+    int damage_event, damage_error, fixes_event, fixes_error;
+    if (!XDamageQueryExtension(x11->display, &damage_event, &damage_error) ||
+        !XFixesQueryExtension(x11->display, &fixes_event, &fixes_error)) {
+        if (app.verbose) {
+            printf("X11: 服务器不支持XDamage，按帧率整帧抓取\n");
+        }
+        return;
+    }
+    x11->damage = XDamageCreate(x11->display, x11->root, XDamageReportNonEmpty);
+    x11->region = XFixesCreateRegion(x11->display, NULL, 0);
+    x11->damage_event = damage_event + XDamageNotify;
+}
+
+// 处理已到达的事件，没有变化时最多等待timeout_ms；返回是否有变化
+static int x11_wait_damage(X11State* x11, int timeout_ms) {
+    for (;;) {
+        while (XPending(x11->display)) {
+            XEvent event;
+            XNextEvent(x11->display, &event);
+            if (event.type == x11->damage_event) {
+                x11->damaged = 1;
+            }
+        }
+        if (x11->damaged || timeout_ms == 0) {
+            return x11->damaged;
+        }
+        struct pollfd pfd = { ConnectionNumber(x11->display), POLLIN, 0 };
+        if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+            return -1;
+        }
+        timeout_ms = 0;
+    }
+}
+
+// 取回抓取区域内的若干行。共享内存图像中整行是连续的，直接写到原位
+static int x11_grab_rows(X11State* x11, int y, int height) {
+    XImage band = *x11->image;
+    band.data = x11->image->data + (size_t)y * x11->image->bytes_per_line;
+    band.height = height;
+    return XShmGetImage(x11->display, x11->root, &band, x11->x, x11->y + y, AllPlanes) ? 0 : -1;
+}
+
+// 只取回变化区域：共享内存时按行合并成条带，否则逐个矩形XGetSubImage
+static int x11_damage_frame(GraphicsBuffer* buf, X11State* x11) {
+    buf->damage_count = 0;
+    int ret = x11_wait_damage(x11, 100);
+    if (ret <= 0) {
+        return ret;
+    }
+    x11->damaged = 0;
+    
+    XDamageSubtract(x11->display, x11->damage, None, x11->region);
+    int count = 0;
+    XRectangle* rects = XFixesFetchRegion(x11->display, x11->region, &count);
+    int band_y0 = 0, band_y1 = 0;
+    ret = 0;
+    
+    for (int i = 0; i < count && ret == 0; i++) {
+        int x0 = rects[i].x - x11->x, y0 = rects[i].y - x11->y;
+        int x1 = x0 + rects[i].width, y1 = y0 + rects[i].height;
+        if (x0 < 0) x0 = 0;
+        if (y0 < 0) y0 = 0;
+        if (x1 > x11->width) x1 = x11->width;
+        if (y1 > x11->height) y1 = x11->height;
+        if (x0 >= x1 || y0 >= y1) continue;
+        
+        damage_add(buf, x0, y0, x1 - x0, y1 - y0);
+        if (!x11->use_shm) {
+            if (!XGetSubImage(x11->display, x11->root, x11->x + x0, x11->y + y0, x1 - x0, y1 - y0,
+                              AllPlanes, ZPixmap, x11->image, x0, y0)) {
+                ret = -1;
+            }
+        } else if (band_y1 > band_y0 && y0 <= band_y1) {
+            // 区域矩形按行排序，相邻或重叠的行并入当前条带
+            if (y0 < band_y0) band_y0 = y0;
+            if (y1 > band_y1) band_y1 = y1;
+        } else {
+            if (band_y1 > band_y0) ret = x11_grab_rows(x11, band_y0, band_y1 - band_y0);
+            band_y0 = y0;
+            band_y1 = y1;
+        }
+    }
+    if (ret == 0 && band_y1 > band_y0) {
+        ret = x11_grab_rows(x11, band_y0, band_y1 - band_y0);
+    }
+    if (rects) XFree(rects);
+    
+    if (ret != 0) {
+        fprintf(stderr, "抓取X11变化区域失败\n");
+    }
+    return ret;
+}
+#endif
+
+// device: x11:[DISPLAY][/WxH+X+Y]，省略DISPLAY时使用环境变量，省略几何参数时抓取整个根窗口
+int init_x11(GraphicsBuffer* buf, const char* device) {
+    char name[256];
+    snprintf(name, sizeof(name), "%s", device + 4);
+    char* geometry = strchr(name, '/');
+    if (geometry) *geometry++ = '\0';
+    
+    X11State* x11 = calloc(1, sizeof(X11State));
+    if (!x11) {
+        perror("分配内存失败");
+        return -1;
+    }
+    x11->display = XOpenDisplay(name[0] ? name : NULL);
+    if (!x11->display) {
+        fprintf(stderr, "无法打开X11显示: %s\n", name[0] ? name : XDisplayName(NULL));
+        free(x11);
+        return -1;
+    }
+    
+    int screen = DefaultScreen(x11->display);
+    x11->root = RootWindow(x11->display, screen);
+    int root_width = DisplayWidth(x11->display, screen);
+    int root_height = DisplayHeight(x11->display, screen);
+    x11->width = root_width;
+    x11->height = root_height;
+    if (geometry && *geometry) {
+        unsigned int w, h;
+        int flags = XParseGeometry(geometry, &x11->x, &x11->y, &w, &h);
+        if (flags & WidthValue) x11->width = w;
+        if (flags & HeightValue) x11->height = h;
+    }
+    if (x11->x < 0 || x11->y < 0 || x11->width <= 0 || x11->height <= 0 ||
+        x11->x + x11->width > root_width || x11->y + x11->height > root_height) {
+        fprintf(stderr, "抓取区域超出根窗口 %dx%d: %s\n", root_width, root_height, geometry);
+        XCloseDisplay(x11->display);
+        free(x11);
+        return -1;
+    }
+    
+    // 远程显示无法共享内存，直接使用XGetImage
+    const char* display_name = DisplayString(x11->display);
+    int local = display_name[0] == ':' || strncmp(display_name, "unix:", 5) == 0;
+    if (!local || !XShmQueryExtension(x11->display) ||
+        x11_attach_shm(x11, DefaultVisual(x11->display, screen), DefaultDepth(x11->display, screen),
+                       x11->width, x11->height) != 0) {
+        x11->use_shm = 0;
+    }
+    
+    if (x11_grab(x11) != 0) {
+        fprintf(stderr, "抓取X11根窗口失败\n");
+        release_x11_state(x11);
+        return -1;
+    }
+    PixelFormat format = x11_pixel_format(x11->image, &buf->layout);
+    if (format == PIXFMT_UNKNOWN) {
+        fprintf(stderr, "不支持的X11像素格式: %d位 掩码 %06lx/%06lx/%06lx\n",
+                x11->image->bits_per_pixel, x11->image->red_mask,
+                x11->image->green_mask, x11->image->blue_mask);
+        release_x11_state(x11);
+        return -1;
+    }
+    
+    snprintf(buf->device, sizeof(buf->device), "%s", device);
+    buf->fd = -1;
+    buf->buffer = x11->image->data;
+    buf->width = x11->width;
+    buf->height = x11->height;
+    buf->bpp = x11->image->bits_per_pixel;
+    buf->line_length = x11->image->bytes_per_line;
+    buf->size = (size_t)buf->line_length * buf->height;
+    buf->format = format;
+    buf->type = SERVER_X11;
+    buf->map_base = NULL;
+    buf->map_size = 0;
+    buf->frame_count = 0;
+    buf->frame_index = 0;
+    buf->priv = x11;
+    
+#ifdef USE_XDAMAGE
+    x11_damage_init(x11);
+    if (!x11->damage) {
+        buf->caps &= ~(CAPTURE_CAP_DAMAGE | CAPTURE_CAP_EVENTS);
+    }
+#endif
+    
+    if (app.verbose) {
+        printf("X11: %s %dx%d+%d+%d %d位 (%s)\n", display_name, x11->width, x11->height,
+               x11->x, x11->y, buf->bpp, x11->use_shm ? "MIT-SHM" : "XGetImage");
+    }
+    return 0;
+}
+
+int x11_next_frame(GraphicsBuffer* buf) {
+    X11State* x11 = (X11State*)buf->priv;
+#ifdef USE_XDAMAGE
+    if (x11->damage) {
+        return x11_damage_frame(buf, x11);
+    }
+#endif
+    if (x11_grab(x11) != 0) {
+        fprintf(stderr, "抓取X11根窗口失败\n");
+        return -1;
+    }
+    return 0;
+}
+
+void release_x11(GraphicsBuffer* buf) {
+    if (buf->priv) {
+        release_x11_state((X11State*)buf->priv);
+    }
+    buf->buffer = NULL;
+    buf->priv = NULL;
+}
+#endif
+
+#ifdef USE_WAYLAND
+// wlr-screencopy-unstable-v1 协议定义 (按wayland-scanner的输出格式手写，避免构建时依赖协议XML)
+extern const struct wl_interface zwlr_screencopy_frame_v1_interface;
+
+static const struct wl_interface* screencopy_types[] = {
+    NULL, NULL, NULL, NULL,
+    &zwlr_screencopy_frame_v1_interface, NULL, &wl_output_interface,
+    &zwlr_screencopy_frame_v1_interface, NULL, &wl_output_interface, NULL, NULL, NULL, NULL,
+    &wl_buffer_interface,
+    &wl_buffer_interface,
+};
+
+static const struct wl_message screencopy_manager_requests[] = {
+    { "capture_output", "nio", screencopy_types + 4 },
+    { "capture_output_region", "nioiiii", screencopy_types + 7 },
+    { "destroy", "", screencopy_types + 0 },
+};
+
+const struct wl_interface zwlr_screencopy_manager_v1_interface = {
+    "zwlr_screencopy_manager_v1", 3,
+    3, screencopy_manager_requests,
+    0, NULL,
+};
+
+static const struct wl_message screencopy_frame_requests[] = {
+    { "copy", "o", screencopy_types + 14 },
+    { "destroy", "", screencopy_types + 0 },
+    { "copy_with_damage", "2o", screencopy_types + 15 },
+};
+
+static const struct wl_message screencopy_frame_events[] = {
+    { "buffer", "uuuu", screencopy_types + 0 },
+    { "flags", "u", screencopy_types + 0 },
+    { "ready", "uuu", screencopy_types + 0 },
+    { "failed", "", screencopy_types + 0 },
+    { "damage", "2uuuu", screencopy_types + 0 },
+    { "linux_dmabuf", "3uuu", screencopy_types + 0 },
+    { "buffer_done", "3", screencopy_types + 0 },
+};
+
+const struct wl_interface zwlr_screencopy_frame_v1_interface = {
+    "zwlr_screencopy_frame_v1", 3,
+    3, screencopy_frame_requests,
+    7, screencopy_frame_events,
+};
+
+enum {
+    SCREENCOPY_MANAGER_CAPTURE_OUTPUT = 0,
+    SCREENCOPY_MANAGER_DESTROY = 2,
+    SCREENCOPY_FRAME_COPY = 0,
+    SCREENCOPY_FRAME_DESTROY = 1,
+    SCREENCOPY_FRAME_COPY_WITH_DAMAGE = 2,
+    SCREENCOPY_FRAME_FLAG_Y_INVERT = 1
+};
+
+typedef struct {
+    void (*buffer)(void* data, struct wl_proxy* frame, uint32_t format,
+                   uint32_t width, uint32_t height, uint32_t stride);
+    void (*flags)(void* data, struct wl_proxy* frame, uint32_t flags);
+    void (*ready)(void* data, struct wl_proxy* frame, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec);
+    void (*failed)(void* data, struct wl_proxy* frame);
+    void (*damage)(void* data, struct wl_proxy* frame, uint32_t x, uint32_t y, uint32_t width, uint32_t height);
+    void (*linux_dmabuf)(void* data, struct wl_proxy* frame, uint32_t format, uint32_t width, uint32_t height);
+    void (*buffer_done)(void* data, struct wl_proxy* frame);
+} ScreencopyFrameListener;
+
+// wl_shm格式按小端32位值定义通道位置
+static PixelFormat wayland_pixel_format(uint32_t format) {
+    switch (format) {
+        case WL_SHM_FORMAT_ARGB8888:
+        case WL_SHM_FORMAT_XRGB8888:
+            return PIXFMT_BGRA8888;
+        case WL_SHM_FORMAT_ABGR8888:
+        case WL_SHM_FORMAT_XBGR8888:
+            return PIXFMT_RGBA8888;
+        case WL_SHM_FORMAT_RGB888:
+            return PIXFMT_BGR888;
+        case WL_SHM_FORMAT_BGR888:
+            return PIXFMT_RGB888;
+        case WL_SHM_FORMAT_BGRX8888:
+        case WL_SHM_FORMAT_BGRA8888:
+            return PIXFMT_ARGB8888;
+        case WL_SHM_FORMAT_RGBX8888:
+        case WL_SHM_FORMAT_RGBA8888:
+            return PIXFMT_ABGR8888;
+        case WL_SHM_FORMAT_XRGB2101010:
+        case WL_SHM_FORMAT_ARGB2101010:
+            return PIXFMT_XRGB2101010;
+        case WL_SHM_FORMAT_RGB565:
+            return PIXFMT_RGB565;
+        case WL_SHM_FORMAT_BGR565:
+            return PIXFMT_BGR565;
+        case WL_SHM_FORMAT_XRGB1555:
+        case WL_SHM_FORMAT_ARGB1555:
+            return PIXFMT_RGB555;
+        default:
+            return PIXFMT_UNKNOWN;
+    }
+}
+
+static void wayland_registry_global(void* data, struct wl_registry* registry, uint32_t name,
+                                    const char* interface, uint32_t version) {
+    WaylandState* wl = (WaylandState*)data;
+    
+    if (strcmp(interface, wl_shm_interface.name) == 0) {
+        wl->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    } else if (strcmp(interface, wl_output_interface.name) == 0 && wl->output_count < MAX_DISPLAYS) {
+        wl->outputs[wl->output_count++] = wl_registry_bind(registry, name, &wl_output_interface, 1);
+    } else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+        wl->manager_version = version < 3 ? version : 3;
+        wl->manager = wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface,
+                                       wl->manager_version);
+    }
+}
+
+static void wayland_registry_global_remove(void* data, struct wl_registry* registry, uint32_t name) {
+    (void)data;
+    (void)registry;
+    (void)name;
+}
+
+static const struct wl_registry_listener wayland_registry_listener = {
+    wayland_registry_global,
+    wayland_registry_global_remove,
+};
+
+static void screencopy_buffer(void* data, struct wl_proxy* frame, uint32_t format,
+                              uint32_t width, uint32_t height, uint32_t stride) {
+    WaylandState* wl = (WaylandState*)data;
+    (void)frame;
+    // 可能提供多种格式，只接受能直接读取的wl_shm格式
+    if (wayland_pixel_format(format) != PIXFMT_UNKNOWN) {
+        wl->frame_format = format;
+        wl->frame_width = width;
+        wl->frame_height = height;
+        wl->frame_stride = stride;
+        wl->buffer_info = 1;
+    }
+}
+
+static void screencopy_flags(void* data, struct wl_proxy* frame, uint32_t flags) {
+    (void)frame;
+    ((WaylandState*)data)->frame_flags = flags;
+}
+
+static void screencopy_ready(void* data, struct wl_proxy* frame, uint32_t tv_sec_hi,
+                             uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    (void)frame;
+    (void)tv_sec_hi;
+    (void)tv_sec_lo;
+    (void)tv_nsec;
+    ((WaylandState*)data)->frame_state = 1;
+}
+
+static void screencopy_failed(void* data, struct wl_proxy* frame) {
+    (void)frame;
+    ((WaylandState*)data)->frame_state = -1;
+}
+
+static void screencopy_damage(void* data, struct wl_proxy* frame, uint32_t x, uint32_t y,
+                              uint32_t width, uint32_t height) {
+    WaylandState* wl = (WaylandState*)data;
+    (void)frame;
+    if (wl->target && wl->target->damage_count >= 0) {
+        if (wl->frame_flags & SCREENCOPY_FRAME_FLAG_Y_INVERT) {
+            y = wl->frame_height - y - height;
+        }
+        damage_add(wl->target, x, y, width, height);
+    }
+}
+
+static void screencopy_linux_dmabuf(void* data, struct wl_proxy* frame, uint32_t format,
+                                    uint32_t width, uint32_t height) {
+    (void)data;
+    (void)frame;
+    (void)format;
+    (void)width;
+    (void)height;
+}
+
+static void screencopy_buffer_done(void* data, struct wl_proxy* frame) {
+    (void)frame;
+    ((WaylandState*)data)->buffer_done = 1;
+}
+
+static const ScreencopyFrameListener screencopy_frame_listener = {
+    screencopy_buffer,
+    screencopy_flags,
+    screencopy_ready,
+    screencopy_failed,
+    screencopy_damage,
+    screencopy_linux_dmabuf,
+    screencopy_buffer_done,
+};
+
+// 分发事件直到*flag非零或超时；返回1表示条件满足，0表示超时
+static int wayland_wait(WaylandState* wl, int* flag, int timeout_ms) {
+    uint64_t deadline = monotonic_ns() + (uint64_t)timeout_ms * 1000000ULL;
+    
+    while (!*flag) {
+        while (wl_display_prepare_read(wl->display) != 0) {
+            if (wl_display_dispatch_pending(wl->display) < 0) return -1;
+        }
+        if (*flag) {
+            wl_display_cancel_read(wl->display);
+            break;
+        }
+        wl_display_flush(wl->display);
+        
+        uint64_t now = monotonic_ns();
+        int remaining = now < deadline ? (int)((deadline - now) / 1000000ULL) : 0;
+        struct pollfd pfd = { wl_display_get_fd(wl->display), POLLIN, 0 };
+        int ready = poll(&pfd, 1, remaining);
+        if (ready <= 0) {
+            wl_display_cancel_read(wl->display);
+            if (ready < 0 && errno != EINTR) return -1;
+            if (ready == 0) return 0;
+            continue;
+        }
+        if (wl_display_read_events(wl->display) != 0 ||
+            wl_display_dispatch_pending(wl->display) < 0) {
+            fprintf(stderr, "Wayland连接已断开\n");
+            return -1;
+        }
+    }
+    return 1;
+}
+
+// 按buffer事件给出的参数分配共享内存缓冲区，参数不变时复用
+static int wayland_prepare_buffer(WaylandState* wl, GraphicsBuffer* buf) {
+    size_t size = (size_t)wl->frame_stride * wl->frame_height;
+    if (wl->buffer && wl->buffer_format == wl->frame_format && wl->buffer_width == wl->frame_width &&
+        wl->buffer_height == wl->frame_height && wl->buffer_stride == wl->frame_stride) {
+        return 0;
+    }
+    
+    if (wl->buffer) {
+        wl_buffer_destroy(wl->buffer);
+        munmap(wl->data, wl->size);
+        wl->buffer = NULL;
+    }
+    
+    int fd = memfd_create("graphics-commander", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        perror("创建共享内存失败");
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    wl->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (wl->data == MAP_FAILED) {
+        perror("映射共享内存失败");
+        close(fd);
+        return -1;
+    }
+    struct wl_shm_pool* pool = wl_shm_create_pool(wl->shm, fd, size);
+    wl->buffer = wl_shm_pool_create_buffer(pool, 0, wl->frame_width, wl->frame_height,
+                                           wl->frame_stride, wl->frame_format);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    
+    wl->size = size;
+    wl->buffer_format = wl->frame_format;
+    wl->buffer_width = wl->frame_width;
+    wl->buffer_height = wl->frame_height;
+    wl->buffer_stride = wl->frame_stride;
+    
+    buf->buffer = wl->data;
+    buf->width = wl->frame_width;
+    buf->height = wl->frame_height;
+    buf->line_length = wl->frame_stride;
+    buf->format = wayland_pixel_format(wl->frame_format);
+    buf->bpp = pixel_format_bpp(buf->format);
+    buf->size = size;
+    buf->damage_count = -1;     // 新缓冲区整帧重新转换
+    return 0;
+}
+
+static void wayland_end_frame(WaylandState* wl) {
+    if (wl->frame) {
+        wl_proxy_marshal(wl->frame, SCREENCOPY_FRAME_DESTROY);
+        wl_proxy_destroy(wl->frame);
+        wl->frame = NULL;
+    }
+}
+
+// 请求截取一帧并等待buffer参数，然后发出copy (with_damage时合成器等到有变化才复制)
+static int wayland_begin_frame(WaylandState* wl, GraphicsBuffer* buf, int with_damage) {
+    wl->buffer_info = 0;
+    wl->buffer_done = 0;
+    wl->frame_flags = 0;
+    wl->frame_state = 0;
+    wl->frame = wl_proxy_marshal_constructor(wl->manager, SCREENCOPY_MANAGER_CAPTURE_OUTPUT,
+                                             &zwlr_screencopy_frame_v1_interface, NULL, 0, wl->output);
+    if (!wl->frame) {
+        return -1;
+    }
+    wl_proxy_add_listener(wl->frame, (void (**)(void))&screencopy_frame_listener, wl);
+    
+    // v3在列出全部格式后发送buffer_done，旧版本只有一个buffer事件
+    int* announced = wl->manager_version >= 3 ? &wl->buffer_done : &wl->buffer_info;
+    if (wayland_wait(wl, announced, 1000) != 1 || wl->frame_state < 0) {
+        fprintf(stderr, "Wayland合成器没有回应截屏请求\n");
+        wayland_end_frame(wl);
+        return -1;
+    }
+    if (!wl->buffer_info) {
+        fprintf(stderr, "Wayland合成器没有提供可用的共享内存格式\n");
+        wayland_end_frame(wl);
+        return -1;
+    }
+    if (wayland_prepare_buffer(wl, buf) != 0) {
+        wayland_end_frame(wl);
+        return -1;
+    }
+    
+    wl_proxy_marshal(wl->frame, with_damage ? SCREENCOPY_FRAME_COPY_WITH_DAMAGE : SCREENCOPY_FRAME_COPY,
+                     wl->buffer);
+    return 0;
+}
+
+// 合成器可能按y轴翻转写入，翻转回正常行序
+static void wayland_flip_rows(WaylandState* wl) {
+    size_t stride = wl->buffer_stride;
+    uint8_t* row = malloc(stride);
+    if (!row) return;
+    uint8_t* top = wl->data;
+    uint8_t* bottom = top + stride * (wl->buffer_height - 1);
+    for (; top < bottom; top += stride, bottom -= stride) {
+        memcpy(row, top, stride);
+        memcpy(top, bottom, stride);
+        memcpy(bottom, row, stride);
+    }
+    free(row);
+}
+
+// device: wayland:[DISPLAY][/N]，N为输出序号 (默认0)
+int init_wayland(GraphicsBuffer* buf, const char* device) {
+    char name[128];
+    snprintf(name, sizeof(name), "%s", device + 8);
+    int output_index = 0;
+    char* slash = strchr(name, '/');
+    if (slash) {
+        *slash = '\0';
+        output_index = atoi(slash + 1);
+    }
+    
+    WaylandState* wl = calloc(1, sizeof(WaylandState));
+    if (!wl) {
+        perror("分配内存失败");
+        return -1;
+    }
+    wl->display = wl_display_connect(name[0] ? name : NULL);
+    if (!wl->display) {
+        fprintf(stderr, "无法连接Wayland显示: %s\n", name[0] ? name : "WAYLAND_DISPLAY");
+        free(wl);
+        return -1;
+    }
+    wl->registry = wl_display_get_registry(wl->display);
+    wl_registry_add_listener(wl->registry, &wayland_registry_listener, wl);
+    wl_display_roundtrip(wl->display);
+    
+    snprintf(buf->device, sizeof(buf->device), "%s", device);
+    buf->fd = -1;
+    buf->buffer = NULL;
+    buf->type = SERVER_WAYLAND;
+    buf->map_base = NULL;
+    buf->map_size = 0;
+    buf->frame_count = 0;
+    buf->frame_index = 0;
+    buf->priv = wl;
+    
+    if (!wl->manager || !wl->shm) {
+        fprintf(stderr, "Wayland合成器不支持 zwlr_screencopy_manager_v1 (需要wlroots系合成器)\n");
+        release_wayland(buf);
+        return -1;
+    }
+    if (output_index < 0 || output_index >= wl->output_count) {
+        fprintf(stderr, "Wayland输出序号 %d 不存在 (共 %d 个)\n", output_index, wl->output_count);
+        release_wayland(buf);
+        return -1;
+    }
+    wl->output = wl->outputs[output_index];
+    if (wl->manager_version < 2) {
+        buf->caps &= ~(CAPTURE_CAP_DAMAGE | CAPTURE_CAP_EVENTS);
+    }
+    
+    // 首帧用普通copy，立即得到完整画面
+    if (wayland_begin_frame(wl, buf, 0) != 0 || wayland_wait(wl, &wl->frame_state, 2000) != 1 ||
+        wl->frame_state < 0) {
+        fprintf(stderr, "Wayland截屏失败\n");
+        release_wayland(buf);
+        return -1;
+    }
+    if (wl->frame_flags & SCREENCOPY_FRAME_FLAG_Y_INVERT) {
+        wayland_flip_rows(wl);
+    }
+    wayland_end_frame(wl);
+    
+    if (app.verbose) {
+        printf("Wayland: 输出%d %dx%d 格式%08x (screencopy v%u)\n", output_index,
+               buf->width, buf->height, wl->buffer_format, wl->manager_version);
+    }
+    return 0;
+}
+
+// copy_with_damage下合成器只在画面变化后才回应；等待超时返回0且本帧没有变化区域，
+// 已发出的copy保留到下一次调用
+int wayland_next_frame(GraphicsBuffer* buf) {
+    WaylandState* wl = (WaylandState*)buf->priv;
+    int with_damage = wl->manager_version >= 2;
+    
+    buf->damage_count = with_damage ? 0 : -1;
+    wl->target = buf;
+    // 上一帧没有经release_frame归还时在这里结束它
+    if (wl->frame && wl->frame_state != 0) {
+        wayland_end_frame(wl);
+    }
+    if (!wl->frame && wayland_begin_frame(wl, buf, with_damage) != 0) {
+        wl->target = NULL;
+        return -1;
+    }
+    
+    int ret = wayland_wait(wl, &wl->frame_state, 100);
+    wl->target = NULL;
+    if (ret < 0) return -1;
+    if (ret == 0) return 0;
+    
+    if (wl->frame_state < 0) {
+        fprintf(stderr, "Wayland截屏失败\n");
+        wayland_end_frame(wl);
+        return -1;
+    }
+    if (wl->frame_flags & SCREENCOPY_FRAME_FLAG_Y_INVERT) {
+        wayland_flip_rows(wl);
+    }
+    return 0;
+}
+
+// 帧对象只能用一次；转换完成后才结束它，下次取帧时再请求，避免合成器在转换期间改写缓冲区。
+// 等待超时的帧仍在进行中，保留到下一次调用
+void wayland_release_frame(GraphicsBuffer* buf) {
+    WaylandState* wl = (WaylandState*)buf->priv;
+    if (wl->frame && wl->frame_state != 0) {
+        wayland_end_frame(wl);
+    }
+}
+
+void release_wayland(GraphicsBuffer* buf) {
+    WaylandState* wl = (WaylandState*)buf->priv;
+    if (wl) {
+        wayland_end_frame(wl);
+        if (wl->buffer) {
+            wl_buffer_destroy(wl->buffer);
+            munmap(wl->data, wl->size);
+        }
+        if (wl->manager) {
+            wl_proxy_marshal(wl->manager, SCREENCOPY_MANAGER_DESTROY);
+            wl_proxy_destroy(wl->manager);
+        }
+        for (int i = 0; i < wl->output_count; i++) {
+            wl_output_destroy(wl->outputs[i]);
+        }
+        if (wl->shm) wl_shm_destroy(wl->shm);
+        wl_registry_destroy(wl->registry);
+        wl_display_disconnect(wl->display);
+        free(wl);
+    }
+    buf->buffer = NULL;
+    buf->priv = NULL;
+}
+#endif
+
+#ifdef USE_DRM
+// DRM fourcc按小端值定义通道位置
+static PixelFormat drm_pixel_format(uint32_t fourcc) {
+    switch (fourcc) {
+        case DRM_FORMAT_XRGB8888:
+        case DRM_FORMAT_ARGB8888:
+            return PIXFMT_BGRA8888;
+        case DRM_FORMAT_XBGR8888:
+        case DRM_FORMAT_ABGR8888:
+            return PIXFMT_RGBA8888;
+        case DRM_FORMAT_RGB888:
+            return PIXFMT_BGR888;
+        case DRM_FORMAT_BGR888:
+            return PIXFMT_RGB888;
+        case DRM_FORMAT_BGRX8888:
+        case DRM_FORMAT_BGRA8888:
+            return PIXFMT_ARGB8888;
+        case DRM_FORMAT_RGBX8888:
+        case DRM_FORMAT_RGBA8888:
+            return PIXFMT_ABGR8888;
+        case DRM_FORMAT_XRGB2101010:
+        case DRM_FORMAT_ARGB2101010:
+            return PIXFMT_XRGB2101010;
+        case DRM_FORMAT_RGB565:
+            return PIXFMT_RGB565;
+        case DRM_FORMAT_BGR565:
+            return PIXFMT_BGR565;
+        case DRM_FORMAT_XRGB1555:
+        case DRM_FORMAT_ARGB1555:
+            return PIXFMT_RGB555;
+        default:
+            return PIXFMT_UNKNOWN;
+    }
+}
+
+// 关闭查询帧缓冲区时得到的GEM句柄，多个平面可能共用同一个句柄
+static void drm_close_handles(DrmState* drm, const DrmFbInfo* info, uint32_t keep) {
+    for (int i = 0; i < 4; i++) {
+        int seen = info->handles[i] == keep;
+        for (int j = 0; j < i; j++) {
+            seen |= info->handles[j] == info->handles[i];
+        }
+        if (info->handles[i] && !seen) {
+            struct drm_gem_close close_req = { .handle = info->handles[i] };
+            drmIoctl(drm->fd, DRM_IOCTL_GEM_CLOSE, &close_req);
+        }
+    }
+}
+
+// 查询帧缓冲区；成功时调用者负责drm_close_handles
+static int drm_query_fb(DrmState* drm, uint32_t fb_id, DrmFbInfo* info) {
+    memset(info, 0, sizeof(*info));
+    
+    drmModeFB2Ptr fb2 = drmModeGetFB2(drm->fd, fb_id);
+    if (fb2) {
+        memcpy(info->handles, fb2->handles, sizeof(info->handles));
+        memcpy(info->pitches, fb2->pitches, sizeof(info->pitches));
+        memcpy(info->offsets, fb2->offsets, sizeof(info->offsets));
+        info->width = fb2->width;
+        info->height = fb2->height;
+        info->pixel_format = fb2->pixel_format;
+        if ((fb2->flags & DRM_MODE_FB_MODIFIERS) && fb2->modifier != DRM_FORMAT_MOD_LINEAR) {
+            fprintf(stderr, "扫描输出缓冲区是分块布局 (modifier 0x%llx)，无法直接读取\n",
+                    (unsigned long long)fb2->modifier);
+            drm_close_handles(drm, info, 0);
+            drmModeFreeFB2(fb2);
+            return -1;
+        }
+        drmModeFreeFB2(fb2);
+    } else {
+        // 旧内核没有GETFB2，按bpp/depth推断格式
+        drmModeFBPtr fb = drmModeGetFB(drm->fd, fb_id);
+        if (!fb) {
+            perror("获取DRM帧缓冲区失败");
+            return -1;
+        }
+        info->handles[0] = fb->handle;
+        info->pitches[0] = fb->pitch;
+        info->width = fb->width;
+        info->height = fb->height;
+        info->pixel_format = fb->bpp == 16 ? (fb->depth == 15 ? DRM_FORMAT_XRGB1555 : DRM_FORMAT_RGB565) :
+                             fb->bpp == 24 ? DRM_FORMAT_RGB888 :
+                             fb->depth == 30 ? DRM_FORMAT_XRGB2101010 :
+                             fb->depth == 32 ? DRM_FORMAT_ARGB8888 : DRM_FORMAT_XRGB8888;
+        drmModeFreeFB(fb);
+    }
+    
+    if (!info->handles[0]) {
+        fprintf(stderr, "无法取得DRM缓冲区句柄 (需要root权限)\n");
+        return -1;
+    }
+    
+    // 对象仍有句柄时重复导出得到同一个dma-buf，文件的inode即对象身份
+    int prime_fd;
+    struct stat st;
+    if (drmPrimeHandleToFD(drm->fd, info->handles[0], DRM_CLOEXEC, &prime_fd) == 0) {
+        if (fstat(prime_fd, &st) == 0) {
+            info->object_dev = st.st_dev;
+            info->object_ino = st.st_ino;
+        }
+        close(prime_fd);
+    }
+    return 0;
+}
+
+// 缓存的映射是否仍对应同一个缓冲区对象和布局；对象身份未知时不复用
+static int drm_fb_same(const DrmFbInfo* a, const DrmFbInfo* b) {
+    return a->object_ino != 0 &&
+           a->object_dev == b->object_dev && a->object_ino == b->object_ino &&
+           memcmp(a->pitches, b->pitches, sizeof(a->pitches)) == 0 &&
+           memcmp(a->offsets, b->offsets, sizeof(a->offsets)) == 0 &&
+           a->width == b->width && a->height == b->height &&
+           a->pixel_format == b->pixel_format;
+}
+
+// 释放缓存槽：解除映射并关闭保留的句柄
+static void drm_drop_mapping(DrmState* drm, DrmMapping* m) {
+    if (!m->fb_id) return;
+    munmap(m->map, m->map_size);
+    struct drm_gem_close close_req = { .handle = m->handle };
+    drmIoctl(drm->fd, DRM_IOCTL_GEM_CLOSE, &close_req);
+    m->fb_id = 0;
+    m->handle = 0;
+}
+
+// 映射帧缓冲区的第一个平面：优先dumb映射，失败时导出为dma-buf映射
+static int drm_map_fb(DrmState* drm, uint32_t fb_id, const DrmFbInfo* info, DrmMapping* m) {
+    uint32_t handle = info->handles[0];
+    uint32_t fourcc = info->pixel_format;
+    PixelFormat format = drm_pixel_format(fourcc);
+    size_t size = info->offsets[0] + (size_t)info->pitches[0] * info->height;
+    void* map = MAP_FAILED;
+    
+    if (format == PIXFMT_UNKNOWN) {
+        fprintf(stderr, "不支持的DRM像素格式: %.4s\n", (const char*)&fourcc);
+        return -1;
+    }
+    
+    struct drm_mode_map_dumb map_req = { .handle = handle };
+    if (drmIoctl(drm->fd, DRM_IOCTL_MODE_MAP_DUMB, &map_req) == 0) {
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, drm->fd, map_req.offset);
+    }
+    if (map == MAP_FAILED) {
+        int prime_fd;
+        if (drmPrimeHandleToFD(drm->fd, handle, DRM_CLOEXEC, &prime_fd) == 0) {
+            map = mmap(NULL, size, PROT_READ, MAP_SHARED, prime_fd, 0);
+            close(prime_fd);
+        }
+    }
+    if (map == MAP_FAILED) {
+        perror("映射DRM扫描输出缓冲区失败");
+        return -1;
+    }
+    
+    m->fb_id = fb_id;
+    m->handle = handle;
+    m->info = *info;
+    m->map = map;
+    m->map_size = size;
+    m->offset = info->offsets[0];
+    m->width = info->width;
+    m->height = info->height;
+    m->pitch = info->pitches[0];
+    m->format = format;
+    m->bpp = pixel_format_bpp(format);
+    return 0;
+}
+
+// 切换到扫描输出的帧缓冲区：翻页时在几个缓冲区间轮换，已映射的直接复用。
+// ID相同但缓冲区对象、行距、尺寸或格式变了，说明ID已被新的缓冲区复用，必须重新映射
+static int drm_select_fb(GraphicsBuffer* buf, DrmState* drm, uint32_t fb_id) {
+    DrmMapping* slot = NULL;
+    DrmFbInfo info;
+    
+    if (drm_query_fb(drm, fb_id, &info) != 0) {
+        return -1;
+    }
+    
+    for (int i = 0; i < DRM_MAP_CACHE; i++) {
+        if (drm->maps[i].fb_id == fb_id) {
+            slot = &drm->maps[i];
+            break;
+        }
+    }
+    if (slot && !drm_fb_same(&slot->info, &info)) {
+        drm_drop_mapping(drm, slot);
+        slot->last_used = 0;
+        slot = NULL;
+    }
+    if (!slot) {
+        slot = &drm->maps[0];
+        for (int i = 1; i < DRM_MAP_CACHE; i++) {
+            if (drm->maps[i].last_used < slot->last_used) slot = &drm->maps[i];
+        }
+        drm_drop_mapping(drm, slot);
+        // 第一个平面的句柄随映射保留，其余句柄立即关闭
+        int ret = drm_map_fb(drm, fb_id, &info, slot);
+        drm_close_handles(drm, &info, ret == 0 ? slot->handle : 0);
+        if (ret != 0) {
+            return -1;
+        }
+        drm->remaps++;
+    } else {
+        drm_close_handles(drm, &info, 0);
+    }
+    
+    slot->last_used = ++drm->use_clock;
+    drm->fb_id = fb_id;
+    buf->buffer = (unsigned char*)slot->map + slot->offset;
+    buf->width = slot->width;
+    buf->height = slot->height;
+    buf->bpp = slot->bpp;
+    buf->line_length = slot->pitch;
+    buf->size = (size_t)slot->pitch * slot->height;
+    buf->format = slot->format;
+    return 0;
+}
+
+// device: /dev/dri/cardN[:K]，K为第几个点亮的CRTC (默认0)
+int init_drm(GraphicsBuffer* buf, const char* device) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s", device);
+    int crtc_index = 0;
+    char* colon = strchr(path, ':');
+    if (colon) {
+        *colon = '\0';
+        crtc_index = atoi(colon + 1);
+    }
+    
+    DrmState* drm = calloc(1, sizeof(DrmState));
+    if (!drm) {
+        perror("分配内存失败");
+        return -1;
+    }
+    drm->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (drm->fd < 0) {
+        perror("打开DRM设备失败");
+        free(drm);
+        return -1;
+    }
+    
+    drmModeResPtr res = drmModeGetResources(drm->fd);
+    if (!res) {
+        fprintf(stderr, "%s 不是KMS设备\n", path);
+        close(drm->fd);
+        free(drm);
+        return -1;
+    }
+    int active = 0;
+    for (int i = 0; i < res->count_crtcs && !drm->crtc_id; i++) {
+        drmModeCrtcPtr crtc = drmModeGetCrtc(drm->fd, res->crtcs[i]);
+        if (crtc && crtc->mode_valid && crtc->buffer_id && active++ == crtc_index) {
+            drm->crtc_id = crtc->crtc_id;
+            drm->fb_id = crtc->buffer_id;
+        }
+        drmModeFreeCrtc(crtc);
+    }
+    drmModeFreeResources(res);
+    
+    snprintf(buf->device, sizeof(buf->device), "%s", device);
+    buf->fd = -1;
+    buf->type = SERVER_FRAMEBUFFER;
+    buf->map_base = NULL;
+    buf->map_size = 0;
+    buf->frame_count = 0;
+    buf->frame_index = 0;
+    buf->priv = drm;
+    buf->damage_count = -1;
+    
+    if (!drm->crtc_id) {
+        fprintf(stderr, "%s 上没有第 %d 个点亮的CRTC (共 %d 个)\n", path, crtc_index, active);
+        release_drm(buf);
+        return -1;
+    }
+    if (drm_select_fb(buf, drm, drm->fb_id) != 0) {
+        release_drm(buf);
+        return -1;
+    }
+    
+    if (app.verbose) {
+        printf("DRM: %s CRTC %u 帧缓冲区 %u %dx%d %d位\n", path, drm->crtc_id, drm->fb_id,
+               buf->width, buf->height, buf->bpp);
+    }
+    return 0;
+}
+
+// 每帧只查询CRTC当前的帧缓冲区ID，变化时才重新映射
+int drm_next_frame(GraphicsBuffer* buf) {
+    DrmState* drm = (DrmState*)buf->priv;
+    drmModeCrtcPtr crtc = drmModeGetCrtc(drm->fd, drm->crtc_id);
+    if (!crtc) {
+        perror("查询CRTC失败");
+        return -1;
+    }
+    uint32_t fb_id = crtc->buffer_id;
+    drmModeFreeCrtc(crtc);
+    
+    // 关屏时没有扫描输出，保留最后一帧
+    if (fb_id == 0 || fb_id == drm->fb_id) {
+        return 0;
+    }
+    return drm_select_fb(buf, drm, fb_id);
+}
+
+void release_drm(GraphicsBuffer* buf) {
+    DrmState* drm = (DrmState*)buf->priv;
+    if (drm) {
+        if (app.verbose) {
+            printf("DRM: 重新映射 %lu 次\n", drm->remaps);
+        }
+        for (int i = 0; i < DRM_MAP_CACHE; i++) {
+            drm_drop_mapping(drm, &drm->maps[i]);
+        }
+        close(drm->fd);
+        free(drm);
+    }
+    buf->buffer = NULL;
+    buf->priv = NULL;
+}
+#endif
+
+int cell_frame_init(CellFrame* frame, int cols, int rows) {
+    frame->cols = cols;
+    frame->rows = rows;
+    frame->cells = calloc((size_t)cols * rows, sizeof(TextCell));
+    return frame->cells ? 0 : -1;
+}
+
+void cell_frame_free(CellFrame* frame) {
+    free(frame->cells);
+    frame->cells = NULL;
+}
+
+// 计算实际采样区域
+static int sample_region(GraphicsBuffer* buf, DisplayConfig* config,
+                         int* region_x, int* region_y, int* region_w, int* region_h) {
+    *region_x = config->region_x;
+    *region_y = config->region_y;
+    *region_w = config->region_w > 0 ? config->region_w : buf->width;
+    *region_h = config->region_h > 0 ? config->region_h : buf->height;
+    
+    // 边界检查：区域裁剪到帧内，解码内核不再逐像素检查
+    if (*region_x < 0) {
+        *region_w += *region_x;
+        *region_x = 0;
+    }
+    if (*region_y < 0) {
+        *region_h += *region_y;
+        *region_y = 0;
+    }
+    if (*region_x >= buf->width || *region_y >= buf->height) return -1;
+    if (*region_w > buf->width - *region_x) *region_w = buf->width - *region_x;
+    if (*region_h > buf->height - *region_y) *region_h = buf->height - *region_y;
+    return *region_w > 0 && *region_h > 0 ? 0 : -1;
+}
+
+static CellRect cell_rect_clip(CellFrame* frame, const CellRect* rect) {
+    CellRect full = { 0, 0, frame->cols, frame->rows };
+    return rect ? *rect : full;
+}
+
+// 区域采样：对字符单元覆盖的全部像素求平均，细的亮线不会因为落在采样点之间而消失。
+// SAMPLING_LINEAR先经查找表转到线性光再平均，结果再转回sRGB
+static int cells_decode_area(GraphicsBuffer* buf, DisplayConfig* config, TextCell* out, int stride, CellRect r,
+                             int region_x, int region_y, float x_step, float y_step) {
+    int count = r.x1 - r.x0;
+    int linear = config->sampling == SAMPLING_LINEAR;
+    
+    // 各字符单元覆盖的像素列 (相对于span_x0)，至少一列
+    int* col_start = malloc(sizeof(int) * count);
+    int* col_end = malloc(sizeof(int) * count);
+    uint64_t* sum = malloc(sizeof(uint64_t) * 3 * count);
+    int* xoff = NULL;
+    TextCell* line = NULL;
+    int span_x0 = region_x + (int)(r.x0 * x_step);
+    int span = 1;
+    
+    if (col_start && col_end && sum) {
+        for (int i = 0; i < count; i++) {
+            int x0 = region_x + (int)((r.x0 + i) * x_step);
+            int x1 = region_x + (int)((r.x0 + i + 1) * x_step);
+            if (x1 <= x0) x1 = x0 + 1;
+            if (x1 > buf->width) x1 = buf->width;
+            col_start[i] = x0 - span_x0;
+            col_end[i] = x1 - span_x0;
+            if (col_end[i] > span) span = col_end[i];
+        }
+        xoff = malloc(sizeof(int) * span);
+        line = malloc(sizeof(TextCell) * span);
+    }
+    if (!xoff || !line) {
+        free(col_start);
+        free(col_end);
+        free(sum);
+        free(xoff);
+        free(line);
+        return -1;
+    }
+    
+    int bytes = bytes_per_pixel(buf);
+    for (int i = 0; i < span; i++) {
+        xoff[i] = (span_x0 + i) * bytes;
+    }
+    PixelRowDecoder decode = pixel_decoder(buf->format);
+    
+    for (int out_y = r.y0; out_y < r.y1; out_y++) {
+        int y0 = region_y + (int)(out_y * y_step);
+        int y1 = region_y + (int)((out_y + 1) * y_step);
+        if (y1 <= y0) y1 = y0 + 1;
+        if (y1 > buf->height) y1 = buf->height;
+        
+        memset(sum, 0, sizeof(uint64_t) * 3 * count);
+        for (int y = y0; y < y1; y++) {
+            decode((const uint8_t*)buf->buffer + (size_t)y * buf->line_length, xoff, span, line, &buf->layout);
+            for (int i = 0; i < count; i++) {
+                uint64_t* s = &sum[i * 3];
+                const TextCell* p = &line[col_start[i]];
+                const TextCell* end = &line[col_end[i]];
+                if (linear) {
+                    for (; p < end; p++) {
+                        s[0] += srgb_to_linear[p->r];
+                        s[1] += srgb_to_linear[p->g];
+                        s[2] += srgb_to_linear[p->b];
+                    }
+                } else {
+                    for (; p < end; p++) {
+                        s[0] += p->r;
+                        s[1] += p->g;
+                        s[2] += p->b;
+                    }
+                }
+            }
+        }
+        
+        TextCell* cell = &out[(size_t)(out_y - r.y0) * stride];
+        for (int i = 0; i < count; i++, cell++) {
+            uint64_t n = (uint64_t)(col_end[i] - col_start[i]) * (y1 - y0);
+            uint64_t* s = &sum[i * 3];
+            if (linear) {
+                cell->r = linear_to_srgb[(s[0] / n) >> 4];
+                cell->g = linear_to_srgb[(s[1] / n) >> 4];
+                cell->b = linear_to_srgb[(s[2] / n) >> 4];
+            } else {
+                cell->r = (uint8_t)(s[0] / n);
+                cell->g = (uint8_t)(s[1] / n);
+                cell->b = (uint8_t)(s[2] / n);
+            }
+        }
+    }
+    
+    free(col_start);
+    free(col_end);
+    free(sum);
+    free(xoff);
+    free(line);
+    return 0;
+}
+
+// 把采样区域划分为grid_cols x grid_rows的网格，解码r内的网格单元，结果写入out (行跨度stride)
+static int decode_grid(GraphicsBuffer* buf, DisplayConfig* config, int grid_cols, int grid_rows,
+                       CellRect r, TextCell* out, int stride) {
+    int region_x, region_y, region_w, region_h;
+    if (sample_region(buf, config, &region_x, &region_y, &region_w, &region_h) != 0) {
+        return -1;
+    }
+    
+    // 计算采样步长
+    float x_step = (float)region_w / grid_cols;
+    float y_step = (float)region_h / grid_rows;
+    int count = r.x1 - r.x0;
+    if (config->sampling != SAMPLING_POINT) {
+        return cells_decode_area(buf, config, out, stride, r, region_x, region_y, x_step, y_step);
+    }
+    
+    // 各列的采样偏移对所有行相同，先算好；解码内核按格式只选一次
+    int* xoff = malloc(sizeof(int) * count);
+    if (!xoff) {
+        return -1;
+    }
+    int bytes = bytes_per_pixel(buf);
+    for (int i = 0; i < count; i++) {
+        xoff[i] = (region_x + (int)((r.x0 + i) * x_step)) * bytes;
+    }
+    PixelRowDecoder decode = pixel_decoder(buf->format);
+    
+    for (int out_y = r.y0; out_y < r.y1; out_y++) {
+        int in_y = region_y + (int)(out_y * y_step);
+        decode((const uint8_t*)buf->buffer + (size_t)in_y * buf->line_length, xoff, count,
+               &out[(size_t)(out_y - r.y0) * stride], &buf->layout);
+    }
+    
+    free(xoff);
+    return 0;
+}
+
+// 2x2块的7种二分法 (掩码与其补集等价)：4种单像素分组和3种与左上像素成对的分组。
+// 组间平方和 = |n*A - na*S|^2 / (n*na*nb)，乘以12后单像素分组为|4A-S|^2，成对分组为3|2A-S|^2，
+// 组间平方和最大即组内误差最小
+static const uint8_t quadrant_masks[7] = { 1, 2, 4, 8, 3, 5, 9 };
+static const uint8_t quadrant_size[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+// 均值以定点倒数代替除法 (向下取整，线性光的和乘以倒数后不会越过查找表)
+static const uint32_t block_recip[7] = { 0, 65536, 32768, 21845, 16384, 13107, 10922 };
+
+// 线性光下求mask所选像素的均值
+static void quadrant_mean_linear(const int v[3][4], int mask, uint8_t* rgb) {
+    uint64_t recip = block_recip[quadrant_size[mask]];
+    for (int c = 0; c < 3; c++) {
+        uint32_t sum = 0;
+        for (int k = 0; k < 4; k++) {
+            sum += (uint32_t)-((mask >> k) & 1) & srgb_to_linear[v[c][k]];
+        }
+        rgb[c] = linear_to_srgb[(sum * recip) >> 20];
+    }
+}
+
+// 对2x2像素做两类最优划分，较亮的一组作前景；四个像素相同时按亮度取全块或空白。
+// 各分组的得分和组内和同时算出，取最大值时不分支
+static void quadrant_fit(const TextCell* const px[4], TextCell* cell, int linear) {
+    int v[3][4];
+    int sum[3];
+    int part[7][3];
+    int score[7] = { 0 };
+    
+    for (int k = 0; k < 4; k++) {
+        v[0][k] = px[k]->r;
+        v[1][k] = px[k]->g;
+        v[2][k] = px[k]->b;
+    }
+    for (int c = 0; c < 3; c++) {
+        sum[c] = v[c][0] + v[c][1] + v[c][2] + v[c][3];
+        for (int k = 0; k < 4; k++) {
+            part[k][c] = v[c][k];
+            int d = 4 * v[c][k] - sum[c];
+            score[k] += d * d;
+        }
+        for (int k = 1; k < 4; k++) {
+            part[3 + k][c] = v[c][0] + v[c][k];
+            int d = 2 * part[3 + k][c] - sum[c];
+            score[3 + k] += 3 * d * d;
+        }
+    }
+    
+    int best = 0;
+    for (int i = 1; i < 7; i++) {
+        best = score[i] > score[best] ? i : best;
+    }
+    int mask = score[best] > 0 ? quadrant_masks[best] : 15;
+    
+    uint8_t fg[3], bg[3];
+    if (linear) {
+        quadrant_mean_linear(v, mask, fg);
+        if (mask != 15) quadrant_mean_linear(v, mask ^ 15, bg);
+    } else {
+        uint32_t in = block_recip[quadrant_size[mask]];
+        uint32_t out = block_recip[4 - quadrant_size[mask]];
+        for (int c = 0; c < 3; c++) {
+            int a = mask == 15 ? sum[c] : part[best][c];
+            fg[c] = (uint8_t)((a * in + 32768) >> 16);
+            bg[c] = (uint8_t)(((sum[c] - a) * out + 32768) >> 16);
+        }
+    }
+    
+    if (mask == 15) {
+        cell->r = cell->r2 = fg[0];
+        cell->g = cell->g2 = fg[1];
+        cell->b = cell->b2 = fg[2];
+        cell->mask = 77 * fg[0] + 150 * fg[1] + 29 * fg[2] >= 128 * 256 ? 15 : 0;
+        return;
+    }
+    
+    int swap = 77 * fg[0] + 150 * fg[1] + 29 * fg[2] < 77 * bg[0] + 150 * bg[1] + 29 * bg[2];
+    const uint8_t* hi = swap ? bg : fg;
+    const uint8_t* lo = swap ? fg : bg;
+    cell->r = hi[0];
+    cell->g = hi[1];
+    cell->b = hi[2];
+    cell->r2 = lo[0];
+    cell->g2 = lo[1];
+    cell->b2 = lo[2];
+    cell->mask = swap ? mask ^ 15 : mask;
+}
+
+// 六分块：以平均亮度为阈值把6个像素分为亮暗两组，各取均值；全部相同时按亮度取全块或空白
+static void sextant_fit(const TextCell* const px[6], TextCell* cell, int linear) {
+    int luma[6], total = 0, mask = 0;
+    
+    for (int k = 0; k < 6; k++) {
+        luma[k] = 77 * px[k]->r + 150 * px[k]->g + 29 * px[k]->b;
+        total += luma[k];
+    }
+    for (int k = 0; k < 6; k++) {
+        mask |= (6 * luma[k] > total) << k;
+    }
+    
+    uint32_t fg[3] = { 0 }, bg[3] = { 0 };
+    for (int k = 0; k < 6; k++) {
+        uint32_t sel = (uint32_t)-((mask >> k) & 1);
+        uint32_t r = linear ? srgb_to_linear[px[k]->r] : px[k]->r;
+        uint32_t g = linear ? srgb_to_linear[px[k]->g] : px[k]->g;
+        uint32_t b = linear ? srgb_to_linear[px[k]->b] : px[k]->b;
+        fg[0] += sel & r;
+        fg[1] += sel & g;
+        fg[2] += sel & b;
+        bg[0] += ~sel & r;
+        bg[1] += ~sel & g;
+        bg[2] += ~sel & b;
+    }
+    
+    int n = __builtin_popcount(mask);
+    uint64_t in = block_recip[n], out = block_recip[6 - n];
+    uint8_t hi[3], lo[3];
+    for (int c = 0; c < 3; c++) {
+        hi[c] = linear ? linear_to_srgb[(fg[c] * in) >> 20] : (uint8_t)((fg[c] * in + 32768) >> 16);
+        lo[c] = linear ? linear_to_srgb[(bg[c] * out) >> 20] : (uint8_t)((bg[c] * out + 32768) >> 16);
+    }
+    
+    if (mask == 0) {
+        memcpy(hi, lo, 3);
+        mask = total >= 6 * 128 * 256 ? 63 : 0;
+    }
+    cell->r = hi[0];
+    cell->g = hi[1];
+    cell->b = hi[2];
+    cell->r2 = lo[0];
+    cell->g2 = lo[1];
+    cell->b2 = lo[2];
+    cell->mask = mask;
+}
+
+// 四分块/六分块模式：在放大的网格上采样，每个字符单元由block_w x block_h个采样点拟合
+static int cells_decode_blocks(GraphicsBuffer* buf, DisplayConfig* config, CellFrame* frame, CellRect r,
+                               int block_w, int block_h) {
+    int count = r.x1 - r.x0;
+    int stride = count * block_w;
+    CellRect sub = { r.x0 * block_w, r.y0 * block_h, r.x1 * block_w, r.y1 * block_h };
+    TextCell* samples = malloc(sizeof(TextCell) * stride * (r.y1 - r.y0) * block_h);
+    if (!samples) {
+        return -1;
+    }
+    if (decode_grid(buf, config, frame->cols * block_w, frame->rows * block_h, sub, samples, stride) != 0) {
+        free(samples);
+        return -1;
+    }
+    
+    int linear = config->sampling == SAMPLING_LINEAR;
+    for (int y = r.y0; y < r.y1; y++) {
+        const TextCell* top = &samples[(size_t)(y - r.y0) * block_h * stride];
+        TextCell* cell = &frame->cells[y * frame->cols + r.x0];
+        
+        for (int i = 0; i < count; i++, cell++) {
+            // 按行优先排列，与字形掩码的位序一致
+            const TextCell* px[6];
+            for (int k = 0; k < block_w * block_h; k++) {
+                px[k] = &top[(k / block_w) * stride + i * block_w + k % block_w];
+            }
+            if (block_h == 3) {
+                sextant_fit(px, cell, linear);
+            } else {
+                quadrant_fit(px, cell, linear);
+            }
+        }
+    }
+    
+    free(samples);
+    return 0;
+}
+
+// 采样阶段：每个字符单元取区域内对应位置的像素，或按config->sampling区域平均；rect为NULL时处理整帧
+int cells_decode(GraphicsBuffer* buf, DisplayConfig* config, CellFrame* frame, const CellRect* rect) {
+    if (!buf || !buf->buffer || !config) {
+        return -1;
+    }
+    
+    CellRect r = cell_rect_clip(frame, rect);
+    if (r.x1 <= r.x0) {
+        return 0;
+    }
+    if (config->charset == CHARSET_QUADRANT) {
+        return cells_decode_blocks(buf, config, frame, r, 2, 2);
+    }
+    if (config->charset == CHARSET_SEXTANT) {
+        return cells_decode_blocks(buf, config, frame, r, 2, 3);
+    }
+    return decode_grid(buf, config, frame->cols, frame->rows, r,
+                       &frame->cells[r.y0 * frame->cols + r.x0], frame->cols);
+}
+
+// 对rect内每个字符单元执行body
+#define FOR_EACH_CELL(frame, rect, cell) \
+    for (int cy_ = (rect).y0; cy_ < (rect).y1; cy_++) \
+        for (TextCell* cell = &(frame)->cells[cy_ * (frame)->cols + (rect).x0], \
+             *end_ = cell + ((rect).x1 - (rect).x0); cell < end_; cell++)
+
+// 采样时已拟合出前景/背景两种颜色的字符集
+static inline int charset_two_color(CharsetMode charset) {
+    return charset == CHARSET_QUADRANT || charset == CHARSET_SEXTANT;
+}
+
+// 调整阶段：亮度和对比度
+static inline uint8_t adjust_channel(int v, DisplayConfig* config) {
+    int out = (int)((v - 128) * config->contrast + 128 * config->brightness);
+    
+    // 限制范围
+    if (out < 0) out = 0;
+    if (out > 255) out = 255;
+    return out;
+}
+
+void cells_adjust(DisplayConfig* config, CellFrame* frame, const CellRect* rect) {
+    CellRect area = cell_rect_clip(frame, rect);
+    
+    FOR_EACH_CELL(frame, area, cell) {
+        cell->r = adjust_channel(cell->r, config);
+        cell->g = adjust_channel(cell->g, config);
+        cell->b = adjust_channel(cell->b, config);
+    }
+    if (charset_two_color(config->charset)) {
+        FOR_EACH_CELL(frame, area, cell) {
+            cell->r2 = adjust_channel(cell->r2, config);
+            cell->g2 = adjust_channel(cell->g2, config);
+            cell->b2 = adjust_channel(cell->b2, config);
+        }
+    }
+}
+
+// 按颜色模式量化为调色板索引 (真彩色保留0xRRGGBB)
+static uint32_t quantize_color(int r, int g, int b, ColorMode mode) {
+    switch (mode) {
+        case COLOR_NONE:
+            return 0;
+        case COLOR_BASIC: {
+            int index = (r + g + b) / 3 / 32;
+            return index > 7 ? 7 : index;
+        }
+        case COLOR_256:
+            return 16 + 36 * (r / 51) + 6 * (g / 51) + (b / 51);
+        case COLOR_GRAY:
+            return 232 + ((r + g + b) / 3 * 24 / 256);
+        case COLOR_TRUE:
+        default:
+            return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+    }
+}
+
+// 量化阶段：前景取采样色，背景取半亮度 (线性光采样时按线性光减半)；同时计算亮度
+void cells_quantize(DisplayConfig* config, CellFrame* frame, const CellRect* rect) {
+    CellRect area = cell_rect_clip(frame, rect);
+    
+    if (charset_two_color(config->charset)) {
+        // 四分块/六分块模式在采样时已拟合出两种颜色
+        FOR_EACH_CELL(frame, area, cell) {
+            cell->fg = quantize_color(cell->r, cell->g, cell->b, config->color_mode);
+            cell->bg = quantize_color(cell->r2, cell->g2, cell->b2, config->color_mode);
+            cell->luma = rgb_to_brightness(cell->r, cell->g, cell->b);
+        }
+        return;
+    }
+    if (config->sampling == SAMPLING_LINEAR) {
+        FOR_EACH_CELL(frame, area, cell) {
+            cell->fg = quantize_color(cell->r, cell->g, cell->b, config->color_mode);
+            cell->bg = quantize_color(srgb_half[cell->r], srgb_half[cell->g], srgb_half[cell->b],
+                                      config->color_mode);
+            cell->luma = rgb_to_brightness(cell->r, cell->g, cell->b);
+        }
+        return;
+    }
+    FOR_EACH_CELL(frame, area, cell) {
+        cell->fg = quantize_color(cell->r, cell->g, cell->b, config->color_mode);
+        cell->bg = quantize_color(cell->r / 2, cell->g / 2, cell->b / 2, config->color_mode);
+        cell->luma = rgb_to_brightness(cell->r, cell->g, cell->b);
+    }
+}
+
+// 字形阶段
+void cells_glyph(DisplayConfig* config, CellFrame* frame, const CellRect* rect) {
+    CellRect area = cell_rect_clip(frame, rect);
+    
+    if (config->charset == CHARSET_QUADRANT) {
+        FOR_EACH_CELL(frame, area, cell) {
+            cell->glyph = &quadrant_glyph_table[cell->mask];
+        }
+        return;
+    }
+    if (config->charset == CHARSET_SEXTANT) {
+        FOR_EACH_CELL(frame, area, cell) {
+            cell->glyph = &sextant_glyph_table[cell->mask];
+        }
+        return;
+    }
+    const Glyph* table = glyph_table[config->charset];
+    FOR_EACH_CELL(frame, area, cell) {
+        cell->glyph = &table[cell->luma];
+    }
+}
+
+// 记录一块变化区域；超过上限时合并为外接矩形
+void damage_add(GraphicsBuffer* buf, int x, int y, int width, int height) {
+    if (buf->damage_count < 0 || width <= 0 || height <= 0) {
+        return;
+    }
+    if (buf->damage_count < MAX_DAMAGE_RECTS) {
+        DamageRect* rect = &buf->damage[buf->damage_count++];
+        rect->x = x;
+        rect->y = y;
+        rect->width = width;
+        rect->height = height;
+        return;
+    }
+    
+    DamageRect* all = &buf->damage[0];
+    int x1 = all->x + all->width, y1 = all->y + all->height;
+    for (int i = 1; i < buf->damage_count; i++) {
+        DamageRect* rect = &buf->damage[i];
+        if (rect->x < all->x) all->x = rect->x;
+        if (rect->y < all->y) all->y = rect->y;
+        if (rect->x + rect->width > x1) x1 = rect->x + rect->width;
+        if (rect->y + rect->height > y1) y1 = rect->y + rect->height;
+    }
+    if (x < all->x) all->x = x;
+    if (y < all->y) all->y = y;
+    if (x + width > x1) x1 = x + width;
+    if (y + height > y1) y1 = y + height;
+    all->width = x1 - all->x;
+    all->height = y1 - all->y;
+    buf->damage_count = 1;
+}
+
+// 把像素变化区域映射为受影响的字符单元矩形；不跟踪变化时返回-1
+int damage_to_cells(GraphicsBuffer* buf, DisplayConfig* config, CellFrame* frame, CellRect* rects) {
+    int region_x, region_y, region_w, region_h;
+    int count = 0;
+    
+    if (buf->damage_count < 0 ||
+        sample_region(buf, config, &region_x, &region_y, &region_w, &region_h) != 0) {
+        return -1;
+    }
+    
+    // 字符单元覆盖的像素范围与变化区域相交即需重新转换
+    float x_step = (float)region_w / frame->cols;
+    float y_step = (float)region_h / frame->rows;
+    for (int i = 0; i < buf->damage_count; i++) {
+        DamageRect* d = &buf->damage[i];
+        CellRect r = {
+            (int)floorf((d->x - region_x) / x_step),
+            (int)floorf((d->y - region_y) / y_step),
+            (int)ceilf((d->x + d->width - region_x) / x_step),
+            (int)ceilf((d->y + d->height - region_y) / y_step)
+        };
+        if (r.x0 < 0) r.x0 = 0;
+        if (r.y0 < 0) r.y0 = 0;
+        if (r.x1 > frame->cols) r.x1 = frame->cols;
+        if (r.y1 > frame->rows) r.y1 = frame->rows;
+        if (r.x0 < r.x1 && r.y0 < r.y1) {
+            rects[count++] = r;
+        }
+    }
+    return count;
+}
+
+// 整体写入4字节，输出缓冲区按每单元64字节预留，不会越界
+static inline char* put_glyph(char* out, const Glyph* glyph) {
+    memcpy(out, glyph->bytes, 4);
+    return out + glyph->len;
+}
+
+size_t cells_output_bound(CellFrame* frame) {
+    // 与原先一致：每个字符预留64字节颜色代码空间
+    return (size_t)frame->rows * frame->cols * 64 + 1;
+}
+
+// 编码阶段：生成ANSI文本，颜色不变时不重复输出颜色代码
+size_t cells_encode(DisplayConfig* config, CellFrame* frame, char* out) {
+    char* current = out;
+    const TextCell* cell = frame->cells;
+    ColorMode mode = config->color_mode;
+    
+    for (int y = 0; y < frame->rows; y++) {
+        int have_color = 0;
+        uint32_t last_fg = 0, last_bg = 0;
+        
+        for (int x = 0; x < frame->cols; x++, cell++) {
+            if (mode != COLOR_NONE &&
+                (!have_color || cell->fg != last_fg || cell->bg != last_bg)) {
+                have_color = 1;
+                last_fg = cell->fg;
+                last_bg = cell->bg;
+                
+                if (mode == COLOR_TRUE) {
+                    current += sprintf(current, "\033[38;2;%u;%u;%um\033[48;2;%u;%u;%um",
+                                       cell->fg >> 16, (cell->fg >> 8) & 0xFF, cell->fg & 0xFF,
+                                       cell->bg >> 16, (cell->bg >> 8) & 0xFF, cell->bg & 0xFF);
+                } else {
+                    current += sprintf(current, "%s%s", color_table[cell->fg].fg,
+                                       color_table[cell->bg].bg);
+                }
+            }
+            
+            current = put_glyph(current, cell->glyph);
+        }
+        
+        // 每行结束重置颜色
+        if (mode != COLOR_NONE) {
+            current += sprintf(current, "\033[0m");
+        }
+        current += sprintf(current, "\n");
+    }
+    
+    return current - out;
+}
+
+static int cells_equal(const TextCell* a, const TextCell* b) {
+    return a->fg == b->fg && a->bg == b->bg && a->glyph == b->glyph;
+}
+
+size_t cells_delta_bound(CellFrame* frame) {
+    // 每个字符另加光标定位
+    return cells_output_bound(frame) + (size_t)frame->rows * frame->cols * 12 + 8;
+}
+
+// 增量编码：只输出与上一帧不同的字符，不连续处用光标定位跳过
+size_t cells_encode_delta(DisplayConfig* config, CellFrame* frame, CellFrame* prev, char* out) {
+    char* current = out;
+    ColorMode mode = config->color_mode;
+    int have_color = 0;
+    uint32_t last_fg = 0, last_bg = 0;
+    
+    for (int y = 0; y < frame->rows; y++) {
+        const TextCell* cell = &frame->cells[y * frame->cols];
+        const TextCell* old = &prev->cells[y * frame->cols];
+        int cursor_x = -1;
+        
+        for (int x = 0; x < frame->cols; x++) {
+            if (cells_equal(&cell[x], &old[x])) continue;
+            
+            if (cursor_x != x) {
+                current += sprintf(current, "\033[%d;%dH", y + 1, x + 1);
+            }
+            if (mode != COLOR_NONE &&
+                (!have_color || cell[x].fg != last_fg || cell[x].bg != last_bg)) {
+                have_color = 1;
+                last_fg = cell[x].fg;
+                last_bg = cell[x].bg;
+                
+                if (mode == COLOR_TRUE) {
+                    current += sprintf(current, "\033[38;2;%u;%u;%um\033[48;2;%u;%u;%um",
+                                       last_fg >> 16, (last_fg >> 8) & 0xFF, last_fg & 0xFF,
+                                       last_bg >> 16, (last_bg >> 8) & 0xFF, last_bg & 0xFF);
+                } else {
+                    current += sprintf(current, "%s%s", color_table[last_fg].fg,
+                                       color_table[last_bg].bg);
+                }
+            }
+            
+            current = put_glyph(current, cell[x].glyph);
+            cursor_x = x + 1;
+        }
+    }
+    
+    if (have_color) {
+        current += sprintf(current, "\033[0m");
+    }
+    *current = '\0';
+    return current - out;
+}
+
+// 转换一帧到字符单元，不编码输出；之后conv->frames[conv->current]为本帧
+int converter_convert(FrameConverter* conv, GraphicsBuffer* buf, DisplayConfig* config) {
+    if (!buf || !buf->buffer || !config) {
+        return -1;
+    }
+    
+    int next = conv->have_previous ? 1 - conv->current : conv->current;
+    CellFrame* frame = &conv->frames[next];
+    
+    // 输出尺寸变化时重建字符单元
+    if (!frame->cells || frame->cols != config->output_width || frame->rows != config->output_height) {
+        converter_free(conv);
+        next = conv->current = 0;
+        frame = &conv->frames[0];
+        if (cell_frame_init(frame, config->output_width, config->output_height) != 0 ||
+            cell_frame_init(&conv->frames[1], config->output_width, config->output_height) != 0) {
+            converter_free(conv);
+            return -1;
+        }
+    }
+    
+    uint64_t t0 = monotonic_ns();
+    CellRect rects[MAX_DAMAGE_RECTS];
+    int rect_count = conv->have_previous ? damage_to_cells(buf, config, frame, rects) : -1;
+    
+    if (rect_count >= 0) {
+        // 源提供了变化区域：沿用上一帧，只重新转换受影响的字符单元
+        memcpy(frame->cells, conv->frames[conv->current].cells,
+               sizeof(TextCell) * frame->cols * frame->rows);
+        for (int i = 0; i < rect_count; i++) {
+            if (cells_decode(buf, config, frame, &rects[i]) != 0) {
+                return -1;
+            }
+            cells_adjust(config, frame, &rects[i]);
+            cells_quantize(config, frame, &rects[i]);
+            cells_glyph(config, frame, &rects[i]);
+        }
+    } else {
+        if (cells_decode(buf, config, frame, NULL) != 0) {
+            return -1;
+        }
+        cells_adjust(config, frame, NULL);
+        cells_quantize(config, frame, NULL);
+        cells_glyph(config, frame, NULL);
+    }
+    histogram_record(&metrics.stages[STAGE_CONVERT], monotonic_ns() - t0);
+    
+    // 与上一帧比较，统计变化的字符单元
+    size_t count = (size_t)frame->cols * frame->rows;
+    if (conv->have_previous) {
+        const TextCell* prev = conv->frames[conv->current].cells;
+        int dirty = 0;
+        for (size_t i = 0; i < count; i++) {
+            dirty += !cells_equal(&frame->cells[i], &prev[i]);
+        }
+        conv->dirty_cells = dirty;
+    } else {
+        conv->dirty_cells = (int)count;
+    }
+    conv->previous_valid = conv->have_previous;
+    conv->current = next;
+    conv->have_previous = 1;
+    
+    return 0;
+}
+
+// 完整帧输出；输出缓冲区末尾预留OUTPUT_TRAILER_RESERVE字节
+int converter_encode(FrameConverter* conv, DisplayConfig* config, char** output, size_t* len) {
+    CellFrame* frame = &conv->frames[conv->current];
+    uint64_t t0 = monotonic_ns();
+    
+    *output = malloc(cells_output_bound(frame) + OUTPUT_TRAILER_RESERVE);
+    if (!*output) {
+        return -1;
+    }
+    *len = cells_encode(config, frame, *output);
+    
+    histogram_record(&metrics.stages[STAGE_ENCODE], monotonic_ns() - t0);
+    histogram_record(&metrics.frame_bytes, *len);
+    return 0;
+}
+
+// 转换并编码完整帧
+int converter_run(FrameConverter* conv, GraphicsBuffer* buf, DisplayConfig* config,
+                  char** output, size_t* len) {
+    if (converter_convert(conv, buf, config) != 0) {
+        return -1;
+    }
+    return converter_encode(conv, config, output, len);
+}
+
+void converter_free(FrameConverter* conv) {
+    cell_frame_free(&conv->frames[0]);
+    cell_frame_free(&conv->frames[1]);
+    conv->current = 0;
+    conv->have_previous = 0;
+    conv->previous_valid = 0;
+    conv->dirty_cells = 0;
+}
+
+// 相对上一帧的增量；没有有效的上一帧时返回-1。输出缓冲区同样预留OUTPUT_TRAILER_RESERVE字节
+int converter_encode_delta(FrameConverter* conv, DisplayConfig* config, char** output, size_t* len) {
+    if (!conv->previous_valid) {
+        return -1;
+    }
+    
+    CellFrame* frame = &conv->frames[conv->current];
+    uint64_t t0 = monotonic_ns();
+    *output = malloc(cells_delta_bound(frame) + OUTPUT_TRAILER_RESERVE);
+    if (!*output) {
+        return -1;
+    }
+    *len = cells_encode_delta(config, frame, &conv->frames[1 - conv->current], *output);
+    histogram_record(&metrics.stages[STAGE_ENCODE], monotonic_ns() - t0);
+    histogram_record(&metrics.frame_bytes, *len);
+    return 0;
+}
+
+int convert_buffer_to_text(GraphicsBuffer* buf, DisplayConfig* config, char** output) {
+    FrameConverter conv = {0};
+    size_t len;
+    
+    int ret = converter_run(&conv, buf, config, output, &len);
+    converter_free(&conv);
+    return ret;
+}
+
+static int sixel_bin(const TextCell* p) {
+    return ((p->r >> 3) << 10) | ((p->g >> 3) << 5) | (p->b >> 3);
+}
+
+// 直方图项中心到调色板最近颜色的下标，按需计算并缓存
+static int sixel_nearest(SixelEncoder* enc, int bin) {
+    if (enc->lookup[bin] != 0xFFFF) {
+        return enc->lookup[bin];
+    }
+    int r = ((bin >> 10) << 3) | 4, g = (((bin >> 5) & 31) << 3) | 4, b = ((bin & 31) << 3) | 4;
+    int best = 0, best_dist = INT_MAX;
+    for (int i = 0; i < enc->palette_size; i++) {
+        int dr = r - enc->palette[i][0], dg = g - enc->palette[i][1], db = b - enc->palette[i][2];
+        int dist = dr * dr + dg * dg + db * db;
+        if (dist < best_dist) {
+            best_dist = dist;
+            best = i;
+        }
+    }
+    enc->lookup[bin] = best;
+    return best;
+}
+
+// 当前调色板对本帧直方图的平均平方误差
+static double sixel_palette_error(SixelEncoder* enc) {
+    uint64_t sum = 0;
+    for (int bin = 0; bin < SIXEL_HIST_SIZE; bin++) {
+        if (!enc->histogram[bin]) continue;
+        const uint8_t* c = enc->palette[sixel_nearest(enc, bin)];
+        int dr = (((bin >> 10) << 3) | 4) - c[0];
+        int dg = ((((bin >> 5) & 31) << 3) | 4) - c[1];
+        int db = (((bin & 31) << 3) | 4) - c[2];
+        sum += (uint64_t)enc->histogram[bin] * (dr * dr + dg * dg + db * db);
+    }
+    return (double)sum / ((double)enc->width * enc->height);
+}
+
+// 中位切分：反复把颜色范围最大的盒子按该通道的像素数中位切开，盒内加权平均为调色板颜色
+static void sixel_build_palette(SixelEncoder* enc) {
+    typedef struct {
+        int start, end;
+        int channel;
+        int range;
+    } Box;
+    Box boxes[SIXEL_MAX_COLORS];
+    uint32_t* entries = enc->entries;
+    uint32_t* sorted = entries + SIXEL_HIST_SIZE;
+    int count = 0;
+    
+    for (int bin = 0; bin < SIXEL_HIST_SIZE; bin++) {
+        if (enc->histogram[bin]) entries[count++] = bin;
+    }
+    
+    int box_count = 1;
+    boxes[0].start = 0;
+    boxes[0].end = count;
+    boxes[0].range = -1;
+    for (;;) {
+        // 计算新切出的盒子的通道范围
+        for (int i = 0; i < box_count; i++) {
+            Box* box = &boxes[i];
+            if (box->range >= 0) continue;
+            int lo[3] = { 31, 31, 31 }, hi[3] = { 0, 0, 0 };
+            for (int k = box->start; k < box->end; k++) {
+                int v[3] = { entries[k] >> 10, (entries[k] >> 5) & 31, entries[k] & 31 };
+                for (int c = 0; c < 3; c++) {
+                    if (v[c] < lo[c]) lo[c] = v[c];
+                    if (v[c] > hi[c]) hi[c] = v[c];
+                }
+            }
+            box->channel = 0;
+            box->range = 0;
+            for (int c = 0; c < 3; c++) {
+                if (hi[c] - lo[c] > box->range) {
+                    box->range = hi[c] - lo[c];
+                    box->channel = c;
+                }
+            }
+        }
+        if (box_count >= SIXEL_MAX_COLORS) break;
+        
+        int pick = -1;
+        for (int i = 0; i < box_count; i++) {
+            if (boxes[i].range > 0 && (pick < 0 || boxes[i].range > boxes[pick].range)) pick = i;
+        }
+        if (pick < 0) break;
+        
+        // 按通道值计数排序，再按像素数取中位
+        Box* box = &boxes[pick];
+        int shift = box->channel == 0 ? 10 : box->channel == 1 ? 5 : 0;
+        int offsets[33] = { 0 };
+        uint64_t total = 0;
+        for (int k = box->start; k < box->end; k++) {
+            offsets[((entries[k] >> shift) & 31) + 1]++;
+            total += enc->histogram[entries[k]];
+        }
+        for (int v = 0; v < 32; v++) offsets[v + 1] += offsets[v];
+        for (int k = box->start; k < box->end; k++) {
+            sorted[offsets[(entries[k] >> shift) & 31]++] = entries[k];
+        }
+        memcpy(&entries[box->start], sorted, sizeof(uint32_t) * (box->end - box->start));
+        
+        int split = box->start + 1;
+        uint64_t acc = enc->histogram[entries[box->start]];
+        while (split < box->end - 1 && acc * 2 < total) {
+            acc += enc->histogram[entries[split++]];
+        }
+        boxes[box_count].start = split;
+        boxes[box_count].end = box->end;
+        boxes[box_count].range = -1;
+        box->end = split;
+        box->range = -1;
+        box_count++;
+    }
+    
+    for (int i = 0; i < box_count; i++) {
+        uint64_t sum[3] = { 0, 0, 0 }, n = 0;
+        for (int k = boxes[i].start; k < boxes[i].end; k++) {
+            uint32_t bin = entries[k], w = enc->histogram[bin];
+            sum[0] += (uint64_t)w * (((bin >> 10) << 3) | 4);
+            sum[1] += (uint64_t)w * ((((bin >> 5) & 31) << 3) | 4);
+            sum[2] += (uint64_t)w * (((bin & 31) << 3) | 4);
+            n += w;
+        }
+        for (int c = 0; c < 3; c++) {
+            enc->palette[i][c] = n ? (uint8_t)(sum[c] / n) : 0;
+        }
+    }
+    enc->palette_size = box_count;
+    memset(enc->lookup, 0xFF, sizeof(enc->lookup));
+    enc->palette_builds++;
+}
+
+// 重复的sixel字符超过3个时用 !N 压缩
+static char* sixel_put_run(char* out, int ch, int count) {
+    if (count > 3) {
+        return out + sprintf(out, "!%d%c", count, ch);
+    }
+    memset(out, ch, count);
+    return out + count;
+}
+
+// 编码一个条带：每种颜色一行sixel，颜色之间用 $ 回到行首；scratch为按颜色排列的6像素位图
+static int sixel_encode_band(SixelEncoder* enc, int band, uint8_t* scratch) {
+    SixelBand* out = &enc->bands[band];
+    int width = enc->width;
+    int y0 = band * 6;
+    int rows = enc->height - y0 < 6 ? enc->height - y0 : 6;
+    const uint8_t* index = &enc->index[(size_t)y0 * width];
+    uint16_t slot_of[SIXEL_MAX_COLORS];  // 0xFFFF表示该颜色尚未分配行；256色时槽位255是有效值
+    int colors[SIXEL_MAX_COLORS], first[SIXEL_MAX_COLORS], last[SIXEL_MAX_COLORS];
+    int count = 0;
+    
+    memset(slot_of, 0xFF, sizeof(slot_of));
+    memset(out->used, 0, sizeof(out->used));
+    for (int r = 0; r < rows; r++) {
+        for (int x = 0; x < width; x++) {
+            int c = index[r * width + x];
+            if (slot_of[c] == 0xFFFF) {
+                slot_of[c] = count;
+                colors[count] = c;
+                first[count] = x;
+                last[count] = x;
+                memset(&scratch[count * width], 0, width);
+                out->used[c >> 3] |= 1 << (c & 7);
+                count++;
+            }
+            int slot = slot_of[c];
+            scratch[slot * width + x] |= 1 << r;
+            if (x < first[slot]) first[slot] = x;
+            if (x > last[slot]) last[slot] = x;
+        }
+    }
+    
+    size_t need = (size_t)count * (width + 8) + 1;
+    if (need > out->capacity) {
+        char* data = realloc(out->data, need);
+        if (!data) {
+            return -1;
+        }
+        out->data = data;
+        out->capacity = need;
+    }
+    
+    char* p = out->data;
+    for (int slot = 0; slot < count; slot++) {
+        const uint8_t* bits = &scratch[slot * width];
+        if (slot > 0) *p++ = '$';
+        p += sprintf(p, "#%d", colors[slot]);
+        p = sixel_put_run(p, '?', first[slot]);
+        
+        int run_char = 63 + bits[first[slot]], run = 1;
+        for (int x = first[slot] + 1; x <= last[slot]; x++) {
+            int ch = 63 + bits[x];
+            if (ch == run_char) {
+                run++;
+            } else {
+                p = sixel_put_run(p, run_char, run);
+                run_char = ch;
+                run = 1;
+            }
+        }
+        p = sixel_put_run(p, run_char, run);
+    }
+    out->len = p - out->data;
+    return 0;
+}
+
+// 领取并编码变化的条带，直到全部领完
+static void sixel_encode_bands(SixelEncoder* enc, uint8_t* scratch) {
+    int band;
+    while ((band = atomic_fetch_add_explicit(&enc->next_band, 1, memory_order_relaxed)) < enc->band_count) {
+        if (enc->dirty[band] && sixel_encode_band(enc, band, scratch) != 0) {
+            atomic_store(&enc->failed, 1);
+        }
+    }
+}
+
+static void* sixel_worker(void* arg) {
+    SixelEncoder* enc = (SixelEncoder*)arg;
+    uint8_t* scratch = malloc((size_t)SIXEL_MAX_COLORS * enc->width);
+    unsigned long seen = 0;
+    
+    for (;;) {
+        pthread_mutex_lock(&enc->lock);
+        while (enc->generation == seen && !enc->stop) {
+            pthread_cond_wait(&enc->cond, &enc->lock);
+        }
+        if (enc->generation == seen) {
+            pthread_mutex_unlock(&enc->lock);
+            break;
+        }
+        seen = enc->generation;
+        pthread_mutex_unlock(&enc->lock);
+        
+        // 没有位图时不领取条带，由其他线程完成
+        if (scratch) {
+            sixel_encode_bands(enc, scratch);
+        }
+        
+        pthread_mutex_lock(&enc->lock);
+        if (--enc->busy == 0) {
+            pthread_cond_signal(&enc->done);
+        }
+        pthread_mutex_unlock(&enc->lock);
+    }
+    
+    free(scratch);
+    return NULL;
+}
+
+SixelEncoder* sixel_encoder_new(int width, int height) {
+    SixelEncoder* enc = calloc(1, sizeof(SixelEncoder));
+    if (!enc) {
+        perror("分配内存失败");
+        return NULL;
+    }
+    
+    size_t pixels = (size_t)width * height;
+    enc->width = width;
+    enc->height = height;
+    enc->band_count = (height + 5) / 6;
+    enc->pixels = malloc(sizeof(TextCell) * pixels);
+    enc->index = malloc(pixels);
+    enc->previous = malloc(pixels);
+    enc->entries = malloc(sizeof(uint32_t) * SIXEL_HIST_SIZE * 2);
+    enc->bands = calloc(enc->band_count, sizeof(SixelBand));
+    enc->dirty = malloc(enc->band_count);
+    enc->scratch = malloc((size_t)SIXEL_MAX_COLORS * width);
+    if (!enc->pixels || !enc->index || !enc->previous || !enc->entries || !enc->bands ||
+        !enc->dirty || !enc->scratch) {
+        perror("分配内存失败");
+        sixel_encoder_free(enc);
+        return NULL;
+    }
+    
+    pthread_mutex_init(&enc->lock, NULL);
+    pthread_cond_init(&enc->cond, NULL);
+    pthread_cond_init(&enc->done, NULL);
+    
+    // 调用线程也参与编码
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus > 1 ? (int)cpus - 1 : 0;
+    if (workers > SIXEL_MAX_WORKERS) workers = SIXEL_MAX_WORKERS;
+    if (workers > enc->band_count - 1) workers = enc->band_count - 1;
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&enc->workers[i], NULL, sixel_worker, enc) != 0) break;
+        enc->worker_count++;
+    }
+    return enc;
+}
+
+void sixel_encoder_free(SixelEncoder* enc) {
+    if (!enc) return;
+    
+    if (enc->worker_count > 0) {
+        pthread_mutex_lock(&enc->lock);
+        enc->stop = 1;
+        pthread_cond_broadcast(&enc->cond);
+        pthread_mutex_unlock(&enc->lock);
+        for (int i = 0; i < enc->worker_count; i++) {
+            pthread_join(enc->workers[i], NULL);
+        }
+    }
+    for (int i = 0; enc->bands && i < enc->band_count; i++) {
+        free(enc->bands[i].data);
+    }
+    free(enc->pixels);
+    free(enc->index);
+    free(enc->previous);
+    free(enc->entries);
+    free(enc->bands);
+    free(enc->dirty);
+    free(enc->scratch);
+    free(enc->output);
+    free(enc);
+}
+
+// 把一帧编码为sixel：采样 → 调色板 (误差明显变大时重建) → 下标图 → 变化条带并行编码 → 拼接。
+// 画面没有变化时*len为0；*output归编码器所有
+int sixel_encode_frame(SixelEncoder* enc, GraphicsBuffer* buf, DisplayConfig* config, char** output, size_t* len) {
+    if (!buf || !buf->buffer || !config) {
+        return -1;
+    }
+    
+    int width = enc->width, height = enc->height;
+    size_t pixels = (size_t)width * height;
+    CellRect rect = { 0, 0, width, height };
+    CellFrame frame = { width, height, enc->pixels };
+    DisplayConfig adjust = *config;
+    adjust.charset = CHARSET_SIMPLE;
+    
+    uint64_t t0 = monotonic_ns();
+    if (decode_grid(buf, config, width, height, rect, enc->pixels, width) != 0) {
+        return -1;
+    }
+    cells_adjust(&adjust, &frame, NULL);
+    
+    memset(enc->histogram, 0, sizeof(enc->histogram));
+    for (size_t i = 0; i < pixels; i++) {
+        enc->histogram[sixel_bin(&enc->pixels[i])]++;
+    }
+    
+    // 画面内容变化较大时重建调色板，颜色定义改变后所有条带都要重发
+    double error = enc->palette_size ? sixel_palette_error(enc) : 0;
+    if (!enc->palette_size || error > enc->palette_error * 1.5 + 4) {
+        sixel_build_palette(enc);
+        enc->palette_error = sixel_palette_error(enc);
+        enc->have_previous = 0;
+    }
+    
+    for (size_t i = 0; i < pixels; i++) {
+        enc->index[i] = sixel_nearest(enc, sixel_bin(&enc->pixels[i]));
+    }
+    
+    int dirty_count = 0;
+    for (int band = 0; band < enc->band_count; band++) {
+        size_t offset = (size_t)band * 6 * width;
+        size_t size = (size_t)(band * 6 + 6 <= height ? 6 : height - band * 6) * width;
+        enc->dirty[band] = !enc->have_previous || memcmp(&enc->index[offset], &enc->previous[offset], size) != 0;
+        dirty_count += enc->dirty[band];
+    }
+    uint64_t t1 = monotonic_ns();
+    histogram_record(&metrics.stages[STAGE_CONVERT], t1 - t0);
+    
+    enc->bands_total += enc->band_count;
+    *output = enc->output;
+    *len = 0;
+    if (dirty_count == 0) {
+        return 0;
+    }
+    enc->bands_sent += dirty_count;
+    
+    // 并行编码变化的条带
+    atomic_store(&enc->next_band, 0);
+    atomic_store(&enc->failed, 0);
+    pthread_mutex_lock(&enc->lock);
+    enc->busy = enc->worker_count;
+    enc->generation++;
+    pthread_cond_broadcast(&enc->cond);
+    pthread_mutex_unlock(&enc->lock);
+    
+    sixel_encode_bands(enc, enc->scratch);
+    
+    pthread_mutex_lock(&enc->lock);
+    while (enc->busy > 0) {
+        pthread_cond_wait(&enc->done, &enc->lock);
+    }
+    pthread_mutex_unlock(&enc->lock);
+    if (atomic_load(&enc->failed)) {
+        return -1;
+    }
+    
+    // 只定义变化条带用到的颜色
+    uint8_t used[SIXEL_MAX_COLORS / 8] = { 0 };
+    size_t need = 64 + (size_t)SIXEL_MAX_COLORS * 24 + enc->band_count;
+    for (int band = 0; band < enc->band_count; band++) {
+        if (!enc->dirty[band]) continue;
+        need += enc->bands[band].len;
+        for (int i = 0; i < SIXEL_MAX_COLORS / 8; i++) used[i] |= enc->bands[band].used[i];
+    }
+    if (need > enc->output_capacity) {
+        char* data = realloc(enc->output, need);
+        if (!data) {
+            perror("分配内存失败");
+            return -1;
+        }
+        enc->output = data;
+        enc->output_capacity = need;
+    }
+    
+    // P2=1：未绘制的像素保持原样，未变化的条带只输出换带符
+    char* p = enc->output;
+    p += sprintf(p, "%s\033[H\033P0;1;0q\"1;1;%d;%d", enc->frames == 0 ? "\033[2J" : "", width, height);
+    for (int c = 0; c < enc->palette_size; c++) {
+        if (!(used[c >> 3] & (1 << (c & 7)))) continue;
+        p += sprintf(p, "#%d;2;%d;%d;%d", c, (enc->palette[c][0] * 100 + 127) / 255,
+                     (enc->palette[c][1] * 100 + 127) / 255, (enc->palette[c][2] * 100 + 127) / 255);
+    }
+    for (int band = 0; band < enc->band_count; band++) {
+        if (band > 0) *p++ = '-';
+        if (enc->dirty[band]) {
+            memcpy(p, enc->bands[band].data, enc->bands[band].len);
+            p += enc->bands[band].len;
+        }
+    }
+    p += sprintf(p, "\033\\");
+    
+    uint8_t* swap = enc->previous;
+    enc->previous = enc->index;
+    enc->index = swap;
+    enc->have_previous = 1;
+    enc->frames++;
+    
+    *output = enc->output;
+    *len = p - enc->output;
+    histogram_record(&metrics.stages[STAGE_ENCODE], monotonic_ns() - t1);
+    histogram_record(&metrics.frame_bytes, *len);
+    return 0;
+}
+
+void status_line_init(StatusLine* status, int row, int width) {
+    memset(status, 0, sizeof(*status));
+    status->row = row;
+    status->width = width < STATUS_LINE_MAX - 32 ? width : STATUS_LINE_MAX - 32;
+    status->last_ns = monotonic_ns();
+}
+
+// 每帧累计变化单元；距上次刷新满1秒时按区间增量重新生成状态文本
+void status_line_update(StatusLine* status, int dirty_cells, int total_cells) {
+    status->dirty_cells += dirty_cells;
+    status->total_cells += total_cells;
+    
+    uint64_t now = monotonic_ns();
+    if (status->len > 0 && now - status->last_ns < 1000000000ULL) {
+        return;
+    }
+    
+    double seconds = (now - status->last_ns) / 1e9;
+    unsigned long frames = atomic_load(&metrics.frames);
+    unsigned long bytes = atomic_load(&metrics.bytes_total);
+    unsigned long dropped = atomic_load(&metrics.frames_dropped);
+    unsigned long delta_frames = frames - status->frames;
+    double stage_ms[STAGE_COUNT];
+    
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        unsigned long count = atomic_load(&metrics.stages[i].total);
+        unsigned long sum = atomic_load(&metrics.stages[i].sum);
+        stage_ms[i] = count > status->stage_count[i] ?
+                      (sum - status->stage_sum[i]) / 1e6 / (count - status->stage_count[i]) : 0;
+        status->stage_count[i] = count;
+        status->stage_sum[i] = sum;
+    }
+    
+    char line[STATUS_LINE_MAX];
+    int n = snprintf(line, sizeof(line),
+                     "%.1ffps snap %.2f conv %.2f enc %.2f wr %.2fms "
+                     "%.1fKB/f %.0fKB/s dirty %.0f%% drop %lu",
+                     seconds > 0 ? delta_frames / seconds : 0,
+                     stage_ms[STAGE_SNAPSHOT], stage_ms[STAGE_CONVERT],
+                     stage_ms[STAGE_ENCODE], stage_ms[STAGE_WRITE],
+                     delta_frames ? (bytes - status->bytes) / 1024.0 / delta_frames : 0,
+                     seconds > 0 ? (bytes - status->bytes) / 1024.0 / seconds : 0,
+                     status->total_cells ? 100.0 * status->dirty_cells / status->total_cells : 0,
+                     dropped - status->dropped);
+    if (n < 0) n = 0;
+    if (n > status->width) n = status->width;
+    
+    // 定位到底行，反色显示，不足宽度补空格
+    status->len = snprintf(status->text, sizeof(status->text), "\033[%d;1H\033[0;7m", status->row);
+    memcpy(status->text + status->len, line, n);
+    status->len += n;
+    while ((int)(status->len) < (int)sizeof(status->text) - 8 && n < status->width) {
+        status->text[status->len++] = ' ';
+        n++;
+    }
+    status->len += sprintf(status->text + status->len, "\033[0m");
+    
+    status->last_ns = now;
+    status->frames = frames;
+    status->bytes = bytes;
+    status->dropped = dropped;
+    status->dirty_cells = 0;
+    status->total_cells = 0;
+}
+
+size_t status_line_append(StatusLine* status, char* out) {
+    memcpy(out, status->text, status->len);
+    out[status->len] = '\0';
+    return status->len;
+}
+
+uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int histogram_bucket(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+// 桶的上界 (含)
+static uint64_t histogram_bucket_limit(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / HIST_SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS) << shift;
+    return base + ((1ULL << shift) - 1);
+}
+
+// 热路径：几次relaxed原子操作，不加锁
+void histogram_record(LatencyHistogram* hist, uint64_t value) {
+    atomic_fetch_add_explicit(&hist->counts[histogram_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum, value, memory_order_relaxed);
+    
+    uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&hist->max, &max, value,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+uint64_t histogram_percentile(LatencyHistogram* hist, double p) {
+    uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+    if (total == 0) return 0;
+    
+    uint64_t rank = (uint64_t)ceil(total * p);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += atomic_load_explicit(&hist->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t limit = histogram_bucket_limit(i);
+            uint64_t max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+            return limit < max ? limit : max;
+        }
+    }
+    return atomic_load_explicit(&hist->max, memory_order_relaxed);
+}
+
+void metrics_dump(FILE* fp) {
+    fprintf(fp, "\n流水线延迟 (微秒):\n");
+    fprintf(fp, "  %-10s %10s %10s %10s %10s %10s\n", "阶段", "次数", "p50", "p99", "p999", "max");
+    
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        LatencyHistogram* hist = &metrics.stages[i];
+        fprintf(fp, "  %-10s %10lu %10.1f %10.1f %10.1f %10.1f\n", stage_names[i],
+                atomic_load(&hist->total),
+                histogram_percentile(hist, 0.50) / 1e3,
+                histogram_percentile(hist, 0.99) / 1e3,
+                histogram_percentile(hist, 0.999) / 1e3,
+                atomic_load(&hist->max) / 1e3);
+    }
+    
+    fprintf(fp, "  %-10s %10s %10lu %10lu %10lu %10lu\n", "字节/帧", "",
+            histogram_percentile(&metrics.frame_bytes, 0.50),
+            histogram_percentile(&metrics.frame_bytes, 0.99),
+            histogram_percentile(&metrics.frame_bytes, 0.999),
+            atomic_load(&metrics.frame_bytes.max));
+    fprintf(fp, "  帧数: %lu  丢帧: %lu  输出字节: %lu\n",
+            atomic_load(&metrics.frames), atomic_load(&metrics.frames_dropped),
+            atomic_load(&metrics.bytes_total));
+    fflush(fp);
+}
+
+// 信号处理中只置标志，由捕获线程输出
+void metrics_signal_handler(int sig) {
+    (void)sig;
+    metrics_dump_requested = 1;
+}
+
+// 在线程内调用，返回登记槽位；槽位用完时返回-1
+int metrics_thread_register(const char* name) {
+    int slot = atomic_fetch_add(&metrics.thread_count, 1);
+    if (slot >= METRICS_MAX_THREADS) {
+        atomic_fetch_sub(&metrics.thread_count, 1);
+        return -1;
+    }
+    
+    MetricsThread* thread = &metrics.threads[slot];
+    snprintf(thread->name, sizeof(thread->name), "%s", name);
+    if (pthread_getcpuclockid(pthread_self(), &thread->clock) != 0) {
+        return -1;
+    }
+    atomic_store_explicit(&thread->active, 1, memory_order_release);
+    return slot;
+}
+
+// 线程退出前调用，之后不再读取它的CPU时钟
+void metrics_thread_unregister(int slot) {
+    if (slot >= 0) {
+        atomic_store_explicit(&metrics.threads[slot].active, 0, memory_order_release);
+    }
+}
+
+void metrics_set_source(int index, const char* device, int width, int height) {
+    if (index < 0 || index >= MAX_BUFFERS) return;
+    
+    MetricsSource* source = &metrics.sources[index];
+    atomic_store(&source->width, 0);
+    snprintf(source->device, sizeof(source->device), "%.*s", (int)sizeof(source->device) - 1, device);
+    atomic_store(&source->height, height);
+    atomic_store_explicit(&source->width, width, memory_order_release);
+}
+
+// 小于2^bit的值都落在该下标之前的桶中 (bit >= HIST_SUB_BITS)
+static int prometheus_bucket_end(int bit) {
+    return (bit - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS;
+}
+
+// 只在2的幂边界输出累计桶，与直方图子桶边界对齐；
+// Prometheus的le是含上界，所以标注2^bit-1而不是2^bit
+static void prometheus_histogram(FILE* fp, const char* name, const char* labels,
+                                 LatencyHistogram* hist, double scale,
+                                 int low_bit, int high_bit) {
+    uint64_t cumulative = 0;
+    int bucket = 0;
+    
+    for (int bit = low_bit; bit <= high_bit; bit++) {
+        int limit = prometheus_bucket_end(bit);
+        while (bucket < limit) {
+            cumulative += atomic_load_explicit(&hist->counts[bucket++], memory_order_relaxed);
+        }
+        fprintf(fp, "%s_bucket{%s%sle=\"%.12g\"} %lu\n", name, labels, labels[0] ? "," : "",
+                (double)((1ULL << bit) - 1) * scale, cumulative);
+    }
+    
+    uint64_t total = atomic_load_explicit(&hist->total, memory_order_relaxed);
+    fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, labels[0] ? "," : "", total);
+    fprintf(fp, "%s_sum{%s} %.9g\n", name, labels,
+            atomic_load_explicit(&hist->sum, memory_order_relaxed) * scale);
+    fprintf(fp, "%s_count{%s} %lu\n", name, labels, total);
+}
+
+// 检查桶边界与le标注一致：2^bit-1计入le="2^bit-1"，2^bit不计入；
+// 再固定一个边界值 (1023/1024) 的实际输出。成功返回0
+int metrics_self_check() {
+    for (int bit = HIST_SUB_BITS; bit < 64; bit++) {
+        uint64_t edge = 1ULL << bit;
+        if (histogram_bucket(edge - 1) >= prometheus_bucket_end(bit) ||
+            histogram_bucket(edge) < prometheus_bucket_end(bit)) {
+            fprintf(stderr, "直方图桶边界错误: 2^%d\n", bit);
+            return -1;
+        }
+    }
+    
+    LatencyHistogram* hist = calloc(1, sizeof(LatencyHistogram));
+    char* text = NULL;
+    size_t len = 0;
+    FILE* fp = open_memstream(&text, &len);
+    if (!hist || !fp) {
+        free(hist);
+        if (fp) fclose(fp);
+        free(text);
+        return -1;
+    }
+    histogram_record(hist, 1023);
+    histogram_record(hist, 1024);
+    prometheus_histogram(fp, "check", "", hist, 1, 10, 10);
+    fclose(fp);
+    
+    const char* expected = "check_bucket{le=\"1023\"} 1\n";
+    int ok = len >= strlen(expected) && strncmp(text, expected, strlen(expected)) == 0;
+    if (!ok) {
+        fprintf(stderr, "Prometheus直方图输出错误:\n%s", text);
+    }
+    free(text);
+    free(hist);
+    return ok ? 0 : -1;
+}
+
+static double timespec_seconds(const struct timespec* ts) {
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+void metrics_write_prometheus(FILE* fp) {
+    fprintf(fp, "# HELP graphics_commander_frames_total Frames captured and converted.\n");
+    fprintf(fp, "# TYPE graphics_commander_frames_total counter\n");
+    fprintf(fp, "graphics_commander_frames_total %lu\n", atomic_load(&metrics.frames));
+    fprintf(fp, "# HELP graphics_commander_frames_dropped_total Frame ticks missed by the pacer.\n");
+    fprintf(fp, "# TYPE graphics_commander_frames_dropped_total counter\n");
+    fprintf(fp, "graphics_commander_frames_dropped_total %lu\n", atomic_load(&metrics.frames_dropped));
+    fprintf(fp, "# HELP graphics_commander_output_bytes_total Bytes written to the terminal.\n");
+    fprintf(fp, "# TYPE graphics_commander_output_bytes_total counter\n");
+    fprintf(fp, "graphics_commander_output_bytes_total %lu\n", atomic_load(&metrics.bytes_total));
+    
+    fprintf(fp, "# HELP graphics_commander_stage_seconds Per-frame latency of each pipeline stage.\n");
+    fprintf(fp, "# TYPE graphics_commander_stage_seconds histogram\n");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        char labels[32];
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[i]);
+        // 1us ~ 17s
+        prometheus_histogram(fp, "graphics_commander_stage_seconds", labels,
+                             &metrics.stages[i], 1e-9, 10, 34);
+    }
+    
+    fprintf(fp, "# HELP graphics_commander_frame_bytes Output size of each frame.\n");
+    fprintf(fp, "# TYPE graphics_commander_frame_bytes histogram\n");
+    prometheus_histogram(fp, "graphics_commander_frame_bytes", "", &metrics.frame_bytes, 1, 6, 26);
+    
+    fprintf(fp, "# HELP graphics_commander_source_width Source resolution in pixels.\n");
+    fprintf(fp, "# TYPE graphics_commander_source_width gauge\n");
+    fprintf(fp, "# HELP graphics_commander_source_height Source resolution in pixels.\n");
+    fprintf(fp, "# TYPE graphics_commander_source_height gauge\n");
+    for (int i = 0; i < MAX_BUFFERS; i++) {
+        MetricsSource* source = &metrics.sources[i];
+        int width = atomic_load_explicit(&source->width, memory_order_acquire);
+        if (width <= 0) continue;
+        fprintf(fp, "graphics_commander_source_width{source=\"%s\"} %d\n", source->device, width);
+        fprintf(fp, "graphics_commander_source_height{source=\"%s\"} %d\n", source->device,
+                atomic_load(&source->height));
+    }
+    
+    fprintf(fp, "# HELP graphics_commander_thread_cpu_seconds_total CPU time by thread.\n");
+    fprintf(fp, "# TYPE graphics_commander_thread_cpu_seconds_total counter\n");
+    int count = atomic_load(&metrics.thread_count);
+    if (count > METRICS_MAX_THREADS) count = METRICS_MAX_THREADS;
+    for (int i = 0; i < count; i++) {
+        MetricsThread* thread = &metrics.threads[i];
+        struct timespec ts;
+        if (!atomic_load_explicit(&thread->active, memory_order_acquire) ||
+            clock_gettime(thread->clock, &ts) != 0) {
+            continue;
+        }
+        fprintf(fp, "graphics_commander_thread_cpu_seconds_total{thread=\"%s\"} %.6f\n",
+                thread->name, timespec_seconds(&ts));
+    }
+    
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    fprintf(fp, "# HELP graphics_commander_process_cpu_seconds_total CPU time of the whole process.\n");
+    fprintf(fp, "# TYPE graphics_commander_process_cpu_seconds_total counter\n");
+    fprintf(fp, "graphics_commander_process_cpu_seconds_total %.6f\n", timespec_seconds(&ts));
+}
+
+// 读掉请求头后返回一份完整的HTTP/1.0响应，然后关闭连接
+static void metrics_serve_client(int fd) {
+    struct timeval tv = {1, 0};
+    char request[2048];
+    size_t used = 0;
+    
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (used < sizeof(request) - 1) {
+        ssize_t n = read(fd, request + used, sizeof(request) - 1 - used);
+        if (n <= 0) break;
+        used += n;
+        request[used] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) break;
+    }
+    
+    char* body = NULL;
+    size_t body_len = 0;
+    FILE* fp = open_memstream(&body, &body_len);
+    if (!fp) return;
+    metrics_write_prometheus(fp);
+    fclose(fp);
+    
+    char header[160];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n\r\n", body_len);
+    write_all(fd, header, header_len);
+    write_all(fd, body, body_len);
+    free(body);
+}
+
+static void* metrics_server_thread(void* arg) {
+    MetricsServer* server = (MetricsServer*)arg;
+    struct sched_param param = {0};
+    
+    // 空闲调度，不与捕获和转换线程争抢CPU
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0 && app.verbose) {
+        fprintf(stderr, "无法降低指标线程优先级\n");
+    }
+    int slot = metrics_thread_register("metrics");
+    
+    while (server->running) {
+        struct pollfd pfd = { server->listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+        
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        metrics_serve_client(fd);
+        close(fd);
+    }
+    
+    metrics_thread_unregister(slot);
+    return NULL;
+}
+
+// addr: "unix:/path/to/socket" 或端口号 (只监听127.0.0.1)
+MetricsServer* metrics_server_start(const char* addr) {
+    MetricsServer* server = calloc(1, sizeof(MetricsServer));
+    if (!server) {
+        perror("分配内存失败");
+        return NULL;
+    }
+    
+    if (strncmp(addr, "unix:", 5) == 0) {
+        struct sockaddr_un sun = { .sun_family = AF_UNIX };
+        if (strlen(addr + 5) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "套接字路径过长: %s\n", addr + 5);
+            free(server);
+            return NULL;
+        }
+        strcpy(sun.sun_path, addr + 5);
+        strcpy(server->unix_path, addr + 5);
+        
+        server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        unlink(sun.sun_path);
+        if (server->listen_fd < 0 ||
+            bind(server->listen_fd, (struct sockaddr*)&sun, sizeof(sun)) < 0) {
+            perror("无法绑定指标套接字");
+            goto fail;
+        }
+    } else {
+        int port = atoi(addr);
+        if (port <= 0 || port > 65535) {
+            fprintf(stderr, "无效的指标地址: %s\n", addr);
+            free(server);
+            return NULL;
+        }
+        
+        struct sockaddr_in sin = { .sin_family = AF_INET, .sin_port = htons(port) };
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int one = 1;
+        
+        server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (server->listen_fd >= 0) {
+            setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        if (server->listen_fd < 0 ||
+            bind(server->listen_fd, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+            perror("无法绑定指标端口");
+            goto fail;
+        }
+    }
+    
+    if (listen(server->listen_fd, 8) < 0) {
+        perror("无法监听指标端口");
+        goto fail;
+    }
+    
+    server->running = 1;
+    if (pthread_create(&server->thread, NULL, metrics_server_thread, server) != 0) {
+        perror("无法创建指标线程");
+        goto fail;
+    }
+    
+    if (app.verbose) {
+        printf("指标服务: %s\n", addr);
+    }
+    return server;
+    
+fail:
+    if (server->listen_fd >= 0) close(server->listen_fd);
+    if (server->unix_path[0]) unlink(server->unix_path);
+    free(server);
+    return NULL;
+}
+
+void metrics_server_stop(MetricsServer* server) {
+    if (!server) return;
+    
+    server->running = 0;
+    pthread_join(server->thread, NULL);
+    close(server->listen_fd);
+    if (server->unix_path[0]) {
+        unlink(server->unix_path);
+    }
+    free(server);
+}
+
+void frame_pacer_init(FramePacer* pacer, int fps) {
+    pacer->interval_ns = fps > 0 ? 1000000000ULL / fps : 0;
+    pacer->next_ns = 0;
+}
+
+// 推进到下一帧时刻；处理超时时跳过已错过的时刻并返回错过的帧数
+long frame_pacer_advance(FramePacer* pacer) {
+    if (pacer->interval_ns == 0) return 0;
+    
+    uint64_t now = monotonic_ns();
+    long missed = 0;
+    
+    if (pacer->next_ns == 0) pacer->next_ns = now;
+    pacer->next_ns += pacer->interval_ns;
+    
+    if (now >= pacer->next_ns) {
+        missed = (long)((now - pacer->next_ns) / pacer->interval_ns) + 1;
+        pacer->next_ns += missed * pacer->interval_ns;
+    }
+    return missed;
+}
+
+// 睡到下一帧时刻
+long frame_pacer_wait(FramePacer* pacer) {
+    if (pacer->interval_ns == 0) return 0;
+    
+    long missed = frame_pacer_advance(pacer);
+    struct timespec deadline = {
+        .tv_sec = pacer->next_ns / 1000000000ULL,
+        .tv_nsec = pacer->next_ns % 1000000000ULL
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+    
+    return missed;
+}
+
+// JSON字符串转义，UTF-8字节原样保留
+static void asciicast_write_escaped(FILE* fp, const char* data, size_t len) {
+    const char* start = data;
+    const char* end = data + len;
+    
+    for (const char* p = data; p < end; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c >= 0x20 && c != '"' && c != '\\' && c != 0x7F) continue;
+        
+        fwrite(start, 1, p - start, fp);
+        switch (c) {
+            case '"':  fputs("\\\"", fp); break;
+            case '\\': fputs("\\\\", fp); break;
+            case '\n': fputs("\\n", fp); break;
+            case '\r': fputs("\\r", fp); break;
+            case '\t': fputs("\\t", fp); break;
+            default:   fprintf(fp, "\\u%04x", c); break;
+        }
+        start = p + 1;
+    }
+    fwrite(start, 1, end - start, fp);
+}
+
+static void* asciicast_thread_func(void* arg) {
+    AsciicastWriter* cast = (AsciicastWriter*)arg;
+    int metrics_slot = metrics_thread_register("asciicast");
+    
+    pthread_mutex_lock(&cast->lock);
+    for (;;) {
+        while (cast->tail == cast->head && !cast->stop) {
+            pthread_cond_wait(&cast->cond, &cast->lock);
+        }
+        if (cast->tail == cast->head) break;
+        
+        AsciicastEvent event = cast->queue[cast->tail % cast->capacity];
+        cast->tail++;
+        pthread_mutex_unlock(&cast->lock);
+        
+        fprintf(cast->fp, "[%.6f, \"o\", \"", event.time_us / 1e6);
+        if (event.prefix) {
+            asciicast_write_escaped(cast->fp, event.prefix, strlen(event.prefix));
+        }
+        asciicast_write_escaped(cast->fp, event.data, event.len);
+        fputs("\"]\n", cast->fp);
+        free(event.data);
+        
+        pthread_mutex_lock(&cast->lock);
+        cast->events_written++;
+    }
+    pthread_mutex_unlock(&cast->lock);
+    
+    metrics_thread_unregister(metrics_slot);
+    return NULL;
+}
+
+AsciicastWriter* asciicast_start(const char* path, int width, int height) {
+    AsciicastWriter* cast = calloc(1, sizeof(AsciicastWriter));
+    if (!cast) {
+        perror("分配内存失败");
+        return NULL;
+    }
+    
+    cast->capacity = ASCIICAST_QUEUE_DEPTH;
+    cast->queue = malloc(cast->capacity * sizeof(AsciicastEvent));
+    cast->fp = cast->queue ? fopen(path, "w") : NULL;
+    if (!cast->fp) {
+        perror("创建asciicast文件失败");
+        free(cast->queue);
+        free(cast);
+        return NULL;
+    }
+    
+    const char* term = getenv("TERM");
+    fprintf(cast->fp, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %ld, "
+            "\"env\": {\"TERM\": \"", width, height, (long)time(NULL));
+    asciicast_write_escaped(cast->fp, term ? term : "xterm-256color",
+                            strlen(term ? term : "xterm-256color"));
+    fputs("\"}}\n", cast->fp);
+    
+    pthread_mutex_init(&cast->lock, NULL);
+    pthread_cond_init(&cast->cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &cast->start);
+    pthread_create(&cast->thread, NULL, asciicast_thread_func, cast);
+    
+    return cast;
+}
+
+// 队列满时加倍容量；head/tail是递增计数，按新容量重新取模放置未写出的事件
+static int asciicast_grow(AsciicastWriter* cast) {
+    unsigned long capacity = cast->capacity * 2;
+    AsciicastEvent* queue = malloc(capacity * sizeof(AsciicastEvent));
+    if (!queue) return -1;
+    
+    for (unsigned long i = cast->tail; i != cast->head; i++) {
+        queue[i % capacity] = cast->queue[i % cast->capacity];
+    }
+    free(cast->queue);
+    cast->queue = queue;
+    cast->capacity = capacity;
+    return 0;
+}
+
+// 渲染线程调用：data必须是刚写到终端的缓冲区，所有权转移给写盘线程
+// 拼接、视口和差分输出都是局部更新，不能丢帧；写盘也不能拖慢显示，
+// 所以队列满时扩容，扩容失败时把本帧并入队尾的事件
+void asciicast_submit(AsciicastWriter* cast, const char* prefix, char* data, size_t len) {
+    uint64_t now = elapsed_us(&cast->start);
+    
+    pthread_mutex_lock(&cast->lock);
+    if (cast->head - cast->tail >= cast->capacity && asciicast_grow(cast) != 0) {
+        AsciicastEvent* last = &cast->queue[(cast->head - 1) % cast->capacity];
+        size_t prefix_len = prefix ? strlen(prefix) : 0;
+        char* merged = realloc(last->data, last->len + prefix_len + len);
+        if (merged) {
+            if (prefix_len) memcpy(merged + last->len, prefix, prefix_len);
+            memcpy(merged + last->len + prefix_len, data, len);
+            last->data = merged;
+            last->len += prefix_len + len;
+            cast->events_merged++;
+        }
+        pthread_mutex_unlock(&cast->lock);
+        free(data);
+        return;
+    }
+    
+    AsciicastEvent* event = &cast->queue[cast->head % cast->capacity];
+    event->prefix = prefix;
+    event->data = data;
+    event->len = len;
+    event->time_us = now;
+    cast->head++;
+    pthread_cond_signal(&cast->cond);
+    pthread_mutex_unlock(&cast->lock);
+}
+
+void asciicast_stop(AsciicastWriter* cast) {
+    if (!cast) return;
+    
+    pthread_mutex_lock(&cast->lock);
+    cast->stop = 1;
+    pthread_cond_signal(&cast->cond);
+    pthread_mutex_unlock(&cast->lock);
+    pthread_join(cast->thread, NULL);
+    fclose(cast->fp);
+    
+    if (app.verbose) {
+        printf("  asciicast事件: %ld (合并 %ld，队列容量 %lu)\n", cast->events_written,
+               cast->events_merged, cast->capacity);
+    }
+    
+    pthread_mutex_destroy(&cast->lock);
+    pthread_cond_destroy(&cast->cond);
+    free(cast->queue);
+    free(cast);
+}
+
+void display_text(char* text, int width, int height) {
+    if (!text) return;
+    
+    // 清屏前缀与文本（含状态行）合并为一次写入
+    size_t len = strlen(text);
+    struct iovec iov[2] = {
+        { FRAME_PREFIX, sizeof(FRAME_PREFIX) - 1 },
+        { text, len }
+    };
+    fflush(stdout);
+    ssize_t n = writev(STDOUT_FILENO, iov, 2);
+    if (n < 0) {
+        if (errno != EINTR) return;
+        n = 0;
+    }
+    
+    // 部分写入时补写剩余内容
+    if ((size_t)n < iov[0].iov_len) {
+        write_all(STDOUT_FILENO, FRAME_PREFIX + n, iov[0].iov_len - n);
+        n = iov[0].iov_len;
+    }
+    n -= iov[0].iov_len;
+    if ((size_t)n < len) {
+        write_all(STDOUT_FILENO, text + n, len - n);
+    }
+}
+
+void* capture_thread_func(void* arg) {
+    DisplayConfig* config = (DisplayConfig*)arg;
+    GraphicsBuffer* buf = NULL;
+    char* output = NULL;
+    FrameRecorder* recorder = NULL;
+    AsciicastWriter* cast = NULL;
+    FrameConverter conv = {0};
+    SixelEncoder* sixel = NULL;
+    StatusLine status;
+    DisplayConfig frame_config = *config;
+    FramePacer pacer;
+    struct timespec start, end;
+    long frame_count = 0;
+    
+    // 状态行占用底部一行
+    if (app.status_line && !app.sixel && frame_config.output_height > 1) {
+        frame_config.output_height--;
+        status_line_init(&status, config->output_height, config->output_width);
+    }
+    
+    // 打开捕获设备
+    buf = open_source(app.device);
+    if (!buf) {
+        fprintf(stderr, "无法打开捕获设备: %s\n", app.device);
+        return NULL;
+    }
+    
+    if (app.verbose) {
+        printf("开始捕获，%s，分辨率: %dx%d (", buf->source->name, buf->width, buf->height);
+        print_capture_caps(buf->caps);
+        printf(")\n");
+    }
+    if (app.sixel) {
+        // 图像比终端少一行，光标停在最后一行，不会引起滚屏
+        int rows = config->output_height > 1 ? config->output_height - 1 : 1;
+        sixel = sixel_encoder_new(config->output_width * SIXEL_CELL_WIDTH, rows * SIXEL_CELL_HEIGHT);
+        if (!sixel) {
+            close_source(buf);
+            return NULL;
+        }
+        if (app.verbose) {
+            printf("Sixel输出: %dx%d 像素，%d 个编码线程\n", sixel->width, sixel->height, sixel->worker_count + 1);
+        }
+    }
+    int metrics_slot = metrics_thread_register("capture");
+    metrics_set_source(0, app.device, buf->width, buf->height);
+    
+    if (app.record_path[0]) {
+        recorder = recorder_start(app.record_path, buf);
+    }
+    if (app.asciicast_path[0]) {
+        cast = asciicast_start(app.asciicast_path, config->output_width, config->output_height);
+    }
+    
+    // 最大速度回放时不限速
+    frame_pacer_init(&pacer, (buf->caps & CAPTURE_CAP_TIMED) && app.replay_speed <= 0 ? 0 : config->fps);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    while (app.running) {
+        uint64_t t0 = monotonic_ns();
+        if (source_next_frame(buf) < 0) {
+            break;
+        }
+        if (recorder) {
+            recorder_submit(recorder, buf);
+        }
+        histogram_record(&metrics.stages[STAGE_SNAPSHOT], monotonic_ns() - t0);
+        
+        // 事件驱动的源在静止时已在源内阻塞等待，没有变化就不转换也不输出，
+        // 并重新对齐帧时刻，下一次变化到达后立即处理
+        size_t len;
+        int idle = (buf->caps & CAPTURE_CAP_EVENTS) && buf->damage_count == 0 &&
+                   (sixel ? sixel->have_previous : conv.have_previous);
+        if (idle) {
+            pacer.next_ns = 0;
+        } else if (sixel) {
+            // 编码器持有输出缓冲区；没有变化的条带时不输出
+            if (sixel_encode_frame(sixel, buf, &frame_config, &output, &len) == 0 && len > 0) {
+                uint64_t t1 = monotonic_ns();
+                write_all(STDOUT_FILENO, output, len);
+                histogram_record(&metrics.stages[STAGE_WRITE], monotonic_ns() - t1);
+                atomic_fetch_add_explicit(&metrics.bytes_total, len, memory_order_relaxed);
+                
+                // 输出缓冲区归编码器所有，录制时交给写盘线程一份副本
+                char* copy = cast ? malloc(len) : NULL;
+                if (copy) {
+                    memcpy(copy, output, len);
+                    asciicast_submit(cast, NULL, copy, len);
+                }
+            }
+        } else if (converter_convert(&conv, buf, &frame_config) == 0) {
+            // 有上一帧时只重新编码变化的字符单元，否则清屏输出完整帧
+            int delta = conv.previous_valid &&
+                        converter_encode_delta(&conv, &frame_config, &output, &len) == 0;
+            if (delta || converter_encode(&conv, &frame_config, &output, &len) == 0) {
+                if (frame_config.output_height != config->output_height) {
+                    status_line_update(&status, conv.dirty_cells,
+                                       frame_config.output_width * frame_config.output_height);
+                    len += status_line_append(&status, output + len);
+                }
+                
+                // 显示文本
+                uint64_t t1 = monotonic_ns();
+                if (delta) {
+                    write_all(STDOUT_FILENO, output, len);
+                } else {
+                    display_text(output, config->output_width, config->output_height);
+                }
+                histogram_record(&metrics.stages[STAGE_WRITE], monotonic_ns() - t1);
+                atomic_fetch_add_explicit(&metrics.bytes_total, len, memory_order_relaxed);
+                
+                if (cast) {
+                    asciicast_submit(cast, delta ? NULL : FRAME_PREFIX, output, len);
+                } else {
+                    free(output);
+                }
+            }
+        }
+        source_release_frame(buf);
+        
+        if (!idle) {
+            frame_count++;
+            atomic_fetch_add_explicit(&metrics.frames, 1, memory_order_relaxed);
+        }
+        
+        if (metrics_dump_requested) {
+            metrics_dump_requested = 0;
+            metrics_dump(stderr);
+        }
+        
+        // 控制帧率
+        if (!idle) {
+            atomic_fetch_add_explicit(&metrics.frames_dropped, frame_pacer_wait(&pacer),
+                                      memory_order_relaxed);
+        }
+        
+        // 检查按键
+        struct timeval tv = {0, 0};
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(STDIN_FILENO, &fds);
+        
+        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0) {
+            char ch;
+            read(STDIN_FILENO, &ch, 1);
+            if (ch == 'q' || ch == 'Q' || ch == 27) { // ESC键
+                app.running = 0;
+                break;
+            }
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    // 计算统计信息
+    double elapsed = (end.tv_sec - start.tv_sec) + 
+                    (end.tv_nsec - start.tv_nsec) / 1e9;
+    double fps = frame_count / elapsed;
+    
+    if (app.verbose) {
+        printf("\n捕获统计:\n");
+        printf("  总帧数: %ld\n", frame_count);
+        printf("  总时间: %.2f秒\n", elapsed);
+        printf("  平均帧率: %.2f FPS\n", fps);
+        if (sixel) {
+            printf("  Sixel: 调色板生成 %ld 次，发送条带 %ld/%ld\n",
+                   sixel->palette_builds, sixel->bands_sent, sixel->bands_total);
+        }
+    }
+    
+    recorder_stop(recorder);
+    asciicast_stop(cast);
+    converter_free(&conv);
+    sixel_encoder_free(sixel);
+    metrics_thread_unregister(metrics_slot);
+    metrics_dump(stderr);
+    close_source(buf);
+    return NULL;
+}
+
+int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 解析 --source 参数: DEVICE[@WIDTHxHEIGHT]
+int parse_source_spec(const char* spec) {
+    if (app.buffer_count >= MAX_BUFFERS) {
+        fprintf(stderr, "最多支持 %d 个源\n", MAX_BUFFERS);
+        return -1;
+    }
+    
+    int index = app.buffer_count;
+    GraphicsBuffer* buf = &app.buffers[index];
+    const char* at = strrchr(spec, '@');
+    size_t len = at ? (size_t)(at - spec) : strlen(spec);
+    
+    if (len == 0 || len >= sizeof(buf->device)) {
+        fprintf(stderr, "无效的源: %s\n", spec);
+        return -1;
+    }
+    
+    memcpy(buf->device, spec, len);
+    buf->device[len] = '\0';
+    buf->fd = -1;
+    app.tile_width[index] = 0;
+    app.tile_height[index] = 0;
+    
+    if (at && sscanf(at + 1, "%dx%d", &app.tile_width[index], &app.tile_height[index]) != 2) {
+        fprintf(stderr, "无效的图块尺寸: %s\n", at + 1);
+        return -1;
+    }
+    
+    app.buffer_count++;
+    return 0;
+}
+
+static int lookup_name(const char* name, const char* const* names, int count) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+// 解析 --viewport 参数: [X,Y,W,H|full][@COLSxROWS][:CHARSET[:COLOR]]
+int parse_viewport_spec(const char* spec) {
+    if (app.viewport_count >= MAX_DISPLAYS) {
+        fprintf(stderr, "最多支持 %d 个视口\n", MAX_DISPLAYS);
+        return -1;
+    }
+    
+    ViewportSpec* view = &app.viewports[app.viewport_count];
+    char text[128];
+    snprintf(text, sizeof(text), "%s", spec);
+    memset(view, 0, sizeof(*view));
+    view->charset = -1;
+    view->color_mode = -1;
+    
+    char* charset = strchr(text, ':');
+    char* color = NULL;
+    if (charset) {
+        *charset++ = '\0';
+        color = strchr(charset, ':');
+        if (color) *color++ = '\0';
+    }
+    char* size = strchr(text, '@');
+    if (size) *size++ = '\0';
+    
+    if (text[0] && strcmp(text, "full") != 0 &&
+        (sscanf(text, "%d,%d,%d,%d", &view->region_x, &view->region_y, &view->region_w, &view->region_h) != 4 ||
+         view->region_x < 0 || view->region_y < 0 || view->region_w <= 0 || view->region_h <= 0)) {
+        fprintf(stderr, "无效的视口区域: %s\n", text);
+        return -1;
+    }
+    if (size && (sscanf(size, "%dx%d", &view->out_width, &view->out_height) != 2 ||
+                 view->out_width <= 0 || view->out_height <= 0)) {
+        fprintf(stderr, "无效的视口尺寸: %s\n", size);
+        return -1;
+    }
+    if (charset && charset[0] &&
+        (view->charset = lookup_name(charset, charset_names, sizeof(charset_names) / sizeof(charset_names[0]))) < 0) {
+        fprintf(stderr, "未知的字符集: %s\n", charset);
+        return -1;
+    }
+    if (color && color[0] &&
+        (view->color_mode = lookup_name(color, color_mode_names,
+                                        sizeof(color_mode_names) / sizeof(color_mode_names[0]))) < 0) {
+        fprintf(stderr, "未知的颜色模式: %s\n", color);
+        return -1;
+    }
+    
+    app.viewport_count++;
+    return 0;
+}
+
+#define NAME_COUNT(names) ((int)(sizeof(names) / sizeof(names[0])))
+
+// 配置项数值：整个值必须是[min, max]内的数，否则返回-1且不修改*out
+static int config_int(const char* value, int min, int max, int* out) {
+    char* end;
+    errno = 0;
+    long v = strtol(value, &end, 10);
+    if (errno || end == value || *end || v < min || v > max) {
+        return -1;
+    }
+    *out = (int)v;
+    return 0;
+}
+
+static int config_float(const char* value, float min, float max, float* out) {
+    char* end;
+    float v = strtof(value, &end);
+    if (end == value || *end || !(v >= min && v <= max)) {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+// 读取INI格式的配置文件 (见 Graphics Commander.conf)；命令行参数在其后生效
+int load_config_file(const char* path) {
+    static const char* server_names[] = {"fb", "x11", "wayland", "vnc", "rdp"};
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        perror("打开配置文件失败");
+        return -1;
+    }
+    
+    char line[512];
+    char section[32] = "";
+    int lineno = 0;
+    int errors = 0;
+    
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char* p = line + strspn(line, " \t");
+        p[strcspn(p, "\r\n")] = '\0';
+        if (*p == '\0' || *p == '#' || *p == ';') {
+            continue;
+        }
+        if (*p == '[') {
+            char* end = strchr(p, ']');
+            if (end) *end = '\0';
+            snprintf(section, sizeof(section), "%s", p + 1);
+            continue;
+        }
+        
+        char* eq = strchr(p, '=');
+        if (!eq) {
+            fprintf(stderr, "%s:%d: 缺少 '='\n", path, lineno);
+            errors++;
+            continue;
+        }
+        char* key = p;
+        char* value = eq + 1;
+        for (char* k = eq; k > key && (k[-1] == ' ' || k[-1] == '\t'); k--) k[-1] = '\0';
+        *eq = '\0';
+        value += strspn(value, " \t");
+        for (char* v = value + strlen(value); v > value && (v[-1] == ' ' || v[-1] == '\t'); v--) v[-1] = '\0';
+        
+        int index = 0;
+        if (strcmp(section, "display") == 0) {
+            if (strcmp(key, "width") == 0) index = config_int(value, 1, 4096, &app.display.output_width);
+            else if (strcmp(key, "height") == 0) index = config_int(value, 1, 4096, &app.display.output_height);
+            else if (strcmp(key, "brightness") == 0) index = config_float(value, 0.0f, 10.0f, &app.display.brightness);
+            else if (strcmp(key, "contrast") == 0) index = config_float(value, 0.0f, 10.0f, &app.display.contrast);
+            else if (strcmp(key, "fps") == 0) index = config_int(value, 1, 1000, &app.display.fps);
+            else if (strcmp(key, "region_x") == 0) index = config_int(value, 0, INT_MAX, &app.display.region_x);
+            else if (strcmp(key, "region_y") == 0) index = config_int(value, 0, INT_MAX, &app.display.region_y);
+            else if (strcmp(key, "region_width") == 0) index = config_int(value, 0, INT_MAX, &app.display.region_w);
+            else if (strcmp(key, "region_height") == 0) index = config_int(value, 0, INT_MAX, &app.display.region_h);
+            else if (strcmp(key, "color_mode") == 0) {
+                index = lookup_name(value, color_mode_names, NAME_COUNT(color_mode_names));
+                if (index >= 0) app.display.color_mode = (ColorMode)index;
+            }
+            else if (strcmp(key, "charset") == 0) {
+                index = lookup_name(value, charset_names, NAME_COUNT(charset_names));
+                if (index >= 0) app.display.charset = (CharsetMode)index;
+            }
+            else if (strcmp(key, "sampling") == 0) {
+                index = lookup_name(value, sampling_names, NAME_COUNT(sampling_names));
+                if (index >= 0) app.display.sampling = (SamplingMode)index;
+            }
+            else index = -2;
+        } else if (strcmp(section, "server") == 0) {
+            if (strcmp(key, "display") == 0) snprintf(app.server.display, sizeof(app.server.display), "%s", value);
+            else if (strcmp(key, "host") == 0) snprintf(app.server.host, sizeof(app.server.host), "%s", value);
+            else if (strcmp(key, "port") == 0) index = config_int(value, 1, 65535, &app.server.port);
+            else if (strcmp(key, "username") == 0) snprintf(app.server.username, sizeof(app.server.username), "%s", value);
+            else if (strcmp(key, "password") == 0) snprintf(app.server.password, sizeof(app.server.password), "%s", value);
+            else if (strcmp(key, "use_ssh") == 0) index = config_int(value, 0, 1, &app.server.use_ssh);
+            else if (strcmp(key, "type") == 0) {
+                index = lookup_name(value, server_names, NAME_COUNT(server_names));
+                if (index >= 0) app.server.type = (ServerType)index;
+            }
+            else index = -2;
+        } else if (strcmp(section, "general") == 0) {
+            if (strcmp(key, "verbose") == 0) index = config_int(value, 0, 1, &app.verbose);
+            else if (strcmp(key, "benchmark") == 0) index = config_int(value, 0, 1, &app.benchmark);
+            else if (strcmp(key, "continuous") == 0) index = config_int(value, 0, 1, &app.display.continuous);
+            else index = -2;
+        } else {
+            index = -2;
+        }
+        
+        if (index == -1) {
+            fprintf(stderr, "%s:%d: %s 的值无效: %s\n", path, lineno, key, value);
+            errors++;
+        } else if (index == -2) {
+            fprintf(stderr, "%s:%d: 未知的设置 [%s] %s\n", path, lineno, section, key);
+            errors++;
+        }
+    }
+    
+    fclose(fp);
+    return errors ? -1 : 0;
+}
+
+// 计算各图块在终端中的位置，图块之间留一列/一行间隔；widths/heights为0的图块自动分配
+void mosaic_layout(DisplayConfig* config, int count, const int* widths, const int* heights) {
+    int columns = app.mosaic_columns;
+    if (columns <= 0) {
+        columns = (int)ceil(sqrt(count));
+    }
+    if (columns > count) columns = count;
+    int rows = (count + columns - 1) / columns;
+    
+    // 未指定尺寸的图块平分总输出区域
+    int auto_w = (config->output_width - (columns - 1)) / columns;
+    int auto_h = (config->output_height - (rows - 1)) / rows;
+    if (auto_w < 1) auto_w = 1;
+    if (auto_h < 1) auto_h = 1;
+    
+    mosaic.tile_count = count;
+    mosaic.total_width = 0;
+    mosaic.total_height = 0;
+    mosaic.config = config;
+    
+    int y = 1;
+    for (int r = 0; r < rows; r++) {
+        int x = 1;
+        int row_height = 0;
+        
+        for (int c = 0; c < columns; c++) {
+            int i = r * columns + c;
+            if (i >= count) break;
+            
+            MosaicTile* tile = &mosaic.tiles[i];
+            tile->index = i;
+            tile->out_width = widths[i] > 0 ? widths[i] : auto_w;
+            tile->out_height = heights[i] > 0 ? heights[i] : auto_h;
+            tile->col = x;
+            tile->row = y;
+            tile->text = NULL;
+            tile->seq = 0;
+            tile->failed = 0;
+            tile->config = *config;
+            tile->config.output_width = tile->out_width;
+            tile->config.output_height = tile->out_height;
+            
+            x += tile->out_width + 1;
+            if (tile->out_height > row_height) row_height = tile->out_height;
+        }
+        
+        if (x - 2 > mosaic.total_width) mosaic.total_width = x - 2;
+        y += row_height + 1;
+    }
+    mosaic.total_height = y - 2;
+}
+
+// 每个源一个线程：独立采集并按图块尺寸转换，结果交给合成器
+void* mosaic_source_thread(void* arg) {
+    MosaicTile* tile = (MosaicTile*)arg;
+    GraphicsBuffer* buf = &app.buffers[tile->index];
+    DisplayConfig config = tile->config;
+    char name[24];
+    
+    if (init_source(buf, buf->device) != 0) {
+        pthread_mutex_lock(&mosaic.lock);
+        tile->failed = 1;
+        pthread_cond_signal(&mosaic.cond);
+        pthread_mutex_unlock(&mosaic.lock);
+        return NULL;
+    }
+    snprintf(name, sizeof(name), "source%d", tile->index);
+    int metrics_slot = metrics_thread_register(name);
+    metrics_set_source(tile->index, buf->device, buf->width, buf->height);
+    
+    while (app.running) {
+        char* output = NULL;
+        
+        uint64_t t0 = monotonic_ns();
+        if (source_next_frame(buf) < 0) {
+            break;
+        }
+        histogram_record(&metrics.stages[STAGE_SNAPSHOT], monotonic_ns() - t0);
+        
+        // 事件驱动的源已在源内等待过，静止时保留图块上的旧文本
+        if ((buf->caps & CAPTURE_CAP_EVENTS) && buf->damage_count == 0 && tile->seq > 0) {
+            source_release_frame(buf);
+            continue;
+        }
+        if (convert_buffer_to_text(buf, &config, &output) == 0) {
+            pthread_mutex_lock(&mosaic.lock);
+            char* old = tile->text;
+            tile->text = output;
+            tile->seq++;
+            pthread_cond_signal(&mosaic.cond);
+            pthread_mutex_unlock(&mosaic.lock);
+            free(old);
+        }
+        source_release_frame(buf);
+        
+        if (config.fps > 0) {
+            usleep(1000000 / config.fps);
+        }
+    }
+    
+    // 源结束后不再等待它的新帧
+    pthread_mutex_lock(&mosaic.lock);
+    tile->failed = 1;
+    pthread_cond_signal(&mosaic.cond);
+    pthread_mutex_unlock(&mosaic.lock);
+    
+    metrics_thread_unregister(metrics_slot);
+    release_source(buf);
+    return NULL;
+}
+
+// 把图块文本按坐标拼入合成缓冲区 (逐行定位光标)
+static char* mosaic_append_tile(char* out, MosaicTile* tile) {
+    const char* line = tile->text;
+    
+    for (int l = 0; l < tile->out_height && *line; l++) {
+        const char* eol = strchr(line, '\n');
+        size_t len = eol ? (size_t)(eol - line) : strlen(line);
+        
+        out += sprintf(out, "\033[%d;%dH", tile->row + l, tile->col);
+        memcpy(out, line, len);
+        out += len;
+        
+        if (!eol) break;
+        line = eol + 1;
+    }
+    
+    return out;
+}
+
+void* mosaic_thread_func(void* arg) {
+    DisplayConfig* config = (DisplayConfig*)arg;
+    unsigned long last_seq[MAX_BUFFERS] = {0};
+    size_t composite_size = 0;
+    char* composite = NULL;
+    AsciicastWriter* cast = NULL;
+    struct timespec start, end;
+    long frame_count = 0;
+    
+    mosaic_layout(config, app.buffer_count, app.tile_width, app.tile_height);
+    int metrics_slot = metrics_thread_register("mosaic");
+    
+    for (int i = 0; i < mosaic.tile_count; i++) {
+        // 与convert_buffer_to_text的行缓冲估算一致，另加每行光标定位
+        composite_size += (size_t)mosaic.tiles[i].out_height *
+                          (mosaic.tiles[i].out_width * 64 + 16);
+    }
+    composite = malloc(composite_size + 1);
+    if (!composite) {
+        perror("分配内存失败");
+        return NULL;
+    }
+    
+    for (int i = 0; i < mosaic.tile_count; i++) {
+        pthread_create(&mosaic.tiles[i].thread, NULL, mosaic_source_thread, &mosaic.tiles[i]);
+    }
+    
+    if (app.verbose) {
+        printf("开始拼接捕获，%d 个源，总尺寸: %dx%d\n",
+               mosaic.tile_count, mosaic.total_width, mosaic.total_height);
+    }
+    if (app.asciicast_path[0]) {
+        cast = asciicast_start(app.asciicast_path, mosaic.total_width, mosaic.total_height);
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    while (app.running) {
+        struct timespec deadline;
+        long interval_ns = config->fps > 0 ? 1000000000L / config->fps : 100000000L;
+        
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += interval_ns;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        
+        pthread_mutex_lock(&mosaic.lock);
+        
+        // 等到所有存活的源都有新帧，或者帧间隔到期
+        for (;;) {
+            int pending = 0, alive = 0;
+            for (int i = 0; i < mosaic.tile_count; i++) {
+                if (mosaic.tiles[i].failed) continue;
+                alive++;
+                if (mosaic.tiles[i].seq == last_seq[i]) pending++;
+            }
+            if (alive == 0) {
+                app.running = 0;
+                break;
+            }
+            if (pending == 0 || !app.running) break;
+            if (pthread_cond_timedwait(&mosaic.cond, &mosaic.lock, &deadline) == ETIMEDOUT) break;
+        }
+        
+        // 合成一帧：只包含有新内容的图块
+        char* out = composite;
+        for (int i = 0; i < mosaic.tile_count; i++) {
+            MosaicTile* tile = &mosaic.tiles[i];
+            if (tile->text && tile->seq != last_seq[i]) {
+                out = mosaic_append_tile(out, tile);
+                last_seq[i] = tile->seq;
+            }
+        }
+        
+        pthread_mutex_unlock(&mosaic.lock);
+        
+        if (out != composite) {
+            uint64_t t0 = monotonic_ns();
+            write_all(STDOUT_FILENO, composite, out - composite);
+            histogram_record(&metrics.stages[STAGE_WRITE], monotonic_ns() - t0);
+            atomic_fetch_add_explicit(&metrics.bytes_total, out - composite, memory_order_relaxed);
+            atomic_fetch_add_explicit(&metrics.frames, 1, memory_order_relaxed);
+            frame_count++;
+            
+            // 合成缓冲区交给asciicast写盘线程，下一帧换新缓冲区
+            char* next = cast ? malloc(composite_size + 1) : NULL;
+            if (next) {
+                asciicast_submit(cast, NULL, composite, out - composite);
+                composite = next;
+            }
+        }
+        
+        if (metrics_dump_requested) {
+            metrics_dump_requested = 0;
+            metrics_dump(stderr);
+        }
+        
+        // 检查按键
+        struct timeval tv = {0, 0};
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(STDIN_FILENO, &fds);
+        
+        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0) {
+            char ch;
+            if (read(STDIN_FILENO, &ch, 1) == 1 &&
+                (ch == 'q' || ch == 'Q' || ch == 27)) { // ESC键
+                app.running = 0;
+            }
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    for (int i = 0; i < mosaic.tile_count; i++) {
+        pthread_join(mosaic.tiles[i].thread, NULL);
+        free(mosaic.tiles[i].text);
+        mosaic.tiles[i].text = NULL;
+    }
+    free(composite);
+    
+    double elapsed = (end.tv_sec - start.tv_sec) + 
+                    (end.tv_nsec - start.tv_nsec) / 1e9;
+    
+    if (app.verbose) {
+        printf("\033[%d;1H\n拼接统计:\n", mosaic.total_height + 1);
+        printf("  合成帧数: %ld\n", frame_count);
+        printf("  总时间: %.2f秒\n", elapsed);
+        printf("  平均帧率: %.2f FPS\n", frame_count / elapsed);
+    }
+    asciicast_stop(cast);
+    metrics_thread_unregister(metrics_slot);
+    metrics_dump(stderr);
+    
+    return NULL;
+}
+
+// 视口线程：等待捕获线程发布的帧，按本视口的配置转换；有变化才更新图块文本
+static void* viewport_worker(void* arg) {
+    MosaicTile* tile = (MosaicTile*)arg;
+    unsigned long seen = 0;
+    char name[24];
+    
+    snprintf(name, sizeof(name), "viewport%d", tile->index);
+    int metrics_slot = metrics_thread_register(name);
+    
+    for (;;) {
+        pthread_mutex_lock(&mosaic.lock);
+        while (mosaic.generation == seen && !mosaic.stop) {
+            pthread_cond_wait(&mosaic.cond, &mosaic.lock);
+        }
+        if (mosaic.generation == seen) {
+            pthread_mutex_unlock(&mosaic.lock);
+            break;
+        }
+        seen = mosaic.generation;
+        pthread_mutex_unlock(&mosaic.lock);
+        
+        char* output = NULL;
+        size_t len;
+        if (converter_run(&tile->conv, mosaic.frame, &tile->config, &output, &len) == 0) {
+            if (!tile->text || tile->conv.dirty_cells > 0) {
+                free(tile->text);
+                tile->text = output;
+                tile->seq++;
+            } else {
+                free(output);
+            }
+        }
+        
+        pthread_mutex_lock(&mosaic.lock);
+        if (--mosaic.busy == 0) {
+            pthread_cond_signal(&mosaic.done);
+        }
+        pthread_mutex_unlock(&mosaic.lock);
+    }
+    
+    metrics_thread_unregister(metrics_slot);
+    return NULL;
+}
+
+// 多视口：只捕获一次，各视口从同一帧并行转换，再按拼接布局合成输出
+void* viewport_thread_func(void* arg) {
+    DisplayConfig* config = (DisplayConfig*)arg;
+    int widths[MAX_DISPLAYS], heights[MAX_DISPLAYS];
+    unsigned long last_seq[MAX_DISPLAYS] = {0};
+    FrameRecorder* recorder = NULL;
+    AsciicastWriter* cast = NULL;
+    FramePacer pacer;
+    struct timespec start, end;
+    long frame_count = 0;
+    
+    for (int i = 0; i < app.viewport_count; i++) {
+        widths[i] = app.viewports[i].out_width;
+        heights[i] = app.viewports[i].out_height;
+    }
+    mosaic_layout(config, app.viewport_count, widths, heights);
+    
+    size_t composite_size = 0;
+    for (int i = 0; i < mosaic.tile_count; i++) {
+        MosaicTile* tile = &mosaic.tiles[i];
+        const ViewportSpec* view = &app.viewports[i];
+        
+        if (view->region_w > 0) {
+            tile->config.region_x = view->region_x;
+            tile->config.region_y = view->region_y;
+            tile->config.region_w = view->region_w;
+            tile->config.region_h = view->region_h;
+        }
+        if (view->charset >= 0) tile->config.charset = (CharsetMode)view->charset;
+        if (view->color_mode >= 0) tile->config.color_mode = (ColorMode)view->color_mode;
+        memset(&tile->conv, 0, sizeof(tile->conv));
+        composite_size += (size_t)tile->out_height * (tile->out_width * 64 + 16);
+    }
+    
+    GraphicsBuffer* buf = open_source(app.device);
+    if (!buf) {
+        fprintf(stderr, "无法打开捕获设备: %s\n", app.device);
+        return NULL;
+    }
+    char* composite = malloc(composite_size + 1);
+    if (!composite) {
+        perror("分配内存失败");
+        close_source(buf);
+        return NULL;
+    }
+    
+    int metrics_slot = metrics_thread_register("capture");
+    metrics_set_source(0, app.device, buf->width, buf->height);
+    if (app.record_path[0]) {
+        recorder = recorder_start(app.record_path, buf);
+    }
+    if (app.asciicast_path[0]) {
+        cast = asciicast_start(app.asciicast_path, mosaic.total_width, mosaic.total_height);
+    }
+    
+    mosaic.frame = buf;
+    mosaic.generation = 0;
+    mosaic.stop = 0;
+    for (int i = 0; i < mosaic.tile_count; i++) {
+        pthread_create(&mosaic.tiles[i].thread, NULL, viewport_worker, &mosaic.tiles[i]);
+    }
+    
+    if (app.verbose) {
+        printf("开始捕获，%d 个视口，总尺寸: %dx%d\n", mosaic.tile_count, mosaic.total_width, mosaic.total_height);
+    }
+    frame_pacer_init(&pacer, (buf->caps & CAPTURE_CAP_TIMED) && app.replay_speed <= 0 ? 0 : config->fps);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    while (app.running) {
+        uint64_t t0 = monotonic_ns();
+        if (source_next_frame(buf) < 0) {
+            break;
+        }
+        if (recorder) {
+            recorder_submit(recorder, buf);
+        }
+        histogram_record(&metrics.stages[STAGE_SNAPSHOT], monotonic_ns() - t0);
+        
+        // 事件驱动的源静止时不必唤醒视口线程
+        int idle = (buf->caps & CAPTURE_CAP_EVENTS) && buf->damage_count == 0 && mosaic.generation > 0;
+        if (idle) {
+            pacer.next_ns = 0;
+        } else {
+            pthread_mutex_lock(&mosaic.lock);
+            mosaic.busy = mosaic.tile_count;
+            mosaic.generation++;
+            pthread_cond_broadcast(&mosaic.cond);
+            while (mosaic.busy > 0) {
+                pthread_cond_wait(&mosaic.done, &mosaic.lock);
+            }
+            pthread_mutex_unlock(&mosaic.lock);
+            
+            // 只重画内容变化的视口
+            char* out = composite;
+            for (int i = 0; i < mosaic.tile_count; i++) {
+                MosaicTile* tile = &mosaic.tiles[i];
+                if (tile->text && tile->seq != last_seq[i]) {
+                    out = mosaic_append_tile(out, tile);
+                    last_seq[i] = tile->seq;
+                }
+            }
+            if (out != composite) {
+                uint64_t t1 = monotonic_ns();
+                write_all(STDOUT_FILENO, composite, out - composite);
+                histogram_record(&metrics.stages[STAGE_WRITE], monotonic_ns() - t1);
+                atomic_fetch_add_explicit(&metrics.bytes_total, out - composite, memory_order_relaxed);
+                
+                char* next = cast ? malloc(composite_size + 1) : NULL;
+                if (next) {
+                    asciicast_submit(cast, NULL, composite, out - composite);
+                    composite = next;
+                }
+            }
+            frame_count++;
+            atomic_fetch_add_explicit(&metrics.frames, 1, memory_order_relaxed);
+        }
+        source_release_frame(buf);
+        
+        if (metrics_dump_requested) {
+            metrics_dump_requested = 0;
+            metrics_dump(stderr);
+        }
+        if (!idle) {
+            atomic_fetch_add_explicit(&metrics.frames_dropped, frame_pacer_wait(&pacer),
+                                      memory_order_relaxed);
+        }
+        
+        // 检查按键
+        struct timeval tv = {0, 0};
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(STDIN_FILENO, &fds);
+        
+        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0) {
+            char ch;
+            if (read(STDIN_FILENO, &ch, 1) == 1 &&
+                (ch == 'q' || ch == 'Q' || ch == 27)) { // ESC键
+                app.running = 0;
+            }
+        }
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    pthread_mutex_lock(&mosaic.lock);
+    mosaic.stop = 1;
+    pthread_cond_broadcast(&mosaic.cond);
+    pthread_mutex_unlock(&mosaic.lock);
+    for (int i = 0; i < mosaic.tile_count; i++) {
+        pthread_join(mosaic.tiles[i].thread, NULL);
+        free(mosaic.tiles[i].text);
+        mosaic.tiles[i].text = NULL;
+        converter_free(&mosaic.tiles[i].conv);
+    }
+    free(composite);
+    
+    double elapsed = (end.tv_sec - start.tv_sec) + 
+                    (end.tv_nsec - start.tv_nsec) / 1e9;
+    
+    if (app.verbose) {
+        printf("\033[%d;1H\n视口统计:\n", mosaic.total_height + 1);
+        printf("  总帧数: %ld\n", frame_count);
+        printf("  总时间: %.2f秒\n", elapsed);
+        printf("  平均帧率: %.2f FPS\n", frame_count / elapsed);
+    }
+    recorder_stop(recorder);
+    asciicast_stop(cast);
+    metrics_thread_unregister(metrics_slot);
+    metrics_dump(stderr);
+    close_source(buf);
+    return NULL;
+}
+
+static SharedChunk* chunk_new(const char* prefix, const char* data, size_t len) {
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    SharedChunk* chunk = malloc(sizeof(SharedChunk) + prefix_len + len);
+    if (!chunk) return NULL;
+    
+    chunk->refs = 1;
+    chunk->len = prefix_len + len;
+    memcpy(chunk->data, prefix, prefix_len);
+    memcpy(chunk->data + prefix_len, data, len);
+    return chunk;
+}
+
+static void chunk_release(SharedChunk* chunk) {
+    if (chunk && --chunk->refs == 0) {
+        free(chunk);
+    }
+}
+
+static void fanout_watch(FanoutServer* server, ServeClient* client, int want_write) {
+    struct epoll_event ev = {
+        .events = EPOLLIN | (want_write ? EPOLLOUT : 0),
+        .data.u32 = (uint32_t)(client - server->clients) + 1
+    };
+    if (client->want_write != want_write) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+        client->want_write = want_write;
+    }
+}
+
+static void fanout_drop(FanoutServer* server, ServeClient* client) {
+    if (app.verbose) {
+        fprintf(stderr, "查看端断开 (重新同步 %lu 次)\n", client->resyncs);
+    }
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    chunk_release(client->pending);
+    client->fd = -1;
+    client->pending = NULL;
+    server->client_count--;
+}
+
+// 非阻塞发送；发不完时等待EPOLLOUT，不阻塞其他客户端
+static void fanout_flush(FanoutServer* server, ServeClient* client) {
+    while (client->pending) {
+        SharedChunk* chunk = client->pending;
+        ssize_t n = send(client->fd, chunk->data + client->offset, chunk->len - client->offset,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                fanout_watch(server, client, 1);
+                return;
+            }
+            fanout_drop(server, client);
+            return;
+        }
+        
+        client->offset += n;
+        if (client->offset == chunk->len) {
+            chunk_release(chunk);
+            client->pending = NULL;
+            client->offset = 0;
+        }
+    }
+    fanout_watch(server, client, 0);
+}
+
+static void fanout_accept(FanoutServer* server) {
+    for (;;) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        
+        ServeClient* client = NULL;
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            if (server->clients[i].fd < 0) {
+                client = &server->clients[i];
+                break;
+            }
+        }
+        if (!client) {
+            close(fd);
+            continue;
+        }
+        
+        memset(client, 0, sizeof(*client));
+        client->fd = fd;
+        client->need_keyframe = 1;
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.u32 = (uint32_t)(client - server->clients) + 1
+        };
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            client->fd = -1;
+            continue;
+        }
+        server->client_count++;
+        
+        if (app.verbose) {
+            fprintf(stderr, "查看端已连接 (共 %d 个)\n", server->client_count);
+        }
+    }
+}
+
+// addr: [ADDR:]PORT，未指定地址时只监听127.0.0.1
+FanoutServer* fanout_start(const char* addr) {
+    struct sockaddr_in sin = { .sin_family = AF_INET };
+    const char* colon = strrchr(addr, ':');
+    int port = atoi(colon ? colon + 1 : addr);
+    int one = 1;
+    
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (colon) {
+        char host[64];
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+        if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+            fprintf(stderr, "无效的监听地址: %s\n", host);
+            return NULL;
+        }
+    }
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "无效的端口: %s\n", addr);
+        return NULL;
+    }
+    sin.sin_port = htons(port);
+    
+    FanoutServer* server = calloc(1, sizeof(FanoutServer));
+    if (!server) {
+        perror("分配内存失败");
+        return NULL;
+    }
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+        server->clients[i].fd = -1;
+    }
+    
+    server->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (server->listen_fd < 0 || server->epoll_fd < 0) {
+        perror("无法创建套接字");
+        goto fail;
+    }
+    setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(server->listen_fd, (struct sockaddr*)&sin, sizeof(sin)) < 0 ||
+        listen(server->listen_fd, 16) < 0) {
+        perror("无法监听端口");
+        goto fail;
+    }
+    
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = 0 };
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ev) < 0) {
+        perror("epoll_ctl失败");
+        goto fail;
+    }
+    return server;
+    
+fail:
+    if (server->listen_fd >= 0) close(server->listen_fd);
+    if (server->epoll_fd >= 0) close(server->epoll_fd);
+    free(server);
+    return NULL;
+}
+
+// 处理连接、断开和可写事件，最多等待timeout_ms
+void fanout_poll(FanoutServer* server, int timeout_ms) {
+    struct epoll_event events[16];
+    int n = epoll_wait(server->epoll_fd, events, 16, timeout_ms);
+    
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.u32 == 0) {
+            fanout_accept(server);
+            continue;
+        }
+        
+        ServeClient* client = &server->clients[events[i].data.u32 - 1];
+        if (client->fd < 0) continue;
+        
+        if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            // 查看端的输入 (例如telnet协商) 直接丢弃，读到EOF即断开
+            char discard[512];
+            ssize_t r = recv(client->fd, discard, sizeof(discard), MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                fanout_drop(server, client);
+                continue;
+            }
+        }
+        if (events[i].events & EPOLLOUT) {
+            fanout_flush(server, client);
+        }
+    }
+}
+
+static void fanout_queue(FanoutServer* server, ServeClient* client, SharedChunk* chunk) {
+    if (!chunk) {
+        client->need_keyframe = 1;
+        return;
+    }
+    
+    chunk->refs++;
+    client->pending = chunk;
+    client->offset = 0;
+    client->need_keyframe = 0;
+    fanout_flush(server, client);
+}
+
+// 上一帧仍未发完的客户端跳过本帧，之后从完整帧重新同步
+void fanout_broadcast(FanoutServer* server, SharedChunk* keyframe, SharedChunk* delta) {
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+        ServeClient* client = &server->clients[i];
+        if (client->fd < 0) continue;
+        
+        if (client->pending) {
+            if (!client->need_keyframe) {
+                client->need_keyframe = 1;
+                client->resyncs++;
+            }
+            continue;
+        }
+        
+        fanout_queue(server, client, client->need_keyframe || !delta ? keyframe : delta);
+    }
+}
+
+// 画面静止时只给等待完整帧的客户端补发，已同步的客户端不受影响
+void fanout_resync(FanoutServer* server, SharedChunk* keyframe) {
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+        ServeClient* client = &server->clients[i];
+        if (client->fd >= 0 && !client->pending && client->need_keyframe) {
+            fanout_queue(server, client, keyframe);
+        }
+    }
+}
+
+void fanout_stop(FanoutServer* server) {
+    if (!server) return;
+    
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+        if (server->clients[i].fd >= 0) {
+            fanout_drop(server, &server->clients[i]);
+        }
+    }
+    close(server->listen_fd);
+    close(server->epoll_fd);
+    free(server);
+}
+
+// 当前帧的完整帧消息；文本输出已有时直接使用，否则从字符单元重新编码
+static SharedChunk* serve_keyframe(DisplayConfig* config, FrameConverter* conv,
+                                   const char* output, size_t len) {
+    CellFrame* frame = &conv->frames[conv->current];
+    
+    if (app.serve_cells) {
+        return cell_message_build(config, frame, NULL);
+    }
+    if (output) {
+        return chunk_new("\033[?25l" FRAME_PREFIX, output, len);
+    }
+    
+    char* text = malloc(cells_output_bound(frame));
+    if (!text) return NULL;
+    SharedChunk* chunk = chunk_new("\033[?25l" FRAME_PREFIX, text, cells_encode(config, frame, text));
+    free(text);
+    return chunk;
+}
+
+// 广播模式：不输出到本地终端，帧间隙处理网络事件
+void serve_mode() {
+    DisplayConfig* config = &app.display;
+    FrameConverter conv = {0};
+    FramePacer pacer;
+    unsigned long frame_count = 0;
+    
+    FanoutServer* server = fanout_start(app.serve_addr);
+    if (!server) {
+        return;
+    }
+    
+    GraphicsBuffer* buf = open_source(app.device);
+    if (!buf) {
+        fprintf(stderr, "无法打开捕获设备: %s\n", app.device);
+        fanout_stop(server);
+        return;
+    }
+    int metrics_slot = metrics_thread_register("serve");
+    metrics_set_source(0, app.device, buf->width, buf->height);
+    
+    printf("广播%s %s，%dx%d -> %dx%d，按 Ctrl+C 退出\n", app.serve_cells ? "字符单元" : "",
+           app.serve_addr, buf->width, buf->height, config->output_width, config->output_height);
+    
+    frame_pacer_init(&pacer, (buf->caps & CAPTURE_CAP_TIMED) && app.replay_speed <= 0 ? 0 : config->fps);
+    app.running = 1;
+    
+    while (app.running) {
+        uint64_t t0 = monotonic_ns();
+        if (source_next_frame(buf) < 0) {
+            break;
+        }
+        histogram_record(&metrics.stages[STAGE_SNAPSHOT], monotonic_ns() - t0);
+        
+        char* output = NULL;
+        size_t len;
+        
+        // 字符单元协议定期让所有查看端重新同步
+        if (app.serve_cells && ++frame_count % CELL_KEYFRAME_INTERVAL == 0) {
+            for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+                server->clients[i].need_keyframe = 1;
+            }
+        }
+        
+        int want_keyframe = 0, want_delta = 0;
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            ServeClient* client = &server->clients[i];
+            if (client->fd < 0 || client->pending) continue;
+            if (client->need_keyframe) want_keyframe = 1;
+            else want_delta = 1;
+        }
+        
+        // 事件驱动的源静止时没有新帧，不必重新转换；
+        // 但新连接的客户端要立即拿到完整帧，用上次转换的结果重新编码
+        int idle = (buf->caps & CAPTURE_CAP_EVENTS) && buf->damage_count == 0 && conv.have_previous;
+        if (idle && want_keyframe) {
+            SharedChunk* keyframe = serve_keyframe(config, &conv, NULL, 0);
+            fanout_resync(server, keyframe);
+            if (keyframe) {
+                atomic_fetch_add_explicit(&metrics.bytes_total, keyframe->len, memory_order_relaxed);
+            }
+            chunk_release(keyframe);
+        } else if (!idle && server->client_count > 0 &&
+                   converter_run(&conv, buf, config, &output, &len) == 0) {
+            SharedChunk* keyframe = NULL;
+            SharedChunk* delta = NULL;
+            
+            // 只编码本帧实际需要的形式
+            if (app.serve_cells) {
+                CellFrame* frame = &conv.frames[conv.current];
+                if (want_delta && conv.previous_valid) {
+                    delta = cell_message_build(config, frame, &conv.frames[1 - conv.current]);
+                }
+            } else {
+                char* delta_text = NULL;
+                size_t delta_len;
+                if (want_delta && converter_encode_delta(&conv, config, &delta_text, &delta_len) == 0) {
+                    delta = chunk_new(NULL, delta_text, delta_len);
+                    free(delta_text);
+                }
+            }
+            if (want_keyframe || (want_delta && !delta)) {
+                keyframe = serve_keyframe(config, &conv, output, len);
+            }
+            free(output);
+            
+            uint64_t t1 = monotonic_ns();
+            fanout_broadcast(server, keyframe, delta);
+            histogram_record(&metrics.stages[STAGE_WRITE], monotonic_ns() - t1);
+            atomic_fetch_add_explicit(&metrics.bytes_total,
+                                      (keyframe ? keyframe->len : 0) + (delta ? delta->len : 0),
+                                      memory_order_relaxed);
+            chunk_release(keyframe);
+            chunk_release(delta);
+        } else if (server->client_count == 0) {
+            // 没有查看端时丢弃上一帧，下一个连接总会先收到完整帧
+            conv.have_previous = 0;
+            conv.previous_valid = 0;
+        }
+        source_release_frame(buf);
+        if (!idle) {
+            atomic_fetch_add_explicit(&metrics.frames, 1, memory_order_relaxed);
+        }
+        
+        if (metrics_dump_requested) {
+            metrics_dump_requested = 0;
+            metrics_dump(stderr);
+        }
+        
+        // 在到下一帧时刻之前处理网络事件
+        atomic_fetch_add_explicit(&metrics.frames_dropped, frame_pacer_advance(&pacer),
+                                  memory_order_relaxed);
+        do {
+            uint64_t now = monotonic_ns();
+            int timeout = pacer.interval_ns && pacer.next_ns > now ?
+                          (int)((pacer.next_ns - now + 999999) / 1000000) : 0;
+            fanout_poll(server, timeout);
+        } while (app.running && pacer.interval_ns && monotonic_ns() < pacer.next_ns);
+    }
+    
+    metrics_thread_unregister(metrics_slot);
+    converter_free(&conv);
+    fanout_stop(server);
+    close_source(buf);
+    metrics_dump(stderr);
+}
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = v >> 24;
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// 字形按Unicode码位传输
+static uint32_t utf8_codepoint(const char* s) {
+    const unsigned char* u = (const unsigned char*)s;
+    if (u[0] < 0x80) return u[0];
+    if ((u[0] & 0xE0) == 0xC0) return ((u[0] & 0x1F) << 6) | (u[1] & 0x3F);
+    if ((u[0] & 0xF0) == 0xE0) return ((u[0] & 0x0F) << 12) | ((u[1] & 0x3F) << 6) | (u[2] & 0x3F);
+    if ((u[0] & 0xF8) == 0xF0) {
+        return ((uint32_t)(u[0] & 0x07) << 18) | ((u[1] & 0x3F) << 12) | ((u[2] & 0x3F) << 6) | (u[3] & 0x3F);
+    }
+    return '?';
+}
+
+// 写入glyph并返回字节数；4字节的字形正好填满Glyph.bytes，不带结尾0
+static int utf8_encode(uint32_t cp, char* out) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xC0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = 0xE0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3F);
+        out[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    } else {
+        out[0] = 0xF0 | (cp >> 18);
+        out[1] = 0x80 | ((cp >> 12) & 0x3F);
+        out[2] = 0x80 | ((cp >> 6) & 0x3F);
+        out[3] = 0x80 | (cp & 0x3F);
+        return 4;
+    }
+}
+
+static int cell_record_size(int color_mode) {
+    switch (color_mode) {
+        case COLOR_NONE: return 4;
+        case COLOR_TRUE: return 10;
+        default: return 6;
+    }
+}
+
+size_t cell_payload_bound(CellFrame* frame) {
+    // 最坏情况每个单元一个区间
+    return (size_t)frame->cols * frame->rows * (10 + 6);
+}
+
+static uint8_t* cell_put_span(DisplayConfig* config, const TextCell* cells, int start, int count,
+                              uint8_t* out) {
+    put_u32(out, start);
+    put_u16(out + 4, count);
+    out += 6;
+    
+    for (int i = 0; i < count; i++) {
+        const TextCell* cell = &cells[start + i];
+        put_u32(out, utf8_codepoint(cell->glyph->bytes));
+        out += 4;
+        
+        if (config->color_mode == COLOR_TRUE) {
+            out[0] = cell->fg >> 16; out[1] = cell->fg >> 8; out[2] = cell->fg;
+            out[3] = cell->bg >> 16; out[4] = cell->bg >> 8; out[5] = cell->bg;
+            out += 6;
+        } else if (config->color_mode != COLOR_NONE) {
+            out[0] = cell->fg;
+            out[1] = cell->bg;
+            out += 2;
+        }
+    }
+    return out;
+}
+
+// prev为NULL时编码完整帧，否则只编码变化单元组成的区间
+size_t cell_payload_encode(DisplayConfig* config, CellFrame* frame, CellFrame* prev, uint8_t* out) {
+    int total = frame->cols * frame->rows;
+    uint8_t* current = out;
+    int i = 0;
+    
+    while (i < total) {
+        if (prev && cells_equal(&frame->cells[i], &prev->cells[i])) {
+            i++;
+            continue;
+        }
+        
+        int start = i;
+        while (i < total && i - start < CELL_SPAN_MAX &&
+               (!prev || !cells_equal(&frame->cells[i], &prev->cells[i]))) {
+            i++;
+        }
+        current = cell_put_span(config, frame->cells, start, i - start, current);
+    }
+    
+    return current - out;
+}
+
+// 按码位缓存解码后的字形：基本多文种平面直接索引，辅助平面用小的开放寻址表
+#define CELL_ASTRAL_CACHE 256
+
+static const Glyph* cell_glyph(uint32_t cp) {
+    static Glyph bmp[65536];
+    static Glyph astral[CELL_ASTRAL_CACHE];
+    static uint32_t astral_cp[CELL_ASTRAL_CACHE];
+    static const Glyph unknown = { "?", 1 };
     
-    // 分配输出缓冲区
-    int line_len = config->output_width * 64; // 预留颜色代码空间
-    *output = malloc(config->output_height * line_len);
-    if (!*output) {
-        return -1;
+    if (cp < 0x10000) {
+        if (!bmp[cp].len) {
+            bmp[cp].len = utf8_encode(cp, bmp[cp].bytes);
+        }
+        return &bmp[cp];
     }
     
-    char* current = *output;
+    for (int i = 0; i < CELL_ASTRAL_CACHE; i++) {
+        int slot = (cp + i) & (CELL_ASTRAL_CACHE - 1);
+        if (astral_cp[slot] == cp) {
+            return &astral[slot];
+        }
+        if (!astral_cp[slot]) {
+            astral_cp[slot] = cp;
+            astral[slot].len = utf8_encode(cp, astral[slot].bytes);
+            return &astral[slot];
+        }
+    }
+    return &unknown;
+}
+
+// 把负载中的区间写入frame；glyph指向按码位缓存的字形
+// 完整帧必须按顺序覆盖全部单元，否则新分配的帧里会留下没有字形的单元
+int cell_payload_apply(const CellMessageHeader* header, const uint8_t* payload, CellFrame* frame) {
+    int record = cell_record_size(header->color_mode);
+    int total = frame->cols * frame->rows;
+    int keyframe = header->type == CELL_MSG_KEYFRAME;
+    uint32_t covered = 0;
+    const uint8_t* end = payload + header->raw_size;
     
-    for (int out_y = 0; out_y < config->output_height; out_y++) {
-        int in_y = region_y + (int)(out_y * y_step);
+    while (payload + 6 <= end) {
+        uint32_t start = get_u32(payload);
+        int count = get_u16(payload + 4);
+        payload += 6;
         
-        char last_fg[32] = "";
-        char last_bg[32] = "";
+        if (start > (uint32_t)total || count > total - (int)start || payload + (size_t)count * record > end) {
+            return -1;
+        }
+        if (keyframe) {
+            if (start != covered) return -1;
+            covered += count;
+        }
         
-        for (int out_x = 0; out_x < config->output_width; out_x++) {
-            int in_x = region_x + (int)(out_x * x_step);
+        for (int i = 0; i < count; i++, payload += record) {
+            TextCell* cell = &frame->cells[start + i];
+            uint32_t cp = get_u32(payload);
             
-            // 获取像素颜色
-            int r, g, b;
-            if (get_pixel_color(buf, in_x, in_y, &r, &g, &b) != 0) {
-                r = g = b = 0;
+            // 控制字符、代理区和超出Unicode范围的码位都不是有效字形
+            if (cp < 0x20 || (cp >= 0xD800 && cp < 0xE000) || cp > 0x10FFFF) {
+                return -1;
             }
+            cell->glyph = cell_glyph(cp);
             
-            // 应用亮度和对比度调整
-            r = (int)((r - 128) * config->contrast + 128 * config->brightness);
-            g = (int)((g - 128) * config->contrast + 128 * config->brightness);
-            b = (int)((b - 128) * config->contrast + 128 * config->brightness);
-            
-            // 限制范围
-            if (r < 0) r = 0; if (r > 255) r = 255;
-            if (g < 0) g = 0; if (g > 255) g = 255;
-            if (b < 0) b = 0; if (b > 255) b = 255;
-            
-            // 获取颜色代码
-            char* fg_color = get_color_fg(r, g, b, config->color_mode);
-            char* bg_color = config->color_mode == COLOR_NONE ? "" : 
-                           get_color_bg(r/2, g/2, b/2, config->color_mode);
-            
-            // 只有在颜色变化时才输出颜色代码
-            if (strcmp(fg_color, last_fg) != 0 || strcmp(bg_color, last_bg) != 0) {
-                strcpy(last_fg, fg_color);
-                strcpy(last_bg, bg_color);
-                current += sprintf(current, "%s%s", fg_color, bg_color);
+            if (header->color_mode == COLOR_TRUE) {
+                cell->fg = (payload[4] << 16) | (payload[5] << 8) | payload[6];
+                cell->bg = (payload[7] << 16) | (payload[8] << 8) | payload[9];
+            } else if (header->color_mode != COLOR_NONE) {
+                cell->fg = payload[4];
+                cell->bg = payload[5];
             }
-            
-            // 获取字符
-            int brightness = rgb_to_brightness(r, g, b);
-            const char* ch = get_unicode_char(brightness, config->charset);
-            current += sprintf(current, "%s", ch);
-        }
-        
-        // 每行结束重置颜色
-        if (config->color_mode != COLOR_NONE) {
-            current += sprintf(current, "\033[0m");
         }
-        current += sprintf(current, "\n");
     }
     
-    return 0;
+    if (keyframe && covered != (uint32_t)total) {
+        return -1;
+    }
+    return payload == end ? 0 : -1;
 }
 
-void display_text(char* text, int width, int height) {
-    if (!text) return;
+SharedChunk* cell_message_build(DisplayConfig* config, CellFrame* frame, CellFrame* prev) {
+    uint8_t* payload = malloc(cell_payload_bound(frame));
+    if (!payload) return NULL;
     
-    // 清屏并移动光标到左上角
-    clear_screen();
+    size_t raw_size = cell_payload_encode(config, frame, prev, payload);
+    const uint8_t* body = payload;
+    size_t size = raw_size;
+    uint8_t flags = 0;
     
-    // 输出文本
-    printf("%s", text);
-    fflush(stdout);
+#ifdef USE_ZLIB
+    // 只在确实变小时使用压缩
+    uLongf packed_size = compressBound(raw_size);
+    uint8_t* packed = malloc(packed_size);
+    if (packed && compress2(packed, &packed_size, payload, raw_size, 1) == Z_OK &&
+        packed_size < raw_size) {
+        body = packed;
+        size = packed_size;
+        flags |= CELL_FLAG_ZLIB;
+    }
+#endif
+    
+    SharedChunk* chunk = malloc(sizeof(SharedChunk) + CELL_MSG_HEADER_SIZE + size);
+    if (chunk) {
+        uint8_t* h = (uint8_t*)chunk->data;
+        chunk->refs = 1;
+        chunk->len = CELL_MSG_HEADER_SIZE + size;
+        h[0] = prev ? CELL_MSG_DELTA : CELL_MSG_KEYFRAME;
+        h[1] = flags;
+        h[2] = config->color_mode;
+        h[3] = config->charset;
+        put_u16(h + 4, frame->cols);
+        put_u16(h + 6, frame->rows);
+        put_u32(h + 8, raw_size);
+        put_u32(h + 12, size);
+        memcpy(h + CELL_MSG_HEADER_SIZE, body, size);
+    }
+    
+#ifdef USE_ZLIB
+    free(packed);
+#endif
+    free(payload);
+    return chunk;
 }
 
-void* capture_thread_func(void* arg) {
-    DisplayConfig* config = (DisplayConfig*)arg;
-    GraphicsBuffer* buf = NULL;
-    char* output = NULL;
-    struct timespec start, end;
-    long frame_count = 0;
+static int read_full(int fd, void* data, size_t len) {
+    uint8_t* p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// addr: HOST:PORT
+int tcp_connect(const char* addr) {
+    char host[128];
+    const char* colon = strrchr(addr, ':');
+    if (!colon) {
+        fprintf(stderr, "地址格式应为 HOST:PORT\n");
+        return -1;
+    }
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
     
-    // 打开默认帧缓冲区
-    buf = open_framebuffer("/dev/fb0");
-    if (!buf) {
-        fprintf(stderr, "无法打开帧缓冲区\n");
-        return NULL;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo* result;
+    int err = getaddrinfo(host, colon + 1, &hints, &result);
+    if (err != 0) {
+        fprintf(stderr, "无法解析 %s: %s\n", host, gai_strerror(err));
+        return -1;
     }
     
-    if (app.verbose) {
-        printf("开始捕获，分辨率: %dx%d\n", buf->width, buf->height);
+    int fd = -1;
+    for (struct addrinfo* ai = result; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
     }
+    freeaddrinfo(result);
     
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (fd < 0) {
+        perror("连接失败");
+    }
+    return fd;
+}
+
+// 查看端：接收字符单元消息，在本地生成ANSI
+void view_mode() {
+    CellFrame frame = {0};      // 当前屏幕内容
+    CellFrame prev = {0};       // 应用本条消息之前的内容
+    int have_frame = 0;
+    size_t payload_capacity = 0;
+    uint8_t* payload = NULL;
+    uint8_t* raw = NULL;
+#ifdef USE_ZLIB
+    size_t raw_capacity = 0;
+#endif
+    char* output = NULL;
+    unsigned long messages = 0, wire_bytes = 0;
+    
+    int fd = tcp_connect(app.view_addr);
+    if (fd < 0) {
+        return;
+    }
+    
+    setup_terminal();
+    app.running = 1;
     
     while (app.running) {
-        // 转换缓冲区为文本
-        if (convert_buffer_to_text(buf, config, &output) == 0) {
-            // 显示文本
-            display_text(output, config->output_width, config->output_height);
-            free(output);
+        struct pollfd pfds[2] = {
+            { fd, POLLIN, 0 },
+            { STDIN_FILENO, POLLIN, 0 }
+        };
+        if (poll(pfds, 2, 200) <= 0) {
+            continue;
         }
         
-        frame_count++;
+        if (pfds[1].revents & POLLIN) {
+            char ch;
+            if (read(STDIN_FILENO, &ch, 1) == 1 && (ch == 'q' || ch == 'Q' || ch == 27)) {
+                break;
+            }
+        }
+        if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
         
-        // 控制帧率
-        if (config->fps > 0) {
-            usleep(1000000 / config->fps);
+        uint8_t h[CELL_MSG_HEADER_SIZE];
+        if (read_full(fd, h, sizeof(h)) != 0) {
+            break;
+        }
+        CellMessageHeader header = {
+            .type = h[0], .flags = h[1], .color_mode = h[2], .charset = h[3],
+            .cols = get_u16(h + 4), .rows = get_u16(h + 6),
+            .raw_size = get_u32(h + 8), .size = get_u32(h + 12)
+        };
+        if (header.cols == 0 || header.rows == 0 || (uint32_t)header.cols * header.rows > CELL_MAX_CELLS) {
+            fprintf(stderr, "无效的字符单元尺寸: %ux%u\n", header.cols, header.rows);
+            break;
+        }
+        if (header.type != CELL_MSG_KEYFRAME && header.type != CELL_MSG_DELTA) {
+            fprintf(stderr, "不支持的消息类型 %u (服务端协议版本不一致?)\n", header.type);
+            break;
+        }
+        if (header.color_mode > COLOR_GRAY) {
+            fprintf(stderr, "不支持的颜色模式 %u\n", header.color_mode);
+            break;
         }
         
-        // 检查按键
-        struct timeval tv = {0, 0};
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(STDIN_FILENO, &fds);
+        if (header.size > payload_capacity) {
+            uint8_t* p = realloc(payload, header.size);
+            if (!p) break;
+            payload = p;
+            payload_capacity = header.size;
+        }
+        if (read_full(fd, payload, header.size) != 0) {
+            break;
+        }
+        messages++;
+        wire_bytes += sizeof(h) + header.size;
         
-        if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0) {
-            char ch;
-            read(STDIN_FILENO, &ch, 1);
-            if (ch == 'q' || ch == 'Q' || ch == 27) { // ESC键
-                app.running = 0;
+        const uint8_t* body = payload;
+        if (header.flags & CELL_FLAG_ZLIB) {
+#ifdef USE_ZLIB
+            if (header.raw_size > raw_capacity) {
+                uint8_t* p = realloc(raw, header.raw_size);
+                if (!p) break;
+                raw = p;
+                raw_capacity = header.raw_size;
+            }
+            uLongf raw_size = header.raw_size;
+            if (uncompress(raw, &raw_size, payload, header.size) != Z_OK ||
+                raw_size != header.raw_size) {
+                fprintf(stderr, "解压失败\n");
+                break;
+            }
+            body = raw;
+#else
+            fprintf(stderr, "服务端使用了zlib压缩，但本程序编译时未启用USE_ZLIB\n");
+            break;
+#endif
+        } else if (header.raw_size != header.size) {
+            break;
+        }
+        
+        // 尺寸变化后必须等待完整帧
+        if (frame.cols != header.cols || frame.rows != header.rows) {
+            cell_frame_free(&frame);
+            cell_frame_free(&prev);
+            have_frame = 0;
+            free(output);
+            output = NULL;
+            if (cell_frame_init(&frame, header.cols, header.rows) != 0 ||
+                cell_frame_init(&prev, header.cols, header.rows) != 0) {
                 break;
             }
+            output = malloc(cells_delta_bound(&frame));
+            if (!output) break;
+        }
+        if (header.type != CELL_MSG_KEYFRAME && !have_frame) {
+            continue;
+        }
+        
+        memcpy(prev.cells, frame.cells, sizeof(TextCell) * frame.cols * frame.rows);
+        if (cell_payload_apply(&header, body, &frame) != 0) {
+            fprintf(stderr, "无效的字符单元消息\n");
+            break;
+        }
+        
+        DisplayConfig config = app.display;
+        config.color_mode = header.color_mode;
+        size_t len;
+        if (header.type == CELL_MSG_KEYFRAME) {
+            write_all(STDOUT_FILENO, FRAME_PREFIX, sizeof(FRAME_PREFIX) - 1);
+            len = cells_encode(&config, &frame, output);
+        } else {
+            len = cells_encode_delta(&config, &frame, &prev, output);
         }
+        write_all(STDOUT_FILENO, output, len);
+        have_frame = 1;
     }
     
-    clock_gettime(CLOCK_MONOTONIC, &end);
+    restore_terminal();
+    close(fd);
+    if (app.verbose) {
+        printf("收到 %lu 条消息，%lu 字节\n", messages, wire_bytes);
+    }
+    free(output);
+    free(payload);
+    free(raw);
+    cell_frame_free(&frame);
+    cell_frame_free(&prev);
+}
+
+// 基准语料
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 360
+#define BENCH_FRAMES 8
+
+enum {
+    BENCH_GRADIENT = 0,
+    BENCH_NOISE,
+    BENCH_TEXT_UI,
+    BENCH_PHOTO,
+    BENCH_STATIC,
+    BENCH_SCROLL,
+    BENCH_CORPUS_COUNT
+};
+
+static const char* bench_corpus_names[] = {
+    "gradient", "noise", "text-ui", "photo", "static", "scroll"
+};
+
+static uint32_t bench_hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// 模拟文本界面：标题栏、面板边框和8x16的伪字符
+static void bench_text_ui_pixel(int x, int y, int* r, int* g, int* b) {
+    *r = 24; *g = 28; *b = 36;
     
-    // 计算统计信息
-    double elapsed = (end.tv_sec - start.tv_sec) + 
-                    (end.tv_nsec - start.tv_nsec) / 1e9;
-    double fps = frame_count / elapsed;
+    if (y < 24) {
+        *r = 60; *g = 90; *b = 160;
+        return;
+    }
+    if (x == 320 || x == 321 || (y % 120) == 0) {
+        *r = *g = *b = 140;
+        return;
+    }
     
-    if (app.verbose) {
-        printf("\n捕获统计:\n");
-        printf("  总帧数: %ld\n", frame_count);
-        printf("  总时间: %.2f秒\n", elapsed);
-        printf("  平均帧率: %.2f FPS\n", fps);
+    int cx = x / 8, cy = y / 16, px = x % 8, py = y % 16;
+    uint32_t h = bench_hash(cx * 131 + cy * 7919);
+    int line_len = 20 + bench_hash(cy) % 50;
+    if ((cx % 80) >= line_len || (h & 7) == 0 || px >= 6 || py < 3 || py > 12) {
+        return;
+    }
+    if ((bench_hash(h + px * 17 + py * 101) & 3) != 0) {
+        *r = 200; *g = 210; *b = (cy % 5 == 0) ? 90 : 200;
+    }
+}
+
+// 生成第frame帧，像素按内存顺序B,G,R,A存放
+static void bench_generate(int corpus, int frame, unsigned char* pixels) {
+    for (int y = 0; y < BENCH_HEIGHT; y++) {
+        unsigned char* p = pixels + (size_t)y * BENCH_WIDTH * 4;
+        
+        for (int x = 0; x < BENCH_WIDTH; x++, p += 4) {
+            int r = 0, g = 0, b = 0;
+            
+            switch (corpus) {
+                case BENCH_GRADIENT:
+                    r = x * 255 / BENCH_WIDTH;
+                    g = y * 255 / BENCH_HEIGHT;
+                    b = 255 - r;
+                    break;
+                case BENCH_NOISE: {
+                    uint32_t h = bench_hash((uint32_t)(frame * BENCH_HEIGHT + y) * BENCH_WIDTH + x);
+                    r = h & 0xFF;
+                    g = (h >> 8) & 0xFF;
+                    b = (h >> 16) & 0xFF;
+                    break;
+                }
+                case BENCH_PHOTO: {
+                    double v = sin(x * 0.021) + sin(y * 0.033) + sin((x + y) * 0.011) +
+                               sin(sqrt((double)(x - 320) * (x - 320) + (y - 180) * (y - 180)) * 0.05);
+                    int n = bench_hash(y * BENCH_WIDTH + x) % 12;
+                    r = (int)(128 + 30 * v) + n;
+                    g = (int)(100 + 25 * sin(v * 2)) + n;
+                    b = (int)(80 + 40 * cos(v)) + n;
+                    break;
+                }
+                case BENCH_SCROLL:
+                    bench_text_ui_pixel(x, y < 24 ? y : y + frame * 4, &r, &g, &b);
+                    break;
+                case BENCH_TEXT_UI:
+                case BENCH_STATIC:
+                default:
+                    bench_text_ui_pixel(x, y, &r, &g, &b);
+                    break;
+            }
+            
+            p[0] = b < 0 ? 0 : (b > 255 ? 255 : b);
+            p[1] = g < 0 ? 0 : (g > 255 ? 255 : g);
+            p[2] = r < 0 ? 0 : (r > 255 ? 255 : r);
+            p[3] = 255;
+        }
+    }
+}
+
+// 在内置语料上按阶段计时：每种颜色模式和字符集的每个字符单元纳秒数
+void benchmark_corpus() {
+    const int cols = 80, rows = 24, passes = 4;
+    const int frame_counts[BENCH_CORPUS_COUNT] = {1, 4, 1, 1, BENCH_FRAMES, BENCH_FRAMES};
+    size_t frame_bytes = (size_t)BENCH_WIDTH * BENCH_HEIGHT * 4;
+    unsigned char* pixels = malloc(frame_bytes * BENCH_FRAMES);
+    CellFrame frame;
+    char* output = NULL;
+    int null_fd = open("/dev/null", O_WRONLY);
+    
+    if (!pixels || null_fd < 0 || cell_frame_init(&frame, cols, rows) != 0 ||
+        !(output = malloc(cells_output_bound(&frame)))) {
+        fprintf(stderr, "无法准备基准语料\n");
+        free(pixels);
+        free(output);
+        if (null_fd >= 0) close(null_fd);
+        return;
     }
     
-    close_framebuffer(buf);
-    return NULL;
+    GraphicsBuffer buf = {
+        .device = "corpus",
+        .fd = -1,
+        .size = frame_bytes,
+        .width = BENCH_WIDTH,
+        .height = BENCH_HEIGHT,
+        .bpp = 32,
+        .line_length = BENCH_WIDTH * 4,
+        .format = PIXFMT_BGRA8888,
+        .type = SERVER_FILE,
+        .frame_count = 1,
+        .damage_count = -1
+    };
+    
+    printf("内置语料: %dx%d -> %dx%d 字符，单位: ns/字符单元\n\n",
+           BENCH_WIDTH, BENCH_HEIGHT, cols, rows);
+    printf("%-9s %-6s %-8s %8s %8s %8s %8s %8s %8s %10s\n",
+           "语料", "颜色", "字符集", "decode", "adjust", "quantize", "glyph", "encode", "write", "字节/帧");
+    
+    for (int corpus = 0; corpus < BENCH_CORPUS_COUNT; corpus++) {
+        int count = frame_counts[corpus];
+        for (int f = 0; f < count; f++) {
+            bench_generate(corpus, f, pixels + f * frame_bytes);
+        }
+        
+        for (int mode = 0; mode < (int)(sizeof(color_mode_names) / sizeof(color_mode_names[0])); mode++) {
+            for (int charset = 0; charset < (int)(sizeof(charset_names) / sizeof(charset_names[0])); charset++) {
+                DisplayConfig config = {
+                    .output_width = cols,
+                    .output_height = rows,
+                    .color_mode = (ColorMode)mode,
+                    .charset = (CharsetMode)charset,
+                    .brightness = 1.0,
+                    .contrast = 1.0
+                };
+                double stage_ns[6] = {0};
+                size_t bytes = 0;
+                int frames = 0;
+                
+                for (int pass = 0; pass < passes; pass++) {
+                    for (int f = 0; f < BENCH_FRAMES; f++) {
+                        struct timespec t[7];
+                        buf.buffer = pixels + (f % count) * frame_bytes;
+                        
+                        clock_gettime(CLOCK_MONOTONIC, &t[0]);
+                        cells_decode(&buf, &config, &frame, NULL);
+                        clock_gettime(CLOCK_MONOTONIC, &t[1]);
+                        cells_adjust(&config, &frame, NULL);
+                        clock_gettime(CLOCK_MONOTONIC, &t[2]);
+                        cells_quantize(&config, &frame, NULL);
+                        clock_gettime(CLOCK_MONOTONIC, &t[3]);
+                        cells_glyph(&config, &frame, NULL);
+                        clock_gettime(CLOCK_MONOTONIC, &t[4]);
+                        size_t len = cells_encode(&config, &frame, output);
+                        clock_gettime(CLOCK_MONOTONIC, &t[5]);
+                        if (write_all(null_fd, output, len) != 0) break;
+                        clock_gettime(CLOCK_MONOTONIC, &t[6]);
+                        
+                        for (int k = 0; k < 6; k++) {
+                            stage_ns[k] += (t[k + 1].tv_sec - t[k].tv_sec) * 1e9 +
+                                           (t[k + 1].tv_nsec - t[k].tv_nsec);
+                        }
+                        bytes += len;
+                        frames++;
+                    }
+                }
+                
+                double cells = (double)frames * cols * rows;
+                printf("%-9s %-6s %-8s %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %10zu\n",
+                       bench_corpus_names[corpus], color_mode_names[mode], charset_names[charset],
+                       stage_ns[0] / cells, stage_ns[1] / cells, stage_ns[2] / cells,
+                       stage_ns[3] / cells, stage_ns[4] / cells, stage_ns[5] / cells,
+                       bytes / frames);
+            }
+        }
+    }
+    printf("\n");
+    
+    // 采样方式的代价和效果：平均亮度反映细亮线是否被保留
+    printf("采样方式 (真彩色, simple)，单位: ns/字符单元\n\n");
+    printf("%-9s %-7s %8s %8s %10s\n", "语料", "采样", "decode", "quantize", "平均亮度");
+    for (int corpus = 0; corpus < BENCH_CORPUS_COUNT; corpus++) {
+        bench_generate(corpus, 0, pixels);
+        buf.buffer = pixels;
+        
+        for (int sampling = 0; sampling < (int)(sizeof(sampling_names) / sizeof(sampling_names[0])); sampling++) {
+            DisplayConfig config = {
+                .output_width = cols,
+                .output_height = rows,
+                .color_mode = COLOR_TRUE,
+                .charset = CHARSET_SIMPLE,
+                .brightness = 1.0,
+                .contrast = 1.0,
+                .sampling = (SamplingMode)sampling
+            };
+            double decode_ns = 0, quantize_ns = 0;
+            
+            for (int pass = 0; pass < passes * BENCH_FRAMES; pass++) {
+                uint64_t t0 = monotonic_ns();
+                cells_decode(&buf, &config, &frame, NULL);
+                uint64_t t1 = monotonic_ns();
+                cells_quantize(&config, &frame, NULL);
+                uint64_t t2 = monotonic_ns();
+                decode_ns += t1 - t0;
+                quantize_ns += t2 - t1;
+            }
+            
+            unsigned long luma = 0;
+            for (int i = 0; i < cols * rows; i++) {
+                luma += frame.cells[i].luma;
+            }
+            double cells = (double)passes * BENCH_FRAMES * cols * rows;
+            printf("%-9s %-7s %8.2f %8.2f %10.1f\n", bench_corpus_names[corpus], sampling_names[sampling],
+                   decode_ns / cells, quantize_ns / cells, (double)luma / (cols * rows));
+        }
+    }
+    printf("\n");
+    
+    cell_frame_free(&frame);
+    free(output);
+    free(pixels);
+    close(null_fd);
 }
 
 void benchmark_mode() {
-    printf("性能测试模式...\n");
+    printf("性能测试模式...\n\n");
+    
+    if (metrics_self_check() != 0) {
+        fprintf(stderr, "指标自检失败\n");
+    }
     
-    GraphicsBuffer* buf = open_framebuffer("/dev/fb0");
+    if (app.vnc_trace_path[0]) {
+        benchmark_vnc_trace(app.vnc_trace_path);
+        return;
+    }
+    
+    benchmark_corpus();
+    
+    // 实际捕获设备
+    printf("捕获设备: %s\n", app.device);
+    GraphicsBuffer* buf = open_source(app.device);
     if (!buf) {
-        fprintf(stderr, "无法打开帧缓冲区\n");
+        fprintf(stderr, "无法打开捕获设备: %s\n", app.device);
         return;
     }
+    printf("捕获源: %s (", buf->source->name);
+    print_capture_caps(buf->caps);
+    printf(")\n");
     
     DisplayConfig config = {
         .output_width = 80,
@@ -791,19 +8791,26 @@ void benchmark_mode() {
         .charset = CHARSET_SIMPLE,
         .brightness = 1.0,
         .contrast = 1.0,
+        .sampling = app.display.sampling,
         .fps = 0  // 最大速度
     };
     
     char* output = NULL;
     struct timespec start, end;
-    const int iterations = 100;
+    int iterations = 100;
     
     clock_gettime(CLOCK_MONOTONIC, &start);
     
     for (int i = 0; i < iterations; i++) {
+        if (source_next_frame(buf) < 0) {
+            // 回放源提前结束
+            iterations = i;
+            break;
+        }
         if (convert_buffer_to_text(buf, &config, &output) == 0) {
             free(output);
         }
+        source_release_frame(buf);
     }
     
     clock_gettime(CLOCK_MONOTONIC, &end);
@@ -818,7 +8825,7 @@ void benchmark_mode() {
     printf("  处理速度: %.2f FPS\n", fps);
     printf("  每帧时间: %.2f ms\n", 1000.0 / fps);
     
-    close_framebuffer(buf);
+    close_source(buf);
 }
 
 void interactive_mode() {
@@ -903,14 +8910,45 @@ void interactive_mode() {
     } while (choice != 0);
 }
 
+// 在终端中持续捕获显示app.device，直到按Q或收到信号
+int capture_screen() {
+    printf("开始捕获屏幕...\n");
+    printf("按 Q 键退出\n\n");
+    
+    setup_terminal();
+    app.running = 1;
+    if (app.buffer_count > 0) {
+        // 多源拼接
+        if (app.viewport_count > 0) {
+            fprintf(stderr, "警告: --viewport 不能与 --source 同时使用，已忽略视口设置\n");
+        }
+        if (app.sixel) {
+            fprintf(stderr, "警告: --sixel 只用于单个捕获源，拼接输出仍为字符\n");
+        }
+        pthread_create(&app.capture_thread, NULL, mosaic_thread_func, &app.display);
+    } else if (app.viewport_count > 0) {
+        // 单源多视口
+        if (app.sixel) {
+            fprintf(stderr, "警告: --sixel 只用于单个捕获源，视口输出仍为字符\n");
+        }
+        pthread_create(&app.capture_thread, NULL, viewport_thread_func, &app.display);
+    } else {
+        pthread_create(&app.capture_thread, NULL, capture_thread_func, &app.display);
+    }
+    pthread_join(app.capture_thread, NULL);
+    restore_terminal();
+    return 0;
+}
+
+// 各类服务器都换算成捕获源设备名，交给同一条捕获流程
 int connect_to_server(ServerConfig* config) {
     printf("连接到服务器: ");
     
     switch (config->type) {
         case SERVER_FRAMEBUFFER:
             printf("本地帧缓冲区\n");
-            // 已经在capture模式中处理
-            return 0;
+            // 沿用 --device 指定的设备
+            break;
             
         case SERVER_X11:
             printf("X11服务器\n");
@@ -923,8 +8961,20 @@ int connect_to_server(ServerConfig* config) {
                 }
             }
             printf("显示: %s\n", config->display);
-            // 这里可以添加X11连接代码
-            return 0;
+            
+            snprintf(app.device, sizeof(app.device), "x11:%s", config->display);
+            break;
+            
+        case SERVER_WAYLAND:
+            printf("Wayland合成器\n");
+            if (strlen(config->display) == 0) {
+                const char* env_display = getenv("WAYLAND_DISPLAY");
+                snprintf(config->display, sizeof(config->display), "%s", env_display ? env_display : "wayland-0");
+            }
+            printf("显示: %s\n", config->display);
+            
+            snprintf(app.device, sizeof(app.device), "wayland:%s", config->display);
+            break;
             
         case SERVER_VNC:
             printf("VNC服务器\n");
@@ -933,17 +8983,33 @@ int connect_to_server(ServerConfig* config) {
                 return -1;
             }
             printf("主机: %s:%d\n", config->host, config->port);
-            // 这里可以添加VNC连接代码
-            return 0;
+            
+            snprintf(app.device, sizeof(app.device), "vnc://%s:%d", config->host, config->port);
+            break;
             
         default:
             printf("不支持的服务器类型\n");
             return -1;
     }
+    
+    printf("捕获源: %s (%s)\n", find_capture_source(app.device)->name, app.device);
+    return capture_screen();
 }
 
 void list_available_devices() {
-    printf("可用设备:\n\n");
+    printf("捕获源:\n");
+    for (size_t i = 0; i < CAPTURE_SOURCE_COUNT; i++) {
+        const CaptureSource* source = &capture_sources[i];
+        printf("  %-26s %s: ", source->usage, source->name);
+        if (source->close) {
+            print_capture_caps(source->caps);
+        } else {
+            printf("未启用");
+        }
+        printf("\n");
+    }
+    
+    printf("\n可用设备:\n\n");
     
     // 帧缓冲区
     printf("帧缓冲区:\n");
@@ -956,6 +9022,17 @@ void list_available_devices() {
         }
     }
     
+    // DRM/KMS设备
+    printf("\nDRM设备:\n");
+    for (int i = 0; i < 4; i++) {
+        char device[32];
+        snprintf(device, sizeof(device), "/dev/dri/card%d", i);
+        
+        if (access(device, F_OK) == 0) {
+            printf("  %s\n", device);
+        }
+    }
+    
     // X11显示
     printf("\nX11显示:\n");
     const char* display = getenv("DISPLAY");
@@ -995,6 +9072,10 @@ int main(int argc, char *argv[]) {
     app.display.region_w = 0;
     app.display.region_h = 0;
     
+    strcpy(app.device, "/dev/fb0");
+    app.raw_format = PIXFMT_UNKNOWN;
+    app.replay_speed = 1.0;
+    
     app.server.type = SERVER_FRAMEBUFFER;
     strcpy(app.server.display, ":0");
     app.server.port = 5900;
@@ -1005,10 +9086,13 @@ int main(int argc, char *argv[]) {
     
     // 初始化颜色表
     init_color_table();
+    init_gamma_tables();
+    init_glyph_tables();
     
     // 设置信号处理
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, metrics_signal_handler);
     
     // 解析命令行参数
     static struct option long_options[] = {
@@ -1029,21 +9113,51 @@ int main(int argc, char *argv[]) {
         {"charset", required_argument, 0, 's'},
         {"brightness", required_argument, 0, 'B'},
         {"contrast", required_argument, 0, 'T'},
+        {"sampling", required_argument, 0, 'G'},
         {"server", required_argument, 0, 'S'},
         {"display", required_argument, 0, 'D'},
         {"host", required_argument, 0, 'H'},
         {"port", required_argument, 0, 'P'},
         {"username", required_argument, 0, 'u'},
         {"password", required_argument, 0, 'p'},
+        {"source", required_argument, 0, 'o'},
+        {"mosaic-columns", required_argument, 0, 'M'},
+        {"viewport", required_argument, 0, 'E'},
+        {"config", required_argument, 0, 'F'},
+        {"sixel", no_argument, 0, 'x'},
+        {"frame-geometry", required_argument, 0, 'g'},
+        {"record", required_argument, 0, 'e'},
+        {"replay", required_argument, 0, 'y'},
+        {"replay-speed", required_argument, 0, 'Y'},
+        {"seek", required_argument, 0, 'k'},
+        {"asciicast", required_argument, 0, 'a'},
+        {"status", no_argument, 0, 'L'},
+        {"metrics", required_argument, 0, 'm'},
+        {"serve", required_argument, 0, 'n'},
+        {"serve-cells", required_argument, 0, 'N'},
+        {"view", required_argument, 0, 'W'},
+        {"vnc-trace", required_argument, 0, 'X'},
         {0, 0, 0, 0}
     };
     
     int opt;
-    int option_index = 0;
-    int mode = 0; // 0=help, 1=capture, 2=connect, 3=interactive, 4=benchmark, 5=list
+    int option_index = -1;
+    int mode = 0; // 0=help, 1=capture, 2=connect, 3=interactive, 4=benchmark, 5=list, 6=serve, 7=view
+    
+    static const char optstring[] = "hVcCiblvd:w:H:f:RC:s:B:T:S:D:H:P:u:p:o:M:g:e:y:Y:k:a:Lm:n:N:W:X:G:E:F:x";
+    
+    // 配置文件先于其余命令行参数生效：先用同一套选项扫描一遍，
+    // 这样-F、--config=FILE和缩写的--conf都能识别；错误留给正式解析报告
+    opterr = 0;
+    while ((opt = getopt_long(argc, argv, optstring, long_options, &option_index)) != -1) {
+        if (opt == 'F' && load_config_file(optarg) != 0) {
+            return 1;
+        }
+    }
+    opterr = 1;
+    optind = 1;
     
-    while ((opt = getopt_long(argc, argv, "hVcCiblvd:w:H:f:RC:s:B:T:S:D:H:P:u:p:", 
-                              long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, optstring, long_options, &option_index)) != -1) {
         switch (opt) {
             case 'h':
                 print_help();
@@ -1055,7 +9169,8 @@ int main(int argc, char *argv[]) {
                 mode = 1;
                 break;
             case 'C':
-                if (strcmp(argv[optind-1], "--connect") == 0) {
+                // --connect 不带参数，--color 必须带参数
+                if (!optarg) {
                     mode = 2;
                 } else {
                     // 处理颜色模式
@@ -1079,13 +9194,16 @@ int main(int argc, char *argv[]) {
                 app.verbose = 1;
                 break;
             case 'd':
-                // 设备参数
+                snprintf(app.device, sizeof(app.device), "%s", optarg);
                 break;
             case 'w':
                 app.display.output_width = atoi(optarg);
                 break;
             case 'H':
-                if (strcmp(argv[optind-1], "--height") == 0) {
+                // --height 与 --host 共用短选项，按长选项名区分
+                if (option_index >= 0 && strcmp(long_options[option_index].name, "host") == 0) {
+                    snprintf(app.server.host, sizeof(app.server.host), "%s", optarg);
+                } else {
                     app.display.output_height = atoi(optarg);
                 }
                 break;
@@ -1101,6 +9219,8 @@ int main(int argc, char *argv[]) {
                 else if (strcmp(optarg, "half") == 0) app.display.charset = CHARSET_HALF;
                 else if (strcmp(optarg, "braille") == 0) app.display.charset = CHARSET_BRAILLE;
                 else if (strcmp(optarg, "art") == 0) app.display.charset = CHARSET_ART;
+                else if (strcmp(optarg, "quadrant") == 0) app.display.charset = CHARSET_QUADRANT;
+                else if (strcmp(optarg, "sextant") == 0) app.display.charset = CHARSET_SEXTANT;
                 break;
             case 'B':
                 app.display.brightness = atof(optarg);
@@ -1108,6 +9228,11 @@ int main(int argc, char *argv[]) {
             case 'T':
                 app.display.contrast = atof(optarg);
                 break;
+            case 'G':
+                for (int i = 0; i < (int)(sizeof(sampling_names) / sizeof(sampling_names[0])); i++) {
+                    if (strcmp(optarg, sampling_names[i]) == 0) app.display.sampling = (SamplingMode)i;
+                }
+                break;
             case 'S':
                 if (strcmp(optarg, "fb") == 0) app.server.type = SERVER_FRAMEBUFFER;
                 else if (strcmp(optarg, "x11") == 0) app.server.type = SERVER_X11;
@@ -1121,10 +9246,79 @@ int main(int argc, char *argv[]) {
             case 'P':
                 app.server.port = atoi(optarg);
                 break;
+            case 'u':
+                snprintf(app.server.username, sizeof(app.server.username), "%s", optarg);
+                break;
+            case 'p':
+                snprintf(app.server.password, sizeof(app.server.password), "%s", optarg);
+                break;
+            case 'o':
+                if (parse_source_spec(optarg) != 0) {
+                    return 1;
+                }
+                break;
+            case 'M':
+                app.mosaic_columns = atoi(optarg);
+                break;
+            case 'E':
+                if (parse_viewport_spec(optarg) != 0) {
+                    return 1;
+                }
+                break;
+            case 'F':
+                // 已在解析其他参数之前读取
+                break;
+            case 'x':
+                app.sixel = 1;
+                break;
+            case 'g':
+                if (parse_frame_geometry(optarg) != 0) {
+                    return 1;
+                }
+                break;
+            case 'e':
+                snprintf(app.record_path, sizeof(app.record_path), "%s", optarg);
+                break;
+            case 'y':
+                snprintf(app.device, sizeof(app.device), "%s", optarg);
+                mode = 1;
+                break;
+            case 'Y':
+                app.replay_speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+                break;
+            case 'k':
+                app.replay_seek = atof(optarg);
+                break;
+            case 'a':
+                snprintf(app.asciicast_path, sizeof(app.asciicast_path), "%s", optarg);
+                break;
+            case 'L':
+                app.status_line = 1;
+                break;
+            case 'm':
+                snprintf(app.metrics_addr, sizeof(app.metrics_addr), "%s", optarg);
+                break;
+            case 'n':
+                snprintf(app.serve_addr, sizeof(app.serve_addr), "%s", optarg);
+                mode = 6;
+                break;
+            case 'N':
+                snprintf(app.serve_addr, sizeof(app.serve_addr), "%s", optarg);
+                app.serve_cells = 1;
+                mode = 6;
+                break;
+            case 'W':
+                snprintf(app.view_addr, sizeof(app.view_addr), "%s", optarg);
+                mode = 7;
+                break;
+            case 'X':
+                snprintf(app.vnc_trace_path, sizeof(app.vnc_trace_path), "%s", optarg);
+                break;
             default:
                 print_help();
                 return 1;
         }
+        option_index = -1;
     }
     
     // 如果没有指定模式，显示帮助
@@ -1133,20 +9327,30 @@ int main(int argc, char *argv[]) {
         return 0;
     }
     
+    // 捕获和广播模式可同时提供指标
+    MetricsServer* metrics_server = NULL;
+    if (app.metrics_addr[0] && (mode == 1 || mode == 6)) {
+        metrics_server = metrics_server_start(app.metrics_addr);
+        if (!metrics_server) {
+            return 1;
+        }
+    }
+    
     // 根据模式执行
     switch (mode) {
         case 1: // 捕获模式
             if (!app.verbose) {
                 print_banner();
             }
-            printf("开始捕获屏幕...\n");
-            printf("按 Q 键退出\n\n");
+            capture_screen();
+            break;
+            
+        case 6: // 广播模式
+            serve_mode();
+            break;
             
-            setup_terminal();
-            app.running = 1;
-            pthread_create(&app.capture_thread, NULL, capture_thread_func, &app.display);
-            pthread_join(app.capture_thread, NULL);
-            restore_terminal();
+        case 7: // 查看模式
+            view_mode();
             break;
             
         case 2: // 连接模式
@@ -1178,5 +9382,6 @@ int main(int argc, char *argv[]) {
             break;
     }
     
+    metrics_server_stop(metrics_server);
     return 0;
 }
@@ -12,14 +12,23 @@ fi
 
 # 检查依赖
 echo "检查依赖..."
-if pkg-config --exists x11; then
+if pkg-config --exists x11 xext; then
     echo "✓ 找到 X11 开发库"
-    X11_FLAGS="-DUSE_X11 $(pkg-config --cflags --libs x11)"
+    X11_FLAGS="-DUSE_X11 $(pkg-config --cflags --libs x11 xext)"
 else
-    echo "✗ 未找到 X11 开发库，X11支持将被禁用"
+    echo "✗ 未找到 X11/Xext 开发库，X11支持将被禁用"
     X11_FLAGS=""
 fi
 
+if [ -n "$X11_FLAGS" ]; then
+    if pkg-config --exists xdamage xfixes; then
+        echo "✓ 找到 XDamage 开发库"
+        X11_FLAGS="$X11_FLAGS -DUSE_XDAMAGE $(pkg-config --cflags --libs xdamage xfixes)"
+    else
+        echo "✗ 未找到 XDamage 开发库，X11将按帧率整帧抓取"
+    fi
+fi
+
 if pkg-config --exists wayland-client; then
     echo "✓ 找到 Wayland 开发库"
     WAYLAND_FLAGS="-DUSE_WAYLAND $(pkg-config --cflags --libs wayland-client)"
@@ -28,6 +37,22 @@ else
     WAYLAND_FLAGS=""
 fi
 
+if pkg-config --exists libdrm; then
+    echo "✓ 找到 libdrm 开发库"
+    DRM_FLAGS="-DUSE_DRM $(pkg-config --cflags --libs libdrm)"
+else
+    echo "✗ 未找到 libdrm 开发库，DRM/KMS捕获将被禁用"
+    DRM_FLAGS=""
+fi
+
+if pkg-config --exists zlib; then
+    echo "✓ 找到 zlib 开发库"
+    ZLIB_FLAGS="-DUSE_ZLIB $(pkg-config --cflags --libs zlib)"
+else
+    echo "✗ 未找到 zlib 开发库，字符单元协议将不压缩"
+    ZLIB_FLAGS=""
+fi
+
 # 编译选项
 CFLAGS="-O2 -Wall -Wextra -std=gnu11 -D_GNU_SOURCE"
 LDFLAGS="-lpthread -lm"
@@ -35,7 +60,7 @@ LDFLAGS="-lpthread -lm"
 # 编译
 echo ""
 echo "编译主程序..."
-gcc $CFLAGS $X11_FLAGS $WAYLAND_FLAGS \
+gcc $CFLAGS $X11_FLAGS $WAYLAND_FLAGS $DRM_FLAGS $ZLIB_FLAGS \
     -o graphics_commander \
     graphics_commander.c \
     $LDFLAGS